@@ -0,0 +1,112 @@
+#include "lz_block.h"
+#include <string.h>
+
+#define LZB_HASH_LOG 14
+#define LZB_MIN_MATCH 4
+#define LZB_MAX_OFFSET 65535
+#define LZB_LAST_LITERALS 5 // Matches end at least this far from the end of input.
+#define LZB_MF_LIMIT 12 // No match starts this close to the end of input.
+
+static inline uint32_t lzb_read32(const uint8_t *p)
+{
+    uint32_t ret;
+    memcpy(&ret, p, sizeof(ret));
+    return ret;
+}
+
+static inline uint32_t lzb_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZB_HASH_LOG);
+}
+
+static inline uint8_t *lzb_put_len(uint8_t *op, size_t len)
+{
+    while (len >= 255) *op++ = 255, len -= 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Writes a sequence. offset is 0 for the final, literal-only sequence.
+static inline uint8_t *lzb_put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t l_lit,
+                                   size_t offset, size_t l_match)
+{
+    uint8_t *token;
+    if ((size_t)(oend - op) < 1 + l_lit + l_lit / 255 + 1 + 2 + l_match / 255 + 1) return NULL;
+    token = op++;
+    *token = (uint8_t)((l_lit >= 15 ? 15: l_lit) << 4);
+    if (l_lit >= 15) op = lzb_put_len(op, l_lit - 15);
+    if (l_lit) memcpy(op, lit, l_lit);
+    op += l_lit;
+    if (offset) {
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        l_match -= LZB_MIN_MATCH;
+        *token |= l_match >= 15 ? 15: l_match;
+        if (l_match >= 15) op = lzb_put_len(op, l_match - 15);
+    }
+    return op;
+}
+
+size_t lzb_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+    uint32_t table[1 << LZB_HASH_LOG];
+    const uint8_t *ip = src, *anchor = src, *ref, *mp;
+    const uint8_t *const end = src + n;
+    uint8_t *op = dst, *const oend = dst + cap;
+    uint32_t seq, h;
+    memset(table, 0, sizeof(table));
+    if (n > LZB_MF_LIMIT) {
+        const uint8_t *const mflimit = end - LZB_MF_LIMIT, *const matchlimit = end - LZB_LAST_LITERALS;
+        while (ip < mflimit) {
+            seq = lzb_read32(ip);
+            h = lzb_hash(seq);
+            ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > LZB_MAX_OFFSET || lzb_read32(ref) != seq) {
+                ++ip;
+                continue;
+            }
+            for (mp = ip + LZB_MIN_MATCH, ref += LZB_MIN_MATCH; mp < matchlimit && *mp == *ref; ++mp, ++ref);
+            if ((op = lzb_put_seq(op, oend, anchor, ip - anchor, mp - ref, mp - ip)) == NULL) return 0;
+            ip = anchor = mp;
+        }
+    }
+    if ((op = lzb_put_seq(op, oend, anchor, end - anchor, 0, 0)) == NULL) return 0;
+    return op - dst;
+}
+
+long lzb_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+    const uint8_t *ip = src, *const iend = src + n, *ref;
+    uint8_t *op = dst, *const oend = dst + cap;
+    size_t len, offset;
+    unsigned token, s;
+    while (ip < iend) {
+        token = *ip++;
+        if ((len = token >> 4) == 15) {
+            do {
+                if (ip == iend) return -1;
+                len += (s = *ip++);
+            } while (s == 255);
+        }
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op)) return -1;
+        if (len) memcpy(op, ip, len);
+        op += len, ip += len;
+        if (ip == iend) break; // Final sequence: literals only.
+        if (iend - ip < 2) return -1;
+        offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+        if ((len = token & 15) == 15) {
+            do {
+                if (ip == iend) return -1;
+                len += (s = *ip++);
+            } while (s == 255);
+        }
+        len += LZB_MIN_MATCH;
+        if (len > (size_t)(oend - op)) return -1;
+        // Byte-wise, since the match may overlap the bytes it produces.
+        for (ref = op - offset; len--; *op++ = *ref++);
+    }
+    return op - dst;
+}
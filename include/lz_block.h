@@ -0,0 +1,31 @@
+#ifndef LZ_BLOCK_H
+#define LZ_BLOCK_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal LZ77 block codec for temporary files, in the spirit of LZ4.
+ * A block is a series of sequences, each a token byte (literal length in the high nibble,
+ * match length - 4 in the low nibble, 15 meaning "extended by following bytes until one < 255"),
+ * literals, then a 2-byte little-endian match offset. The final sequence has literals only.
+ * Trades compression ratio for speed: no entropy coding, single-probe hash table.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Worst-case compressed size for n bytes of input. */
+static inline size_t lzb_bound(size_t n) {return n + n / 255 + 16;}
+
+/* Returns the compressed size, or 0 if dst (of capacity cap) is too small. */
+size_t lzb_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+/* Returns the decompressed size, or -1 if src is corrupt or dst (of capacity cap) is too small. */
+long lzb_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LZ_BLOCK_H */
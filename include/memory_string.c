@@ -0,0 +1,20 @@
+#include "memory_string.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+size_t parse_memory_string(const char *str)
+{
+    char *end;
+    size_t ret = strtoull(str, &end, 10);
+    switch(toupper(*end)) {
+        case 'G': ret <<= 10; /* fall-through */
+        case 'M': ret <<= 10; /* fall-through */
+        case 'K': ret <<= 10; break;
+        case '\0': break;
+        default:
+            fprintf(stderr, "[E:%s] Unrecognized memory suffix '%c' in %s. Use K, M, or G.\n", __func__, *end, str);
+            exit(EXIT_FAILURE);
+    }
+    return ret;
+}
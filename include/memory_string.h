@@ -0,0 +1,20 @@
+#ifndef MEMORY_STRING_H
+#define MEMORY_STRING_H
+#include <stddef.h>
+
+/*
+ * Memory sizes given on the command line, shared by the C++ subcommands and sort, which is C.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Parses a memory string with an optional K/M/G suffix. Exits on an unrecognized suffix. */
+size_t parse_memory_string(const char *str);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MEMORY_STRING_H */
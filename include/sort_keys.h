@@ -0,0 +1,49 @@
+#ifndef SORT_KEYS_H
+#define SORT_KEYS_H
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Side index of sort keys written by bmftools sort -K, aligned with the output bam:
+ * entry i holds the keys of record i, so consumers need not re-derive them from tags.
+ * Layout: the 4-byte magic, a uint32_t of flags, then key and mkey as two uint64_t per record.
+ * key is bmfsort_core_key (bmfsort_se_key if SORT_KEYS_SE), mkey is bmfsort_mate_key (0 if SORT_KEYS_SE).
+ * Integers are in host byte order, as the index is meant to be consumed where it was written.
+ */
+
+#define SORT_KEYS_MAGIC "BMFK"
+#define SORT_KEYS_SE 1u
+
+static inline int sort_keys_write_header(FILE *fp, uint32_t flags)
+{
+    return fwrite(SORT_KEYS_MAGIC, 1, 4, fp) == 4 && fwrite(&flags, sizeof(flags), 1, fp) == 1 ? 0: -1;
+}
+
+/* Returns the flags, or -1 if fp does not start with a sort key index header. */
+static inline int64_t sort_keys_read_header(FILE *fp)
+{
+    char magic[4];
+    uint32_t flags;
+    if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, SORT_KEYS_MAGIC, 4) ||
+        fread(&flags, sizeof(flags), 1, fp) != 1)
+        return -1;
+    return flags;
+}
+
+static inline int sort_keys_write1(FILE *fp, uint64_t key, uint64_t mkey)
+{
+    const uint64_t kv[2] = {key, mkey};
+    return fwrite(kv, sizeof(kv), 1, fp) == 1 ? 0: -1;
+}
+
+/* Returns 0 on success, -1 at the end of the index. */
+static inline int sort_keys_read1(FILE *fp, uint64_t *key, uint64_t *mkey)
+{
+    uint64_t kv[2];
+    if (fread(kv, sizeof(kv), 1, fp) != 1) return -1;
+    *key = kv[0], *mkey = kv[1];
+    return 0;
+}
+
+#endif /* SORT_KEYS_H */
@@ -0,0 +1,38 @@
+#include "sort_order.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int change_SO(bam_hdr_t *h, const char *so)
+{
+    char *p, *q, *beg = NULL, *end = NULL, *newtext;
+    if (h->l_text > 3) {
+        if (strncmp(h->text, "@HD", 3) == 0) {
+            if ((p = strchr(h->text, '\n')) == 0) return -1;
+            *p = '\0';
+            if ((q = strstr(h->text, "\tSO:")) != 0) {
+                *p = '\n'; // change back
+                if (strncmp(q + 4, so, p - q - 4) != 0) {
+                    beg = q;
+                    for (q += 4; *q != '\n' && *q != '\t'; ++q);
+                    end = q;
+                } else return 0; // no need to change
+            } else beg = end = p, *p = '\n';
+        }
+    }
+    if (beg == NULL) { // no @HD
+        h->l_text += strlen(so) + 15;
+        newtext = (char*)malloc(h->l_text + 1);
+        sprintf(newtext, "@HD\tVN:1.3\tSO:%s\n", so);
+        strcat(newtext, h->text);
+    } else { // has @HD but different or no SO
+        h->l_text = (beg - h->text) + (4 + strlen(so)) + (h->text + h->l_text - end);
+        newtext = (char*)malloc(h->l_text + 1);
+        strncpy(newtext, h->text, beg - h->text);
+        sprintf(newtext + (beg - h->text), "\tSO:%s", so);
+        strcat(newtext, end);
+    }
+    free(h->text);
+    h->text = newtext;
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef SORT_ORDER_H
+#define SORT_ORDER_H
+#include "htslib/sam.h"
+
+/*
+ * Header sort order, shared by sort, which is C, and markrsq.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sets the SO tag of h's @HD line to so, adding either if missing. Returns -1 on a malformed header. */
+int change_SO(bam_hdr_t *h, const char *so);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SORT_ORDER_H */
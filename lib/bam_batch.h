@@ -0,0 +1,127 @@
+#ifndef BAM_BATCH_H
+#define BAM_BATCH_H
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <omp.h>
+#include "htslib/sam.h"
+#include "dlib/logging_util.h"
+#include "dlib/compiler_util.h"
+
+namespace bmf {
+
+/*
+ * Reads in in batches of up to batch_size records. For each batch, calls apply(b) on every record
+ * across n_threads OpenMP threads, then emit(b, result) on each in input order on the calling thread.
+ * apply must only modify the record it is given, and may use omp_get_thread_num() to find per-thread state.
+ * Its result is stored per record, so it should not be bool, as vector<bool> is not safe to fill in parallel.
+ * BGZF work is left to the thread pool attached to the files.
+ * Returns the number of records read.
+ */
+template<typename Apply, typename Emit>
+uint64_t for_each_batch(samFile *in, bam_hdr_t *hdr, int n_threads, Apply apply, Emit emit,
+                        size_t batch_size=1 << 14)
+{
+    std::vector<bam1_t *> batch(batch_size);
+    std::vector<decltype(apply(batch[0]))> results(batch_size);
+    for(bam1_t *&b: batch) b = bam_init1();
+    uint64_t count(0);
+    size_t n;
+    int ret(0);
+    do {
+        for(n = 0; n < batch_size && (ret = sam_read1(in, hdr, batch[n])) >= 0; ++n);
+        if(UNLIKELY(ret < -1)) LOG_EXIT("Failed to read record %lu. Truncated file? Abort!\n", count + n);
+        #pragma omp parallel for num_threads(n_threads) schedule(static)
+        for(size_t i = 0; i < n; ++i)
+            results[i] = apply(batch[i]);
+        for(size_t i(0); i < n; ++i)
+            emit(batch[i], results[i]);
+        count += n;
+    } while(n == batch_size);
+    for(bam1_t *b: batch) bam_destroy1(b);
+    return count;
+}
+
+/*
+ * Calls fn(b) on each record of in in parallel batches, as for_each_batch does,
+ * and writes those for which fn returned 0 to out in input order,
+ * as dlib::BamHandle::for_each does on one thread.
+ */
+template<typename Fn>
+uint64_t for_each_batched(samFile *in, bam_hdr_t *hdr, samFile *out, int n_threads, Fn fn,
+                          size_t batch_size=1 << 14)
+{
+    uint64_t n_written(0);
+    return for_each_batch(in, hdr, n_threads, fn, [&](bam1_t *b, int fail) {
+        if(fail) return;
+        if(UNLIKELY(sam_write1(out, hdr, b) < 0))
+            LOG_EXIT("Failed to write record %lu. Abort!\n", n_written);
+        ++n_written;
+    }, batch_size);
+}
+
+/*
+ * Paired counterpart of for_each_batched for name-grouped input, pairing records as markrsq does:
+ * each read 2 must directly follow its read 1, and any other record which is not secondary
+ * or supplementary is an error. Secondary and supplementary records are written through unchanged.
+ * Calls fn(r1, r2) on the pairs of each batch across n_threads OpenMP threads,
+ * and writes both reads of each pair for which fn returned 0 to out, with all records in input order.
+ * Returns the number of pairs read.
+ */
+template<typename Fn>
+uint64_t for_each_pair_batched(samFile *in, bam_hdr_t *hdr, samFile *out, int n_threads, Fn fn,
+                               size_t batch_size=1 << 13)
+{
+    std::vector<bam1_t *> recs; // The batch's records in input order. Their buffers are reused by later batches.
+    std::vector<long> pair_of;  // Index into pairs of each record, or -1 for records written through.
+    std::vector<std::pair<size_t, size_t>> pairs(batch_size); // Indices into recs of read 1 and read 2.
+    std::vector<int> fail(batch_size);
+    uint64_t count(0);
+    size_t n, n_recs;
+    int ret(0);
+    do {
+        long r1_at(-1);
+        for(n = n_recs = 0; n < batch_size; ++n_recs) {
+            if(n_recs == recs.size()) recs.push_back(bam_init1()), pair_of.push_back(-1);
+            bam1_t *const b(recs[n_recs]);
+            if((ret = sam_read1(in, hdr, b)) < 0) break;
+            pair_of[n_recs] = -1;
+            if(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
+            switch(b->core.flag & (BAM_FREAD1 | BAM_FREAD2)) {
+            case BAM_FREAD1:
+                if(UNLIKELY(r1_at >= 0))
+                    LOG_EXIT("Read 1 %s has no read 2. Is this bam namesorted?\n", bam_get_qname(recs[r1_at]));
+                r1_at = n_recs;
+                break;
+            case BAM_FREAD2:
+                if(UNLIKELY(r1_at < 0))
+                    LOG_EXIT("Read 2 %s has no preceding read 1. Is this bam namesorted?\n", bam_get_qname(b));
+                if(UNLIKELY(strcmp(bam_get_qname(recs[r1_at]), bam_get_qname(b))))
+                    LOG_EXIT("Read 1 %s is followed by read 2 %s. Is this bam namesorted?\n",
+                             bam_get_qname(recs[r1_at]), bam_get_qname(b));
+                pairs[n] = std::make_pair((size_t)r1_at, n_recs);
+                pair_of[r1_at] = pair_of[n_recs] = n++;
+                r1_at = -1;
+                break;
+            default:
+                LOG_EXIT("Record %s is not read 1 or read 2 of a pair. Is this bam paired-end?\n", bam_get_qname(b));
+            }
+        }
+        if(UNLIKELY(ret < -1)) LOG_EXIT("Failed to read pair %lu. Truncated file? Abort!\n", count + n);
+        if(UNLIKELY(r1_at >= 0)) LOG_EXIT("Read 1 %s has no read 2. Is this bam namesorted?\n", bam_get_qname(recs[r1_at]));
+        #pragma omp parallel for num_threads(n_threads) schedule(static)
+        for(size_t i = 0; i < n; ++i)
+            fail[i] = fn(recs[pairs[i].first], recs[pairs[i].second]);
+        for(size_t i(0); i < n_recs; ++i)
+            if((pair_of[i] < 0 || !fail[pair_of[i]]) && UNLIKELY(sam_write1(out, hdr, recs[i]) < 0))
+                LOG_EXIT("Failed to write record %s. Abort!\n", bam_get_qname(recs[i]));
+        count += n;
+    } while(ret >= 0);
+    for(bam1_t *b: recs) bam_destroy1(b);
+    return count;
+}
+
+} /* namespace bmf */
+
+#endif /* BAM_BATCH_H */
@@ -0,0 +1,45 @@
+#include "lib/bam_shard.h"
+#include <algorithm>
+
+namespace bmf {
+
+// Below this, the cost of seeking to a shard outweighs spreading the work further.
+static const int64_t MIN_SHARD_LEN(1 << 20);
+
+std::vector<BamShard> make_bam_shards(const bam_hdr_t *hdr, int n_threads)
+{
+    std::vector<BamShard> ret;
+    int64_t total(0);
+    for(int i(0); i < hdr->n_targets; ++i) total += hdr->target_len[i];
+    // Several shards per thread, as records cluster on targets rather than spreading evenly.
+    const int64_t len(std::max(MIN_SHARD_LEN, total / (n_threads * 8 + 1)));
+    for(int i(0); i < hdr->n_targets; ++i) {
+        const int64_t tlen(hdr->target_len[i]);
+        for(int64_t beg(0), end; beg < tlen; beg = end) {
+            end = std::min(beg + len, tlen);
+            ret.push_back(BamShard{i, (int)beg, (int)end});
+        }
+    }
+    ret.push_back(BamShard{HTS_IDX_NOCOOR, 0, 0});
+    return ret;
+}
+
+ShardReader::ShardReader(const char *path):
+    fp(sam_open(path, "r")),
+    idx(nullptr),
+    b(bam_init1()),
+    hdr(nullptr)
+{
+    if(fp && (hdr = sam_hdr_read(fp)) != nullptr)
+        idx = sam_index_load(fp, path);
+}
+
+ShardReader::~ShardReader()
+{
+    if(idx) hts_idx_destroy(idx);
+    if(hdr) bam_hdr_destroy(hdr);
+    if(fp) sam_close(fp);
+    bam_destroy1(b);
+}
+
+} /* namespace bmf */
@@ -0,0 +1,108 @@
+#ifndef BAM_SHARD_H
+#define BAM_SHARD_H
+#include <vector>
+#include <omp.h>
+#include "htslib/sam.h"
+#include "dlib/logging_util.h"
+#include "dlib/compiler_util.h"
+
+namespace bmf {
+
+/*
+ * Region of an indexed bam processed by one worker at a time.
+ * tid is HTS_IDX_NOCOOR for the shard holding the records without a reference.
+ */
+struct BamShard {
+    int tid;
+    int beg;
+    int end;
+};
+
+/*
+ * Splits the references in hdr into shards of equal length, enough for n_threads workers
+ * to balance load, followed by one shard for unplaced records.
+ */
+std::vector<BamShard> make_bam_shards(const bam_hdr_t *hdr, int n_threads);
+
+/*
+ * Per-thread handle on an indexed bam. ok() is false if path could not be opened
+ * or has no index, in which case callers should stream the file instead.
+ */
+class ShardReader {
+    samFile *fp;
+    hts_idx_t *idx;
+    bam1_t *b;
+public:
+    bam_hdr_t *hdr;
+    ShardReader(const char *path);
+    ~ShardReader();
+    bool ok() const {return idx != nullptr;}
+    /*
+     * Calls fn(b) on each record overlapping [beg, end) of tid, as returned by the index.
+     * Returns the number of records visited, or -1 on a read error.
+     */
+    template<typename Fn>
+    int64_t query(int tid, int beg, int end, Fn fn) {
+        hts_itr_t *itr(sam_itr_queryi(idx, tid, beg, end));
+        if(UNLIKELY(itr == nullptr)) return -1;
+        int64_t n(0);
+        int ret;
+        while((ret = sam_itr_next(fp, itr, b)) >= 0) {
+            fn(b);
+            ++n;
+        }
+        hts_itr_destroy(itr);
+        return ret == -1 ? n: -1;
+    }
+    /*
+     * Calls fn(b) on each record starting within shard. The index also yields records
+     * which only overlap the shard's start, and those are left to the shard they start in,
+     * so that each record is visited exactly once across a set of shards.
+     * Returns the number of records visited, or -1 on a read error.
+     */
+    template<typename Fn>
+    int64_t read(const BamShard &shard, Fn fn) {
+        int64_t n(0);
+        if(query(shard.tid, shard.beg, shard.end, [&](bam1_t *b) {
+            if(shard.tid >= 0 && b->core.pos < shard.beg) return;
+            fn(b);
+            ++n;
+        }) < 0) return -1;
+        return n;
+    }
+};
+
+/*
+ * Calls fn(b, thread) for every record in the indexed bam at path, using n_threads OpenMP threads
+ * which each open the file and read shards from make_bam_shards until none remain.
+ * thread is in [0, n_threads) so that callers can accumulate into per-thread state
+ * and merge it afterwards; the order in which records are visited is unspecified.
+ * Returns -1 without calling fn if path has no index.
+ */
+template<typename Fn>
+int for_each_sharded(const char *path, int n_threads, Fn fn)
+{
+    std::vector<BamShard> shards;
+    {
+        ShardReader probe(path);
+        if(!probe.ok()) return -1;
+        shards = make_bam_shards(probe.hdr, n_threads);
+    }
+    LOG_DEBUG("Reading %s in %lu shards with %i threads.\n", path, shards.size(), n_threads);
+    #pragma omp parallel num_threads(n_threads)
+    {
+        ShardReader reader(path);
+        const int thread(omp_get_thread_num());
+        if(UNLIKELY(!reader.ok())) LOG_EXIT("Could not open %s and its index. Abort!\n", path);
+        #pragma omp for schedule(dynamic, 1)
+        for(int i = 0; i < (int)shards.size(); ++i)
+            if(UNLIKELY(reader.read(shards[i], [&](bam1_t *b) {fn(b, thread);}) < 0))
+                LOG_EXIT("Failed to read shard %i:%i-%i of %s. Truncated file? Abort!\n",
+                         shards[i].tid, shards[i].beg, shards[i].end, path);
+    }
+    return 0;
+}
+
+} /* namespace bmf */
+
+#endif /* BAM_SHARD_H */
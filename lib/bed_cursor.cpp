@@ -0,0 +1,45 @@
+#include "lib/bed_cursor.h"
+#include <algorithm>
+
+namespace bmf {
+
+BedCursor::BedCursor(khash_t(bed) *bed):
+    cur(nullptr),
+    end(nullptr),
+    tid(-1),
+    pos(0)
+{
+    for(khiter_t k(kh_begin(bed)); k != kh_end(bed); ++k) {
+        if(!kh_exist(bed, k)) continue;
+        const unsigned t(kh_key(bed, k));
+        if(t >= contigs.size()) contigs.resize(t + 1);
+        std::vector<interval_t> &ivs(contigs[t]);
+        for(uint64_t i(0); i < kh_val(bed, k).n; ++i)
+            ivs.push_back(interval_t{(int32_t)get_start(kh_val(bed, k).intervals[i]),
+                                     (int32_t)get_stop(kh_val(bed, k).intervals[i])});
+        std::sort(ivs.begin(), ivs.end(),
+                  [](const interval_t &a, const interval_t &b) {return a.start < b.start;});
+        // Merge overlapping and abutting intervals, which leaves membership unchanged.
+        size_t n(0);
+        for(const interval_t &iv: ivs) {
+            if(n && iv.start <= ivs[n - 1].stop) ivs[n - 1].stop = std::max(ivs[n - 1].stop, iv.stop);
+            else ivs[n++] = iv;
+        }
+        ivs.resize(n);
+    }
+}
+
+void BedCursor::seek(int32_t _tid, int32_t _pos)
+{
+    tid = _tid;
+    if(tid < 0 || (unsigned)tid >= contigs.size()) {
+        cur = end = nullptr;
+        return;
+    }
+    const std::vector<interval_t> &ivs(contigs[tid]);
+    end = ivs.data() + ivs.size();
+    cur = std::upper_bound(ivs.data(), end, _pos,
+                           [](int32_t p, const interval_t &iv) {return p < iv.stop;});
+}
+
+} /* namespace bmf */
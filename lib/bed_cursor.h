@@ -0,0 +1,52 @@
+#ifndef BED_CURSOR_H
+#define BED_CURSOR_H
+#include <cstdint>
+#include <vector>
+#include "htslib/sam.h"
+#include "dlib/bed_util.h"
+#include "dlib/compiler_util.h"
+
+namespace bmf {
+
+/*
+ * Bed membership test for records arriving in coordinate order.
+ * A record is in the bed if [pos, bam_endpos) overlaps an interval, as with dlib::bed_test.
+ * Each contig's intervals are sorted and merged, and the cursor keeps the first
+ * which ends after the last position tested. Positions only grow in a sorted bam,
+ * so the cursor only moves forward and each test is amortized O(1), however many intervals there are.
+ * A record behind the cursor or on another contig repositions it by binary search,
+ * so unsorted input gets the same answers at O(log n) per test.
+ * Holds its own copy of the intervals, so the bed hash may be destroyed afterwards.
+ * Not thread-safe: use one cursor per thread.
+ */
+class BedCursor {
+    struct interval_t {
+        int32_t start;
+        int32_t stop;
+    };
+    std::vector<std::vector<interval_t>> contigs; // Indexed by tid.
+    const interval_t *cur; // First interval of the current contig which ends after the last position tested.
+    const interval_t *end;
+    int32_t tid;
+    int32_t pos;
+    void seek(int32_t _tid, int32_t _pos);
+public:
+    BedCursor(khash_t(bed) *bed);
+    // Copies start at the beginning, so that each thread can have its own.
+    BedCursor(const BedCursor &other): contigs(other.contigs), cur(nullptr), end(nullptr), tid(-1), pos(0) {}
+    BedCursor &operator=(const BedCursor &) = delete;
+    // Returns 1 if [beg, stop) on _tid overlaps an interval, 0 otherwise.
+    int test(int32_t _tid, int32_t beg, int32_t stop) {
+        if(UNLIKELY(_tid != tid || beg < pos)) seek(_tid, beg);
+        pos = beg;
+        while(cur < end && cur->stop <= beg) ++cur;
+        return cur < end && cur->start < stop;
+    }
+    int test(const bam1_t *b) {
+        return test(b->core.tid, b->core.pos, bam_endpos(b));
+    }
+};
+
+} /* namespace bmf */
+
+#endif /* BED_CURSOR_H */
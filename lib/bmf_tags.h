@@ -0,0 +1,89 @@
+#ifndef BMF_TAGS_H
+#define BMF_TAGS_H
+#include <cstring>
+#include "htslib/sam.h"
+#include "dlib/compiler_util.h"
+
+namespace bmf {
+
+/*
+ * Index of a record's BMF tags, built in one pass over its aux block.
+ * Each bam_aux_get call is a linear scan, so looking up several tags per record
+ * with it rescans the block once per tag. get() returns what bam_aux_get would,
+ * a pointer to the tag's type character, or nullptr if the tag is absent.
+ * The index refers into the record and is invalidated by any change to its aux data.
+ */
+class BmfTags {
+public:
+    enum tag_t {FM, FP, RV, DR, NP, MF, AF, PV, FA, KR, SK, N_TAGS};
+private:
+    uint8_t *tags[N_TAGS];
+    static int tag_index(const uint8_t *s) {
+        switch(s[0] << 8 | s[1]) {
+            case 'F' << 8 | 'M': return FM;
+            case 'F' << 8 | 'P': return FP;
+            case 'R' << 8 | 'V': return RV;
+            case 'D' << 8 | 'R': return DR;
+            case 'N' << 8 | 'P': return NP;
+            case 'M' << 8 | 'F': return MF;
+            case 'A' << 8 | 'F': return AF;
+            case 'P' << 8 | 'V': return PV;
+            case 'F' << 8 | 'A': return FA;
+            case 'K' << 8 | 'R': return KR;
+            case 'S' << 8 | 'K': return SK;
+        }
+        return -1;
+    }
+    // Returns the start of the tag after the one whose type character is at s, or nullptr if malformed.
+    static uint8_t *skip(uint8_t *s, const uint8_t *end) {
+        uint32_t n;
+        switch(*s++) {
+            case 'A': case 'c': case 'C': return s + 1;
+            case 's': case 'S': return s + 2;
+            case 'i': case 'I': case 'f': return s + 4;
+            case 'd': return s + 8;
+            case 'Z': case 'H':
+                while(s < end && *s) ++s;
+                return s < end ? s + 1: nullptr;
+            case 'B':
+                if(s + 5 > end) return nullptr;
+                memcpy(&n, s + 1, sizeof(n));
+                switch(*s) {
+                    case 'c': case 'C': return s + 5 + n;
+                    case 's': case 'S': return s + 5 + 2 * n;
+                    case 'i': case 'I': case 'f': return s + 5 + 4 * n;
+                }
+        }
+        return nullptr;
+    }
+public:
+    BmfTags() {memset(tags, 0, sizeof(tags));}
+    explicit BmfTags(const bam1_t *b) {parse(b);}
+    void parse(const bam1_t *b) {
+        memset(tags, 0, sizeof(tags));
+        uint8_t *s(bam_get_aux(b));
+        const uint8_t *const end(b->data + b->l_data);
+        int i;
+        while(s + 3 <= end) {
+            // Keep the first occurrence, as bam_aux_get does.
+            if((i = tag_index(s)) >= 0 && tags[i] == nullptr) tags[i] = s + 2;
+            if(UNLIKELY((s = skip(s + 2, end)) == nullptr)) break;
+        }
+    }
+    uint8_t *get(tag_t tag) const {return tags[tag];}
+    // Integer value of tag, or missing if it is absent.
+    int itag(tag_t tag, int missing=0) const {
+        return tags[tag] ? bam_aux2i(tags[tag]): missing;
+    }
+    double ftag(tag_t tag, double missing=0.) const {
+        return tags[tag] ? bam_aux2f(tags[tag]): missing;
+    }
+    // Contents of a uint32_t array tag such as PV or FA, as from dlib::array_tag.
+    uint32_t *array(tag_t tag) const {
+        return tags[tag] ? (uint32_t *)(tags[tag] + 6): nullptr;
+    }
+};
+
+} /* namespace bmf */
+
+#endif /* BMF_TAGS_H */
@@ -0,0 +1,67 @@
+#ifndef DENSE_HIST_H
+#define DENSE_HIST_H
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+#include "dlib/compiler_util.h"
+
+namespace bmf {
+
+/*
+ * Histogram over small integer keys, such as family sizes.
+ * Keys in [0, max_dense) index a vector which grows to the largest key seen,
+ * so the common case is a bounds check and an increment. Negative and outlying keys
+ * go to an ordered overflow map. Entries equal to T() are treated as absent,
+ * so T needs operator== and operator+=.
+ */
+template<typename T>
+class DenseHist {
+    std::vector<T> dense;
+    std::map<int64_t, T> overflow;
+    int64_t max_dense;
+public:
+    DenseHist(int64_t _max_dense=1 << 16): max_dense(_max_dense) {}
+    T &operator[](int64_t key) {
+        if(LIKELY((uint64_t)key < dense.size())) return dense[key];
+        if(key >= 0 && key < max_dense) {
+            dense.resize(key + 1);
+            return dense[key];
+        }
+        return overflow[key];
+    }
+    // Returns nullptr if key is absent.
+    const T *find(int64_t key) const {
+        if((uint64_t)key < dense.size()) return dense[key] == T() ? nullptr: &dense[key];
+        auto it(overflow.find(key));
+        return it == overflow.end() || it->second == T() ? nullptr: &it->second;
+    }
+    // Adds each entry of o to this one, as when combining per-thread histograms.
+    DenseHist &operator+=(const DenseHist &o) {
+        if(o.dense.size() > dense.size()) dense.resize(o.dense.size());
+        for(size_t i(0); i < o.dense.size(); ++i) dense[i] += o.dense[i];
+        for(const auto &kv: o.overflow) (*this)[kv.first] += kv.second;
+        return *this;
+    }
+    // Calls fn(key, value) for each present entry in ascending order of key.
+    template<typename Fn>
+    void for_each(Fn fn) const {
+        auto it(overflow.cbegin());
+        for(; it != overflow.cend() && it->first < 0; ++it)
+            if(!(it->second == T())) fn(it->first, it->second);
+        for(size_t i(0); i < dense.size(); ++i)
+            if(!(dense[i] == T())) fn((int64_t)i, dense[i]);
+        for(; it != overflow.cend(); ++it)
+            if(!(it->second == T())) fn(it->first, it->second);
+    }
+    // Number of present entries.
+    size_t size() const {
+        size_t ret(0);
+        for_each([&ret](int64_t, const T &) {++ret;});
+        return ret;
+    }
+};
+
+} /* namespace bmf */
+
+#endif /* DENSE_HIST_H */
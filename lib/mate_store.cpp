@@ -0,0 +1,190 @@
+#include "lib/mate_store.h"
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <unistd.h>
+#include "dlib/logging_util.h"
+#include "dlib/compiler_util.h"
+
+namespace bmf {
+
+// Approximate per-entry cost of the hash table itself.
+static const size_t ENTRY_OVERHEAD(sizeof(char *) + 8);
+
+MateStore::MateStore(size_t _max_mem, const char *_prefix, unsigned n_parts):
+    h(kh_init(mate)),
+    mem(0),
+    max_mem(_max_mem),
+    prefix(_prefix ? _prefix: "bmftools_mates"),
+    parts(n_parts ? n_parts: 1, nullptr),
+    n_spills(0),
+    n_spilled(0),
+    level(0)
+{
+}
+
+MateStore::~MateStore()
+{
+    for(khiter_t ki(kh_begin(h)); ki != kh_end(h); ++ki)
+        if(kh_exist(h, ki))
+            free((char *)kh_key(h, ki));
+    kh_destroy(mate, h);
+    for(unsigned i(0); i < parts.size(); ++i) {
+        if(parts[i]) {
+            fclose(parts[i]);
+            unlink(part_path(i).c_str());
+        }
+    }
+}
+
+std::string MateStore::part_path(unsigned i) const
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), ".%.4u.mates", i);
+    return prefix + buf;
+}
+
+char *MateStore::make_blob(const char *key, const char *val, uint32_t len, uint8_t flag)
+{
+    const size_t keylen(strlen(key) + 1);
+    char *ret((char *)malloc(keylen + 1 + sizeof(uint32_t) + len));
+    if(UNLIKELY(!ret)) LOG_EXIT("Could not allocate memory for pending mate. Abort!\n");
+    memcpy(ret, key, keylen);
+    ret[keylen] = flag;
+    memcpy(ret + keylen + 1, &len, sizeof(uint32_t));
+    memcpy(ret + keylen + 1 + sizeof(uint32_t), val, len);
+    return ret;
+}
+
+MateStore::entry_t MateStore::blob_entry(const char *blob)
+{
+    entry_t ret;
+    blob += strlen(blob) + 1;
+    ret.flag = *blob++;
+    memcpy(&ret.len, blob, sizeof(uint32_t));
+    ret.val = blob + sizeof(uint32_t);
+    return ret;
+}
+
+size_t MateStore::blob_size(const char *blob)
+{
+    return strlen(blob) + 1 + 1 + sizeof(uint32_t) + blob_entry(blob).len;
+}
+
+int MateStore::insert(khash_t(mate) *hash, char *blob, const pair_fn &fn)
+{
+    int khr;
+    khiter_t ki(kh_put(mate, hash, blob, &khr));
+    if(khr) return 1; // Stored.
+    char *prev((char *)kh_key(hash, ki));
+    fn(blob, blob_entry(prev), blob_entry(blob));
+    kh_del(mate, hash, ki);
+    free(prev), free(blob);
+    return 0;
+}
+
+void MateStore::add(const char *key, const char *val, uint32_t len, uint8_t flag, const pair_fn &fn)
+{
+    khiter_t ki(kh_get(mate, h, key));
+    if(ki != kh_end(h)) {
+        char *prev((char *)kh_key(h, ki));
+        const entry_t incoming{val, len, flag};
+        fn(key, blob_entry(prev), incoming);
+        mem -= std::min(mem, blob_size(prev) + ENTRY_OVERHEAD);
+        kh_del(mate, h, ki);
+        free(prev);
+        return;
+    }
+    int khr;
+    char *blob(make_blob(key, val, len, flag));
+    kh_put(mate, h, blob, &khr);
+    if((mem += blob_size(blob) + ENTRY_OVERHEAD) > max_mem) spill();
+}
+
+void MateStore::spill()
+{
+    LOG_DEBUG("Spilling %lu pending mates (%lu bytes) to disk.\n", (uint64_t)kh_size(h), (uint64_t)mem);
+    for(khiter_t ki(kh_begin(h)); ki != kh_end(h); ++ki) {
+        if(!kh_exist(h, ki)) continue;
+        char *blob((char *)kh_key(h, ki));
+        const unsigned i(part_of(blob));
+        if(!parts[i] && (parts[i] = fopen(part_path(i).c_str(), "w+b")) == nullptr)
+            LOG_EXIT("Could not open temporary file %s for pending mates. Abort!\n", part_path(i).c_str());
+        const uint32_t size(blob_size(blob));
+        if(fwrite(&size, sizeof(size), 1, parts[i]) != 1 || fwrite(blob, 1, size, parts[i]) != size)
+            LOG_EXIT("Failed to write pending mates to %s. Abort!\n", part_path(i).c_str());
+        free(blob);
+        ++n_spilled;
+    }
+    kh_clear(mate, h);
+    mem = 0;
+    ++n_spills;
+}
+
+uint64_t MateStore::join_part(unsigned i, const pair_fn &fn, const orphan_fn &ofn)
+{
+    uint64_t n_orphans(0);
+    uint32_t size;
+    const long bytes(ftell(parts[i]));
+    rewind(parts[i]);
+    // Past a few levels, the keys are too alike for another split to help.
+    if((size_t)bytes > max_mem && level < 4) {
+        // Stream the partition into a store of its own, which spills and splits it further as needed.
+        MateStore child(max_mem, part_path(i).c_str(), parts.size());
+        child.level = level + 1;
+        while(fread(&size, sizeof(size), 1, parts[i]) == 1) {
+            char *blob((char *)malloc(size));
+            if(UNLIKELY(!blob)) LOG_EXIT("Could not allocate memory for pending mate. Abort!\n");
+            if(fread(blob, 1, size, parts[i]) != size)
+                LOG_EXIT("Truncated temporary file %s. Abort!\n", part_path(i).c_str());
+            const entry_t e(blob_entry(blob));
+            child.add(blob, e.val, e.len, e.flag, fn);
+            free(blob);
+        }
+        n_orphans = child.finish(fn, ofn);
+    } else {
+        khash_t(mate) *tmp(kh_init(mate));
+        while(fread(&size, sizeof(size), 1, parts[i]) == 1) {
+            char *blob((char *)malloc(size));
+            if(UNLIKELY(!blob)) LOG_EXIT("Could not allocate memory for pending mate. Abort!\n");
+            if(fread(blob, 1, size, parts[i]) != size)
+                LOG_EXIT("Truncated temporary file %s. Abort!\n", part_path(i).c_str());
+            insert(tmp, blob, fn);
+        }
+        for(khiter_t ki(kh_begin(tmp)); ki != kh_end(tmp); ++ki) {
+            if(!kh_exist(tmp, ki)) continue;
+            ofn(kh_key(tmp, ki), blob_entry(kh_key(tmp, ki)));
+            free((char *)kh_key(tmp, ki));
+            ++n_orphans;
+        }
+        kh_destroy(mate, tmp);
+    }
+    fclose(parts[i]), parts[i] = nullptr;
+    unlink(part_path(i).c_str());
+    return n_orphans;
+}
+
+uint64_t MateStore::finish(const pair_fn &fn, const orphan_fn &ofn)
+{
+    uint64_t n_orphans(0);
+    if(n_spills) {
+        LOG_INFO("Joining %lu spilled pending mates from %lu spills.\n", n_spilled, n_spills);
+        // Move whatever is still in memory into the partition files so that each can be joined on its own.
+        spill();
+        for(unsigned i(0); i < parts.size(); ++i)
+            if(parts[i]) n_orphans += join_part(i, fn, ofn);
+    } else {
+        for(khiter_t ki(kh_begin(h)); ki != kh_end(h); ++ki) {
+            if(!kh_exist(h, ki)) continue;
+            ofn(kh_key(h, ki), blob_entry(kh_key(h, ki)));
+            free((char *)kh_key(h, ki));
+            ++n_orphans;
+        }
+        kh_clear(mate, h);
+        mem = 0;
+    }
+    return n_orphans;
+}
+
+} /* namespace bmf */
@@ -0,0 +1,76 @@
+#ifndef MATE_STORE_H
+#define MATE_STORE_H
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <functional>
+#include "htslib/khash.h"
+#include "include/memory_string.h"
+
+KHASH_SET_INIT_STR(mate)
+
+namespace bmf {
+
+/*
+ * Keyed store for records waiting on their mates.
+ * Each pending entry is a single allocation laid out as
+ * [key\0][flag (1 byte)][value length (4 bytes)][value],
+ * with the khash key pointing at the start of the blob.
+ * Once the in-memory footprint exceeds max_mem, all pending entries
+ * are spilled to n_parts partition files (by key hash), and are joined
+ * against each other and the remaining in-memory entries by finish().
+ * A partition too large to join within max_mem is itself split by a rehash of its keys.
+ */
+class MateStore {
+public:
+    struct entry_t {
+        const char *val;
+        uint32_t len;
+        uint8_t flag; // Caller-defined. rsq uses it for the read number.
+    };
+    // Called with (key, earlier entry, later entry) when both mates have been found.
+    using pair_fn = std::function<void (const char *, const entry_t &, const entry_t &)>;
+    using orphan_fn = std::function<void (const char *, const entry_t &)>;
+private:
+    khash_t(mate) *h;
+    size_t mem;
+    size_t max_mem;
+    std::string prefix;
+    std::vector<FILE *> parts;
+    uint64_t n_spills;
+    uint64_t n_spilled;
+    unsigned level; // Number of times the keys in this store have already been split.
+    unsigned part_of(const char *key) const {
+        // Salt by level so that a split partition spreads across its children.
+        uint64_t hv(__ac_X31_hash_string(key) + level * 0x9e3779b97f4a7c15uL);
+        hv ^= hv >> 33, hv *= 0xff51afd7ed558ccduL, hv ^= hv >> 33;
+        return hv % parts.size();
+    }
+    std::string part_path(unsigned i) const;
+    void spill();
+    static char *make_blob(const char *key, const char *val, uint32_t len, uint8_t flag);
+    static entry_t blob_entry(const char *blob);
+    static size_t blob_size(const char *blob);
+    // Inserts into hash, or pairs with an existing entry. Takes ownership of blob.
+    static int insert(khash_t(mate) *hash, char *blob, const pair_fn &fn);
+    uint64_t join_part(unsigned i, const pair_fn &fn, const orphan_fn &ofn);
+public:
+    MateStore(size_t max_mem, const char *prefix, unsigned n_parts=16);
+    ~MateStore();
+    // If key's mate is pending, calls fn and drops the entry. Otherwise stores the record.
+    void add(const char *key, const char *val, uint32_t len, uint8_t flag, const pair_fn &fn);
+    void add(const char *key, const std::string &val, uint8_t flag, const pair_fn &fn) {
+        add(key, val.data(), val.size(), flag, fn);
+    }
+    // Joins spilled entries, calling fn for each pair and ofn for each remaining entry.
+    // Returns the number of orphaned entries.
+    uint64_t finish(const pair_fn &fn, const orphan_fn &ofn);
+    size_t size() const {return kh_size(h);}
+    size_t bytes() const {return mem;}
+    uint64_t spills() const {return n_spills;}
+};
+
+} /* namespace bmf */
+
+#endif /* MATE_STORE_H */
@@ -0,0 +1,243 @@
+#include "lib/rescue_sort.h"
+#include <cstdio>
+#include <algorithm>
+#include <functional>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "dlib/bam_util.h"
+#include "dlib/sort_util.h"
+#include "dlib/logging_util.h"
+#include "dlib/compiler_util.h"
+#include "src/bmf_threads.h"
+
+namespace bmf {
+
+RescueSorter::RescueSorter(bam_hdr_t *_hdr, size_t _max_mem, const char *_prefix, int _is_se):
+    mem(0),
+    max_mem(_max_mem),
+    prefix(_prefix ? _prefix: "bmftools_rescue"),
+    hdr(_hdr),
+    is_se(_is_se),
+    i(0),
+    n_added(0)
+{
+}
+
+RescueSorter::~RescueSorter()
+{
+    clear_buffer();
+    for(unsigned j(0); j < runs.size(); ++j) {
+        if(j < fps.size() && fps[j]) sam_close(fps[j]);
+        if(j < heads.size()) bam_destroy1(heads[j]);
+        unlink(runs[j].c_str());
+    }
+}
+
+void RescueSorter::set_keys(const bam1_t *b, uint64_t &key, uint64_t &mkey) const
+{
+    bam1_t *const p(const_cast<bam1_t *>(b));
+    if(is_se) key = bmfsort_se_key(p), mkey = 0;
+    else key = bmfsort_core_key(p), mkey = bmfsort_mate_key(p);
+}
+
+void RescueSorter::add(const bam1_t *b)
+{
+    rec_t rec;
+    set_keys(b, rec.key, rec.mkey);
+    if(UNLIKELY((rec.b = bam_dup1(b)) == nullptr))
+        LOG_EXIT("Could not allocate memory for record buffer. Abort!\n");
+    recs.push_back(rec);
+    ++n_added;
+    if((mem += sizeof(rec_t) + sizeof(bam1_t) + rec.b->m_data) > max_mem) spill();
+}
+
+void RescueSorter::sort_buffer()
+{
+    std::stable_sort(recs.begin(), recs.end(), [](const rec_t &a, const rec_t &b) {
+        return a.key != b.key ? a.key < b.key: a.mkey < b.mkey;
+    });
+}
+
+void RescueSorter::clear_buffer()
+{
+    for(auto &rec: recs) if(rec.b) bam_destroy1(rec.b);
+    recs.clear();
+    mem = 0;
+}
+
+void RescueSorter::spill()
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), ".%.4lu.bam", runs.size());
+    runs.push_back(prefix + buf);
+    LOG_DEBUG("Writing %lu records (%lu bytes) to sorted run %s.\n", recs.size(), mem, runs.back().c_str());
+    sort_buffer();
+    samFile *fp(sam_open(runs.back().c_str(), "wb1"));
+    bmf_thread_pool_attach(fp);
+    if(fp == nullptr || sam_hdr_write(fp, hdr))
+        LOG_EXIT("Could not open temporary file %s for sorted records. Abort!\n", runs.back().c_str());
+    for(auto &rec: recs)
+        if(sam_write1(fp, hdr, rec.b) < 0)
+            LOG_EXIT("Failed to write sorted records to %s. Abort!\n", runs.back().c_str());
+    if(sam_close(fp))
+        LOG_EXIT("Failed to close temporary file %s. Abort!\n", runs.back().c_str());
+    clear_buffer();
+}
+
+void RescueSorter::finalize()
+{
+    if(runs.empty()) {
+        sort_buffer();
+        return;
+    }
+    if(recs.size()) spill();
+    LOG_INFO("Merging %lu sorted runs of %lu records.\n", runs.size(), n_added);
+    for(unsigned j(0); j < runs.size(); ++j) {
+        samFile *fp(sam_open(runs[j].c_str(), "r"));
+        bam_hdr_t *tmp;
+        if(fp == nullptr || (tmp = sam_hdr_read(fp)) == nullptr)
+            LOG_EXIT("Could not read temporary file %s. Abort!\n", runs[j].c_str());
+        bam_hdr_destroy(tmp);
+        bmf_thread_pool_attach(fp);
+        fps.push_back(fp);
+        heads.push_back(bam_init1());
+        if(sam_read1(fp, hdr, heads[j]) >= 0) {
+            head_t h{0, 0, j};
+            set_keys(heads[j], h.key, h.mkey);
+            heap.push_back(h);
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), std::greater<head_t>());
+}
+
+int RescueSorter::next(bam1_t *b)
+{
+    if(runs.empty()) {
+        if(i == recs.size()) return -1;
+        // Hand the buffered record's data over to b rather than copying it.
+        std::swap(*b, *recs[i].b);
+        bam_destroy1(recs[i].b);
+        recs[i++].b = nullptr;
+        return 0;
+    }
+    if(heap.empty()) return -1;
+    std::pop_heap(heap.begin(), heap.end(), std::greater<head_t>());
+    head_t &h(heap.back());
+    std::swap(*b, *heads[h.run]);
+    if(sam_read1(fps[h.run], hdr, heads[h.run]) >= 0) {
+        set_keys(heads[h.run], h.key, h.mkey);
+        std::push_heap(heap.begin(), heap.end(), std::greater<head_t>());
+    } else heap.pop_back();
+    return 0;
+}
+
+// Most partition writers open at once, each holding a file descriptor and BGZF buffers.
+static const unsigned MAX_OPEN_PARTS(256);
+
+static inline uint64_t mix64(uint64_t key)
+{
+    key ^= key >> 33, key *= 0xff51afd7ed558ccduL, key ^= key >> 33;
+    return key;
+}
+
+/*
+ * Partition key of a paired record. It combines the contig, unclipped start and strand of the read
+ * and of its mate, which bmfsort_core_key and bmfsort_mate_key are built from, without regard to which is which.
+ * Records which could share a stack therefore agree, and so do the two mates of a pair,
+ * which keeps both in one partition rather than leaving one pending in rsq's MateStore.
+ */
+static inline uint64_t pair_part_key(const bam1_t *b)
+{
+    bam1_t *const p(const_cast<bam1_t *>(b));
+    const uint64_t self(((uint64_t)(uint32_t)b->core.tid << 32 | (uint32_t)bam_itag(p, "SU")) << 1 | !!(b->core.flag & BAM_FREVERSE));
+    const uint64_t mate(((uint64_t)(uint32_t)b->core.mtid << 32 | (uint32_t)bam_itag(p, "MU")) << 1 | !!(b->core.flag & BAM_FMREVERSE));
+    return mix64(std::min(self, mate) ^ mix64(std::max(self, mate)));
+}
+
+RescuePartitioner::RescuePartitioner(bam_hdr_t *_hdr, unsigned n_parts, size_t _max_mem, const char *_prefix, int _is_se):
+    hdr(_hdr),
+    max_mem(_max_mem),
+    prefix(_prefix ? _prefix: "bmftools_rescue"),
+    is_se(_is_se),
+    cur(0),
+    sorter(nullptr)
+{
+    unsigned max_parts(MAX_OPEN_PARTS);
+    struct rlimit lim;
+    // Leave room below the descriptor limit for the input, output, fastq and sorted runs.
+    if(getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur != RLIM_INFINITY && lim.rlim_cur / 2 < max_parts)
+        max_parts = std::max((unsigned)(lim.rlim_cur / 2), 1u);
+    if(n_parts > max_parts) {
+        LOG_WARNING("Capping %u partitions at %u open at once. Each partition is still sorted within -b.\n", n_parts, max_parts);
+        n_parts = max_parts;
+    }
+    char buf[24];
+    for(unsigned i(0); i < (n_parts ? n_parts: 1); ++i) {
+        snprintf(buf, sizeof(buf), ".part%.4u.bam", i);
+        paths.push_back(prefix + buf);
+    }
+}
+
+RescuePartitioner::~RescuePartitioner()
+{
+    delete sorter;
+    for(const auto &path: paths) unlink(path.c_str());
+}
+
+void RescuePartitioner::partition(samFile *in)
+{
+    std::vector<samFile *> fps;
+    for(const auto &path: paths) {
+        samFile *fp(sam_open(path.c_str(), "wb1"));
+        bmf_thread_pool_attach(fp);
+        if(fp == nullptr || sam_hdr_write(fp, hdr))
+            LOG_EXIT("Could not open temporary partition %s. Abort!\n", path.c_str());
+        fps.push_back(fp);
+    }
+    bam1_t *b(bam_init1());
+    uint64_t count(0), key;
+    while(LIKELY(sam_read1(in, hdr, b) >= 0)) {
+        if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records partitioned: %lu.\n", count);
+        // Mix the keys so that neighboring positions spread across partitions.
+        key = is_se ? mix64(bmfsort_se_key(b)): pair_part_key(b);
+        if(sam_write1(fps[key % fps.size()], hdr, b) < 0)
+            LOG_EXIT("Failed to write to temporary partition %s. Abort!\n", paths[key % fps.size()].c_str());
+    }
+    bam_destroy1(b);
+    for(unsigned i(0); i < fps.size(); ++i)
+        if(sam_close(fps[i]))
+            LOG_EXIT("Failed to close temporary partition %s. Abort!\n", paths[i].c_str());
+    LOG_INFO("Partitioned %lu records into %lu partitions.\n", count, paths.size());
+}
+
+int RescuePartitioner::load_next()
+{
+    delete sorter, sorter = nullptr;
+    if(cur == paths.size()) return -1;
+    const std::string &path(paths[cur++]);
+    samFile *fp(sam_open(path.c_str(), "r"));
+    bam_hdr_t *tmp;
+    if(fp == nullptr || (tmp = sam_hdr_read(fp)) == nullptr)
+        LOG_EXIT("Could not read temporary partition %s. Abort!\n", path.c_str());
+    bam_hdr_destroy(tmp);
+    bmf_thread_pool_attach(fp);
+    sorter = new RescueSorter(hdr, max_mem, path.c_str(), is_se);
+    bam1_t *b(bam_init1());
+    while(sam_read1(fp, hdr, b) >= 0) sorter->add(b);
+    bam_destroy1(b);
+    sam_close(fp);
+    unlink(path.c_str());
+    sorter->finalize();
+    LOG_DEBUG("Loaded %lu records from partition %s.\n", sorter->size(), path.c_str());
+    return 0;
+}
+
+int RescuePartitioner::next(bam1_t *b)
+{
+    do {
+        if(sorter && sorter->next(b) >= 0) return 0;
+    } while(load_next() >= 0);
+    return -1;
+}
+
+} /* namespace bmf */
@@ -0,0 +1,114 @@
+#ifndef RESCUE_SORT_H
+#define RESCUE_SORT_H
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "htslib/sam.h"
+
+namespace bmf {
+
+/*
+ * Source of records already grouped for positional rescue.
+ * next() follows sam_read1's convention: >= 0 on success, < 0 once exhausted.
+ */
+class RescueSource {
+public:
+    virtual ~RescueSource() {}
+    virtual int next(bam1_t *b) = 0;
+};
+
+/*
+ * Sorts records into the positional_rescue order used by bmftools sort -k bmf
+ * (bmfsort_se_key, or bmfsort_core_key then bmfsort_mate_key) without a round trip through sort.
+ * Records are held in memory with their keys precomputed. Once the buffer exceeds max_mem,
+ * it is sorted and written to a temporary BAM run, and the runs are merged by next().
+ * Records with equal keys keep their insertion order, as with sort's merge sort.
+ */
+class RescueSorter: public RescueSource {
+    struct rec_t {
+        uint64_t key;
+        uint64_t mkey;
+        bam1_t *b;
+    };
+    struct head_t {
+        uint64_t key;
+        uint64_t mkey;
+        unsigned run;
+        bool operator>(const head_t &o) const {
+            return key != o.key ? key > o.key: mkey != o.mkey ? mkey > o.mkey: run > o.run;
+        }
+    };
+    std::vector<rec_t> recs;
+    size_t mem;
+    size_t max_mem;
+    std::string prefix;
+    bam_hdr_t *hdr;
+    int is_se;
+    size_t i; // Cursor into recs when no runs were written.
+    std::vector<std::string> runs;
+    std::vector<samFile *> fps;
+    std::vector<bam1_t *> heads;
+    std::vector<head_t> heap;
+    uint64_t n_added;
+    void sort_buffer();
+    void spill();
+    void clear_buffer();
+protected:
+    virtual void set_keys(const bam1_t *b, uint64_t &key, uint64_t &mkey) const;
+public:
+    RescueSorter(bam_hdr_t *hdr, size_t max_mem, const char *prefix, int is_se);
+    virtual ~RescueSorter();
+    // Copies b into the buffer, spilling a sorted run if the buffer is full.
+    void add(const bam1_t *b);
+    // Call once all records have been added and before next().
+    void finalize();
+    int next(bam1_t *b) override;
+    uint64_t size() const {return n_added;}
+    size_t spills() const {return runs.size();}
+};
+
+/*
+ * Sorts records by the coordinate of their mates, in the order of a coordinate-sorted bam,
+ * so that a second pass over that bam meets each record's copy where it reaches its mate.
+ * Used by bmftools mark to pair reads in coordinate-sorted input without a name sort.
+ */
+class MateSorter: public RescueSorter {
+protected:
+    void set_keys(const bam1_t *b, uint64_t &key, uint64_t &mkey) const override {
+        key = pos_key(b->core.mtid, b->core.mpos), mkey = 0;
+    }
+public:
+    MateSorter(bam_hdr_t *hdr, size_t max_mem, const char *prefix): RescueSorter(hdr, max_mem, prefix, 0) {}
+    // Sort key of a coordinate-sorted bam, as in samtools sort, without the strand.
+    static uint64_t pos_key(int32_t tid, int32_t pos) {
+        return (uint64_t)(uint32_t)tid << 32 | (uint32_t)(pos + 1);
+    }
+};
+
+/*
+ * Groups records for rescue without a full sort. Records are hashed on the fields of
+ * the keys RescueSorter orders by into n_parts temporary bams, so that all records which could share a stack
+ * land in the same partition, as do both mates of a pair. Each partition is then sorted on its own in a RescueSorter.
+ * n_parts is capped so that the partition writers, all open at once, stay well under the descriptor limit.
+ * Input order does not matter, so coordinate-sorted or unsorted bams can be used directly.
+ */
+class RescuePartitioner: public RescueSource {
+    bam_hdr_t *hdr;
+    size_t max_mem;
+    std::string prefix;
+    int is_se;
+    std::vector<std::string> paths;
+    unsigned cur;
+    RescueSorter *sorter;
+    int load_next();
+public:
+    RescuePartitioner(bam_hdr_t *hdr, unsigned n_parts, size_t max_mem, const char *prefix, int is_se);
+    ~RescuePartitioner();
+    // Reads in to completion, writing each record to its partition.
+    void partition(samFile *in);
+    int next(bam1_t *b) override;
+};
+
+} /* namespace bmf */
+
+#endif /* RESCUE_SORT_H */
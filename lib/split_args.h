@@ -0,0 +1,32 @@
+#ifndef SPLIT_ARGS_H
+#define SPLIT_ARGS_H
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace bmf {
+
+/*
+ * Splits a quoted command line on whitespace into a nullptr-terminated argv, as for getopt.
+ * The words are kept in words, which must outlive the argv and anything parsed from it,
+ * as options keep pointers into them.
+ */
+static inline std::vector<char *> split_args(const char *cmd, std::vector<std::string> &words)
+{
+    std::vector<char *> ret;
+    const char *const ws(" \t\n");
+    const char *p(cmd + strspn(cmd, ws));
+    while(*p) {
+        const size_t len(strcspn(p, ws));
+        words.emplace_back(p, len);
+        p += len;
+        p += strspn(p, ws);
+    }
+    for(auto &word: words) ret.push_back(&word[0]);
+    ret.push_back(nullptr);
+    return ret;
+}
+
+} /* namespace bmf */
+
+#endif /* SPLIT_ARGS_H */
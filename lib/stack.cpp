@@ -192,23 +192,25 @@ void UniqueObservation::add_obs(const bam_pileup1_t& plp, stack_aux_t *aux) {
     for(auto tag: {"PV", "FA"})
         if(!bam_aux_get(plp.b, tag)) LOG_WARNING("Missing tag %s.\n", tag);
 #endif
-    size += bam_itag(plp.b, "FM");
+    const BmfTags tags(plp.b);
+    uint32_t *const FA(tags.array(BmfTags::FA)), *const PV(tags.array(BmfTags::PV));
+    size += tags.itag(BmfTags::FM);
     base2 = plp_bc(plp);
     cycle2 = dlib::arr_qpos(&plp);
     mq2 = (uint32_t)plp.b->core.qual;
     is_reverse2 = bam_is_rev(plp.b);
     is_overlap = 1;
-    rv += (uint32_t)dlib::int_tag_zero(plp.b, "RV");
+    rv += (uint32_t)tags.itag(BmfTags::RV);
     if(base2 == base1) {
         discordant = 0;
-        agreed += ((uint32_t *)dlib::array_tag(plp.b, "FA"))[cycle2];
-        quality = agreed_pvalues(quality, ((uint32_t *)dlib::array_tag(plp.b, "PV"))[cycle2]);
+        agreed += FA[cycle2];
+        quality = agreed_pvalues(quality, PV[cycle2]);
         pvalue = std::pow(10, -0.1 * quality);
     } else if(base1 == 'N') {
         discordant = 0;
         base_call = base2;
-        agreed = ((uint32_t *)dlib::array_tag(plp.b, "FA"))[cycle2];
-        quality = ((uint32_t *)dlib::array_tag(plp.b, "PV"))[cycle2];
+        agreed = FA[cycle2];
+        quality = PV[cycle2];
         pvalue = std::pow(10, -0.1 * quality);
     } else if(base2 != 'N') {
         discordant = 1;
@@ -4,6 +4,7 @@
 #include <unordered_map>
 #include "dlib/bam_util.h"
 #include "dlib/vcf_util.h"
+#include "lib/bmf_tags.h"
 
 
 #define DEFAULT_MAX_DEPTH (1 << 18)
@@ -100,16 +101,20 @@ public:
         return is_duplex1 + (mate_added() ? is_duplex2: 0);
     }
     UniqueObservation(const bam_pileup1_t& plp, stack_aux_t *aux):
+        UniqueObservation(plp, aux, BmfTags(plp.b))
+    {
+    }
+    UniqueObservation(const bam_pileup1_t& plp, stack_aux_t *aux, const BmfTags &tags):
         qname(bam_get_qname(plp.b)),
         cycle1(dlib::arr_qpos(&plp)),
         cycle2(-1),
-        quality(((uint32_t *)dlib::array_tag(plp.b, "PV"))[cycle1]),
+        quality(tags.array(BmfTags::PV)[cycle1]),
         mq1(plp.b->core.qual),
         mq2((uint8_t)-1),
-        rv(dlib::int_tag_zero(bam_aux_get(plp.b, "RV"))),
+        rv(tags.itag(BmfTags::RV)),
         md(get_mismatch_density(plp, aux)),
         discordant(0),
-        is_duplex1(dlib::int_tag_zero(bam_aux_get(plp.b, "DR"))),
+        is_duplex1(tags.itag(BmfTags::DR)),
         is_duplex2(0),
         is_reverse1((plp.b->core.flag & BAM_FREVERSE) != 0),
         is_reverse2(0),
@@ -120,8 +125,8 @@ public:
         base1(seq_nt16_str[bam_seqi(bam_get_seq(plp.b), plp.qpos)]),
         base2('\0'),
         base_call(base1),
-        agreed(((uint32_t *)dlib::array_tag(plp.b, "FA"))[cycle1]),
-        size(bam_itag(plp.b, "FM"))
+        agreed(tags.array(BmfTags::FA)[cycle1]),
+        size(tags.itag(BmfTags::FM))
     {
     }
     void add_obs(const bam_pileup1_t& plp, stack_aux_t *aux);
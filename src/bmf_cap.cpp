@@ -1,5 +1,10 @@
 #include <getopt.h>
+#include <algorithm>
+#include <cmath>
 #include "dlib/bam_util.h"
+#include "lib/bam_batch.h"
+#include "lib/bmf_tags.h"
+#include "bmf_threads.h"
 
 namespace bmf {
 
@@ -15,6 +20,7 @@ static int cap_usage() {
                     "-f: set minimum fraction agreed. [double].\n"
                     "-t: set maximum permitted phred score. [int, coerced to char].\n"
                     "-d: Flag to use existing quality scores instead of setting all below a threshold to 2.\n"
+                    "Records are capped in batches across the threads set by bmftools -@, and written in input order.\n"
                     "Set output.bam to \'-\' or \'stdout\' to pipe results.\n"
                     "Set input.csrt.bam to \'-\' or \'stdin\' to read from stdin.\n"
             );
@@ -30,55 +36,53 @@ struct cap_settings_t {
 };
 
 
-static inline int cap_bam_dnd(bam1_t *b, cap_settings_t *settings) {
-    int i;
-    uint32_t *PV((uint32_t *)dlib::array_tag(b, "PV"));
-    uint32_t *FA((uint32_t *)dlib::array_tag(b, "FA"));
-    const int FM(bam_itag(b, "FM"));
-    if(FM < settings->minFM)
-        return 1;
-    const int l_qseq(b->core.l_qseq);
-    char *qual((char *)bam_get_qual(b));
-    if(b->core.flag & BAM_FREVERSE) {
-        for(i = 0; i < l_qseq; ++i) {
-            if(PV[i] >= settings->minPV && static_cast<double>(FA[i]) / FM >= settings->minFrac) {
-                qual[l_qseq - 1 - i] = settings->cap;
-            }
-        }
-    } else {
-        for(i = 0; i < l_qseq; ++i)
-            if(PV[i] >= settings->minPV && static_cast<double>(FA[i]) / FM >= settings->minFrac)
-                qual[i] = settings->cap;
+/*
+ * Smallest FA for which static_cast<double>(FA) / FM >= minFrac, so that the per-base test needs no division.
+ * Returns more than UINT32_MAX if no FA passes.
+ */
+static inline uint64_t cap_min_fa(double minFrac, int FM)
+{
+    if(FM <= 0) return 1; // FA / 0 is infinite, except for 0 / 0, which is NaN and fails.
+    if(minFrac <= 0.) return 0;
+    const double t(std::ceil(minFrac * FM));
+    if(t > (double)UINT32_MAX) return (uint64_t)UINT32_MAX + 1;
+    uint64_t ret(t);
+    // Correct for rounding in minFrac * FM, so that this matches the division exactly.
+    while(ret && static_cast<double>(ret - 1) / FM >= minFrac) --ret;
+    while(ret <= UINT32_MAX && static_cast<double>(ret) / FM < minFrac) ++ret;
+    return ret;
+}
+
+
+/*
+ * Sets each base's quality to cap if its PV and FA pass and otherwise to 2, or leaves it be if dnd.
+ * PV and FA are in sequencing order, so a reverse-strand read's qualities are flipped around the loop,
+ * which is branch-free so that the comparisons over the uint32 arrays vectorize.
+ */
+static inline void cap_kernel(char *qual, const uint32_t *PV, const uint32_t *FA, int l_qseq,
+                              uint32_t minPV, uint64_t minFA, char cap, int dnd, int rev)
+{
+    const uint32_t fa(minFA > UINT32_MAX ? UINT32_MAX: minFA);
+    const int possible(minFA <= UINT32_MAX);
+    if(rev) std::reverse(qual, qual + l_qseq);
+    #pragma omp simd
+    for(int i = 0; i < l_qseq; ++i) {
+        const int pass(possible & (PV[i] >= minPV) & (FA[i] >= fa));
+        qual[i] = pass ? cap: dnd ? qual[i]: 2;
     }
-    return 0;
+    if(rev) std::reverse(qual, qual + l_qseq);
 }
 
 
-static inline int cap_bam_q(bam1_t *b, cap_settings_t *settings) {
-    uint32_t *const PV((uint32_t *)dlib::array_tag(b, "PV"));
-    uint32_t *const FA((uint32_t *)dlib::array_tag(b, "FA"));
-    const int FM(bam_itag(b, "FM"));
-    if(FM < (int)settings->minFM)
+/* Returns 1 to drop reads with FM < minFM, 0 otherwise, to match for_each. */
+static inline int cap_bam(bam1_t *b, const cap_settings_t *settings) {
+    const BmfTags tags(b);
+    const int FM(tags.itag(BmfTags::FM));
+    if(FM < settings->minFM)
         return 1;
-    char *qual((char *)bam_get_qual(b));
-    int i(0);
-    // If the thresholds are failed, set the quality to 2 to make them
-    if(b->core.flag & BAM_FREVERSE) {
-        int l_qseq(b->core.l_qseq);
-        for(; l_qseq >= 0; ++i) {
-            if(PV[i] >= settings->minPV && static_cast<double>(FA[i]) / FM >= settings->minFrac)
-                qual[--l_qseq] = settings->cap;
-            else
-                qual[--l_qseq] = 2;
-        }
-    } else {
-        for(; i < b->core.l_qseq; ++i) {
-            if(PV[i] >= settings->minPV && static_cast<double>(FA[i]) / FM >= settings->minFrac) 
-                qual[i] = settings->cap;
-            else
-                qual[i] = 2;
-        }
-    }
+    cap_kernel((char *)bam_get_qual(b), tags.array(BmfTags::PV), tags.array(BmfTags::FA), b->core.l_qseq,
+               settings->minPV, cap_min_fa(settings->minFrac, FM), settings->cap, settings->dnd,
+               b->core.flag & BAM_FREVERSE);
     return 0;
 }
 
@@ -118,16 +122,15 @@ int cap_main(int argc, char *argv[])
         fprintf(stderr, "[E:%s] All caps cannot be set to 0 (default values). [Required parameter] See usage.\n", __func__);
         return cap_usage();
     }
-    int ret(dlib::bam_apply_function(argv[optind], argv[optind+1],
-                                     settings.dnd ? (single_aux_fn)&cap_bam_dnd
-                                                  : (single_aux_fn)&cap_bam_q,
-                                     (void *)&settings, wmode));
-    if(ret) {
-        fprintf(stderr, "bmftools cap returned non-zero exit status %i.\n", ret);
-        return ret;
-    }
-    LOG_INFO("Successfully completed bmftools cap!\n");
-    return ret;
+    dlib::BamHandle in(argv[optind]);
+    dlib::BamHandle out(argv[optind + 1], in.header, wmode);
+    bmf_thread_pool_attach(in.fp);
+    bmf_thread_pool_attach(out.fp);
+    const int n_threads(std::max(1, bmf_thread_pool_size()));
+    const uint64_t count(for_each_batched(in.fp, in.header, out.fp, n_threads,
+                                          [&settings](bam1_t *b) {return cap_bam(b, &settings);}));
+    LOG_INFO("Successfully completed bmftools cap on %lu records!\n", count);
+    return EXIT_SUCCESS;
 }
 
 } /* namespace bmf */
@@ -12,6 +12,8 @@
 #include "dlib/bam_util.h"
 #include "dlib/cstr_util.h"
 #include "dlib/io_util.h"
+#include "lib/bmf_tags.h"
+#include "bmf_threads.h"
 
 namespace bmf {
 
@@ -179,7 +181,8 @@ static int read_bam(void *data, bam1_t *b)
     {
         ret = aux->iter? sam_itr_next(aux->fp, aux->iter, b) : sam_read1(aux->fp, aux->header, b);
         if ( ret<0 ) break;
-        uint8_t *data(bam_aux_get(b, "FM")), *fpdata(bam_aux_get(b, "FP"));
+        const BmfTags tags(b);
+        uint8_t *data(tags.get(BmfTags::FM)), *fpdata(tags.get(BmfTags::FP));
         if ((b->core.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP)) ||
             b->core.qual < aux->minmq || (data && bam_aux2i(data) < aux->minFM) ||
             (aux->requireFP && fpdata && bam_aux2i(fpdata) == 0))
@@ -241,6 +244,7 @@ int depth_main(int argc, char *argv[])
         aux[i]->minFM = minFM;
         aux[i]->requireFP = requireFP;
         aux[i]->fp = sam_open(argv[i + optind], "r");
+        bmf_thread_pool_attach(aux[i]->fp);
         aux[i]->depth_hash = kh_init(depth);
         if (aux[i]->fp)
             idx[i] = sam_index_load(aux[i]->fp, argv[i + optind]);
@@ -6,6 +6,10 @@
 #include "dlib/bam_util.h"
 #include "lib/kingfisher.h"
 #include "lib/rescaler.h"
+#include "lib/dense_hist.h"
+#include "lib/bmf_tags.h"
+#include "bmf_qc.h"
+#include "bmf_threads.h"
 
 extern void dlib::check_bam_tag_exit(char *bampath, const char *tag);
 
@@ -44,6 +48,11 @@ struct fullerr_t {
 struct obserr_t {
     uint64_t obs;
     uint64_t err;
+    obserr_t &operator+=(const obserr_t &o) {
+        obs += o.obs, err += o.err;
+        return *this;
+    }
+    bool operator==(const obserr_t &o) const {return obs == o.obs && err == o.err;}
 };
 
 class RegionErr {
@@ -98,6 +107,7 @@ public:
             max_depth(max_depth)
     {
         if(!fp || !hdr) LOG_EXIT("Could not open input sam file %s. Abort!\n", bampath);
+        bmf_thread_pool_attach(fp);
         if(!bam_index) LOG_EXIT("Could not read bam index for sam file %s. Abort!\n", fp->fn);
     }
     ~RegionExpedition() {
@@ -112,12 +122,9 @@ public:
     }
 };
 
-KHASH_MAP_INIT_INT(obs, obserr_t)
-KHASH_SET_INIT_INT(obs_union)
-
 struct fmerr_t {
-    khash_t(obs) *hash1;
-    khash_t(obs) *hash2;
+    DenseHist<obserr_t> *hist1; // Observations and errors by family size for read 1.
+    DenseHist<obserr_t> *hist2;
     khash_t(bed) *bed;
     char *bedpath;
     char *refcontig;
@@ -188,24 +195,22 @@ RegionErr::RegionErr(region_set_t set, int i):
 }
 
 
-uint64_t get_max_obs(khash_t(obs) *hash)
+uint64_t get_max_obs(const DenseHist<obserr_t> *hist)
 {
     uint64_t ret(0);
-    for(khiter_t k(kh_begin(hash)); k != kh_end(hash); ++k)
-        if(kh_exist(hash, k))
-            if(kh_val(hash, k).obs > ret)
-                ret = kh_val(hash, k).obs;
+    hist->for_each([&ret](int64_t, const obserr_t &o) {
+        if(o.obs > ret) ret = o.obs;
+    });
     return ret;
 }
 
 
-uint64_t get_max_err(khash_t(obs) *hash)
+uint64_t get_max_err(const DenseHist<obserr_t> *hist)
 {
     uint64_t ret(0);
-    for(khiter_t k(kh_begin(hash)); k != kh_end(hash); ++k)
-        if(kh_exist(hash, k))
-            if(kh_val(hash, k).err > ret)
-                ret = kh_val(hash, k).err;
+    hist->for_each([&ret](int64_t, const obserr_t &o) {
+        if(o.err > ret) ret = o.err;
+    });
     return ret;
 }
 
@@ -304,18 +309,13 @@ void write_final(FILE *fp, fullerr_t *e)
 
 void err_fm_report(FILE *fp, fmerr_t *f)
 {
-    int khr, fm;
-    khiter_t k, k1, k2;
-    // Make a set of all FMs to print out.
-    khash_t(obs_union) *key_union(kh_init(obs_union));
-    for(k1 = kh_begin(f->hash1); k1 != kh_end(f->hash1); ++k1)
-        if(kh_exist(f->hash1, k1))
-            if((k = kh_get(obs_union, key_union, kh_key(f->hash1, k1))) == kh_end(key_union))
-                k = kh_put(obs_union, key_union, kh_key(f->hash1, k1), &khr);
-    for(k2 = kh_begin(f->hash2); k2 != kh_end(f->hash2); ++k2)
-        if(kh_exist(f->hash2, k2))
-            if((k = kh_get(obs_union, key_union, kh_key(f->hash2, k2))) == kh_end(key_union))
-                k = kh_put(obs_union, key_union, kh_key(f->hash2, k2), &khr);
+    // Make a sorted set of all FMs to print out.
+    std::vector<int64_t> fms;
+    auto add_key = [&fms](int64_t fm, const obserr_t &) {fms.push_back(fm);};
+    f->hist1->for_each(add_key);
+    f->hist2->for_each(add_key);
+    std::sort(fms.begin(), fms.end());
+    fms.erase(std::unique(fms.begin(), fms.end()), fms.end());
 
     // Write  header
     fprintf(fp, "##PARAMETERS\n##refcontig:\"%s\"\n##bed:\"%s\"\n"
@@ -325,30 +325,21 @@ void err_fm_report(FILE *fp, fmerr_t *f)
             f->flag & REFUSE_DUPLEX ? "True": "False");
     fprintf(fp, "##STATS\n##nread:%" PRIu64 "\n##nskipped:%" PRIu64 "\n", f->nread, f->nskipped);
     fprintf(fp, "#FM\tRead 1 Error\tRead 2 Error\tRead 1 Errors\tRead 1 Counts\tRead 2 Errors\tRead 2 Counts\n");
-    int *tmp((int *)malloc(key_union->n_occupied * sizeof(int)));
-    for(k = kh_begin(key_union), khr = 0; k != kh_end(key_union); ++k)
-        if(kh_exist(key_union, k))
-            tmp[khr++] = kh_key(key_union, k);
-    std::sort(tmp, tmp + key_union->n_occupied);
-    for(unsigned i(0); i < key_union->n_occupied; ++i) {
-        fm = tmp[i];
-        fprintf(fp, "%i\t", fm);
-
-        if((k1 = kh_get(obs, f->hash1, fm)) == kh_end(f->hash1)) fprintf(fp, "-nan\t");
-        else fprintf(fp, "%0.12f\t", (double)kh_val(f->hash1, k1).err / kh_val(f->hash1, k1).obs);
-
-        if((k2 = kh_get(obs, f->hash2, fm)) == kh_end(f->hash2)) fprintf(fp, "-nan\t");
-        else fprintf(fp, "%0.12f\t", (double)kh_val(f->hash2, k2).err / kh_val(f->hash2, k2).obs);
-
-        if(k1 != kh_end(f->hash1))
-            fprintf(fp, "%" PRIu64 "\t%" PRIu64 "\t", kh_val(f->hash1, k1).err, kh_val(f->hash1, k1).obs);
+    for(const int64_t fm: fms) {
+        fprintf(fp, "%i\t", (int)fm);
+        const obserr_t *const o1(f->hist1->find(fm)), *const o2(f->hist2->find(fm));
+
+        if(!o1) fprintf(fp, "-nan\t");
+        else fprintf(fp, "%0.12f\t", (double)o1->err / o1->obs);
+
+        if(!o2) fprintf(fp, "-nan\t");
+        else fprintf(fp, "%0.12f\t", (double)o2->err / o2->obs);
+
+        if(o1) fprintf(fp, "%" PRIu64 "\t%" PRIu64 "\t", o1->err, o1->obs);
         else fputs("0\t0\t", fp);
-        if(k2 != kh_end(f->hash2))
-            fprintf(fp, "%" PRIu64 "\t%" PRIu64 "\n", kh_val(f->hash2, k2).err, kh_val(f->hash2, k2).obs);
+        if(o2) fprintf(fp, "%" PRIu64 "\t%" PRIu64 "\n", o2->err, o2->obs);
         else fputs("0\t0\n", fp);
     }
-    free(tmp);
-    kh_destroy(obs_union, key_union);
 }
 
 
@@ -412,14 +403,15 @@ void err_fm_core(char *fname, faidx_t *fai, fmerr_t *f, htsFormat *open_fmt)
     samFile *fp(sam_open(fname, "r"));
     bam_hdr_t *hdr(sam_hdr_read(fp));
     if (!hdr) LOG_EXIT("Failed to read input header from bam %s. Abort!\n", fname);
+    bmf_thread_pool_attach(fp);
     bam1_t *b(bam_init1());
-    int32_t cycle, ind, s, i, fc, rc, r, khr, DR, FP, FM,
+    int32_t cycle, ind, s, i, fc, rc, r, DR, FP, FM,
            reflen, length, pos, tid_to_study(-1), last_tid(-1);
     char *ref(nullptr); // Will hold the sequence for a  chromosome
-    khash_t(obs) *hash;
+    DenseHist<obserr_t> *hist;
+    obserr_t *counts;
     uint8_t *seq;
     uint32_t *cigar, *pv_array, *fa_array;
-    khiter_t k;
     if(f->refcontig) {
         for(int i(0); i < hdr->n_targets; ++i) {
             if(!strcmp(hdr->target_name[i], f->refcontig)) {
@@ -430,12 +422,12 @@ void err_fm_core(char *fname, faidx_t *fai, fmerr_t *f, htsFormat *open_fmt)
     }
     while(LIKELY((r = sam_read1(fp, hdr, b)) != -1)) {
         if(++f->nread % 1000000 == 0) LOG_INFO("Records read: %" PRIu64 ".\n", f->nread);
-        pv_array = (uint32_t *)dlib::array_tag(b, "PV");
-        fa_array = (uint32_t *)dlib::array_tag(b, "FA");
-        FM = (seq = bam_aux_get(b, "FM")) ? bam_aux2i(seq): 1;
-        FM = dlib::int_tag_zero(b, "FM");
-        DR = dlib::int_tag_zero(b, "DR");
-        FP = dlib::int_tag_zero(b, "FP");
+        const BmfTags tags(b);
+        pv_array = tags.array(BmfTags::PV);
+        fa_array = tags.array(BmfTags::FA);
+        FM = tags.itag(BmfTags::FM);
+        DR = tags.itag(BmfTags::DR);
+        FP = tags.itag(BmfTags::FP);
         // Pass reads without FP tag.
         if(b->core.flag & (BAM_FSECONDARY | BAM_FUNMAP | BAM_FQCFAIL | BAM_FDUP)) {
             ++f->nskipped;
@@ -471,7 +463,7 @@ void err_fm_core(char *fname, faidx_t *fai, fmerr_t *f, htsFormat *open_fmt)
         }
         seq = (uint8_t *)bam_get_seq(b);
         cigar = bam_get_cigar(b);
-        hash = (b->core.flag & BAM_FREAD1) ? f->hash1: f->hash2;
+        hist = (b->core.flag & BAM_FREAD1) ? f->hist1: f->hist2;
         if(b->core.tid != last_tid) {
             last_tid = b->core.tid;
             cond_free(ref);
@@ -480,10 +472,7 @@ void err_fm_core(char *fname, faidx_t *fai, fmerr_t *f, htsFormat *open_fmt)
                 LOG_EXIT("[Failed to load ref sequence for contig '%s'. Abort!\n", hdr->target_name[b->core.tid]);
         }
         pos = b->core.pos;
-        if((k = kh_get(obs, hash, FM)) == kh_end(hash)) {
-            k = kh_put(obs, hash, FM, &khr);
-            memset(&kh_val(hash, k), 0, sizeof(obserr_t));
-        }
+        counts = &(*hist)[FM];
         for(i = 0, rc = 0, fc = 0; i < b->core.n_cigar; ++i) {
             length = bam_cigar_oplen(cigar[i]);
             switch(bam_cigar_type(cigar[i])) {
@@ -501,9 +490,9 @@ void err_fm_core(char *fname, faidx_t *fai, fmerr_t *f, htsFormat *open_fmt)
                         cycle = b->core.l_qseq - 1 - ind - rc;
                         if(pv_array[cycle] < f->minPV) continue;
                         if(static_cast<double>(fa_array[cycle]) / FM < f->min_fr) continue;
-                        ++kh_val(hash, k).obs;
+                        ++counts->obs;
                         if(seq_nt16_table[(int8_t)ref[pos + fc + ind]] != s)
-                            ++kh_val(hash, k).err;
+                            ++counts->err;
                     }
                 } else {
                     for(ind = 0; ind < length; ++ind) {
@@ -512,9 +501,9 @@ void err_fm_core(char *fname, faidx_t *fai, fmerr_t *f, htsFormat *open_fmt)
                         if(static_cast<double>(fa_array[cycle]) / FM < f->min_fr) continue;
                         s = bam_seqi(seq, cycle);
                         if(s == dlib::htseq::HTS_N || ref[pos + fc + ind] == 'N') continue;
-                        ++kh_val(hash, k).obs;
+                        ++counts->obs;
                         if(seq_nt16_table[(int8_t)ref[pos + fc + ind]] != s)
-                            ++kh_val(hash, k).err;
+                            ++counts->err;
                     }
                 }
                 rc += length; fc += length;
@@ -529,100 +518,124 @@ void err_fm_core(char *fname, faidx_t *fai, fmerr_t *f, htsFormat *open_fmt)
 }
 
 
-void err_main_core(char *fname, faidx_t *fai, fullerr_t *f, htsFormat *open_fmt)
+/* State carried from record to record by err_main_add. */
+struct err_main_pass_t {
+    faidx_t *fai;
+    bam_hdr_t *hdr;
+    char *ref; // Will hold the sequence for a  chromosome
+    int32_t last_tid;
+    int32_t tid_to_study;
+};
+
+
+static void err_main_pass_init(err_main_pass_t *p, fullerr_t *f, faidx_t *fai, bam_hdr_t *hdr)
 {
+    *p = {fai, hdr, nullptr, -1, -1};
     if(!f->r1) f->r1 = readerr_init(f->l);
     if(!f->r2) f->r2 = readerr_init(f->l);
-    samFile *fp(sam_open_format(fname, "r", open_fmt));
-    bam_hdr_t *hdr(sam_hdr_read(fp));
-    if (!hdr)
-        LOG_EXIT("Failed to read input header from bam %s. Abort!\n", fname);
-    int32_t i, s, c, len, pos, FM, RV, rc, fc, last_tid(-1), tid_to_study(-1);
-    unsigned ind;
-    bam1_t *b(bam_init1());
-    char *ref(nullptr); // Will hold the sequence for a  chromosome
     if(f->refcontig) {
-        for(i = 0; i < hdr->n_targets; ++i) {
+        for(int i(0); i < hdr->n_targets; ++i) {
             if(!strcmp(hdr->target_name[i], f->refcontig)) {
-                tid_to_study = i; break;
+                p->tid_to_study = i; break;
             }
         }
-        if(tid_to_study < 0) LOG_EXIT("Contig %s not found in bam header. Abort mission!\n", f->refcontig);
+        if(p->tid_to_study < 0) LOG_EXIT("Contig %s not found in bam header. Abort mission!\n", f->refcontig);
     }
-    uint8_t *fdata, *rdata, *pdata, *seq, *qual;
-    uint32_t *cigar, *pv_array, length, cycle;
-    while(LIKELY((c = sam_read1(fp, hdr, b)) != -1)) {
-        fdata = bam_aux_get(b, "FM");
-        rdata = bam_aux_get(b, "RV");
-        pdata = bam_aux_get(b, "FP");
-        FM = dlib::int_tag_zero(fdata);
-        RV = dlib::int_tag_zero(rdata);
-        pv_array = f->minPV ? static_cast<uint32_t*>(dlib::array_tag(b, "PV")): nullptr;
-        // Filters... WOOF
-        if((b->core.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FSUPPLEMENTARY | BAM_FQCFAIL | BAM_FDUP)) ||
-            b->core.qual < f->minmq || (f->refcontig && tid_to_study != b->core.tid) ||
-            (f->bed && dlib::bed_test(b, f->bed) == 0) || // Outside of region
-            (FM < f->minFM) || (FM > f->maxFM) || // minFM
-            ((f->flag & REQUIRE_PROPER) && (!(b->core.flag & BAM_FPROPER_PAIR))) || // skip improper pairs
-            ((f->flag & REQUIRE_DUPLEX) ? (RV == FM || RV == 0): ((f->flag & REFUSE_DUPLEX) && (RV != FM && RV != 0))) || // Requires
-            ((f->flag & REQUIRE_FP_PASS) && pdata && bam_aux2i(pdata) == 0) /* Fails barcode QC */) {
-                ++f->nskipped;
-                continue;
-        }
-        seq = (uint8_t *)bam_get_seq(b);
-        qual = (uint8_t *)bam_get_qual(b);
-        cigar = bam_get_cigar(b);
+}
 
-        if(++f->nread % 1000000 == 0) LOG_INFO("Records read: %" PRIu64 ".\n", f->nread);
-        if(b->core.tid != last_tid) {
-            last_tid = b->core.tid;
-            cond_free(ref);
-            LOG_DEBUG("Loading ref sequence for contig with name %s.\n", hdr->target_name[b->core.tid]);
-            ref = fai_fetch(fai, hdr->target_name[b->core.tid], &len);
-            if(ref == nullptr) LOG_EXIT("[Failed to load ref sequence for contig '%s'. Abort!\n", hdr->target_name[b->core.tid]);
-        }
-        const readerr_t *const r = (b->core.flag & BAM_FREAD1) ? f->r1: f->r2;
-        pos = b->core.pos;
-        for(i = 0, rc = 0, fc = 0; i < b->core.n_cigar; ++i) {
-            length = bam_cigar_oplen(cigar[i]);
-            switch(bam_cigar_type(cigar[i])) {
-            case 1:
-                rc += length;
-                break;
-            case 2:
-                fc += length;
-                break;
-            case 3:
-                if((b->core.flag & BAM_FREVERSE)) {
-                    for(ind = 0; ind < length; ++ind) {
-                        s = bam_seqi(seq, ind + rc);
-                        if(s == dlib::htseq::HTS_N || ref[pos + fc + ind] == 'N') continue;
-                        cycle = b->core.l_qseq - 1 - ind - rc;
-                        assert((int32_t)cycle < b->core.l_qseq);
-                        assert(bamseq2i[s] >= 0);
-                        if(pv_array && pv_array[cycle] < f->minPV) continue;
-                        ++r->obs[bamseq2i[s]][qual[ind + rc] - 2][cycle];
-                        if(seq_nt16_table[(int8_t)ref[pos + fc + ind]] != s)
-                            ++r->err[bamseq2i[s]][qual[ind + rc] - 2][cycle];
-                    }
-                } else {
-                    for(ind = 0; ind < length; ++ind) {
-                        cycle = ind + rc;
-                        if(pv_array && pv_array[cycle] < f->minPV) continue;
-                        s = bam_seqi(seq, cycle);
-                        assert(bamseq2i[s] >= 0);
-                        if(s == dlib::htseq::HTS_N || ref[pos + fc + ind] == 'N') continue;
-                        ++r->obs[bamseq2i[s]][qual[cycle] - 2][cycle];
-                        if(seq_nt16_table[(int8_t)ref[pos + fc + ind]] != s)
-                            ++r->err[bamseq2i[s]][qual[cycle] - 2][cycle];
-                    }
+
+static inline void err_main_add(fullerr_t *f, err_main_pass_t *p, bam1_t *b, const BmfTags &tags)
+{
+    int32_t i, s, len, pos, rc, fc;
+    unsigned ind;
+    uint8_t *seq, *qual;
+    uint32_t *cigar, length, cycle;
+    uint8_t *const pdata(tags.get(BmfTags::FP));
+    const int32_t FM(tags.itag(BmfTags::FM)), RV(tags.itag(BmfTags::RV));
+    uint32_t *const pv_array(f->minPV ? tags.array(BmfTags::PV): nullptr);
+    // Filters... WOOF
+    if((b->core.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FSUPPLEMENTARY | BAM_FQCFAIL | BAM_FDUP)) ||
+        b->core.qual < f->minmq || (f->refcontig && p->tid_to_study != b->core.tid) ||
+        (f->bed && dlib::bed_test(b, f->bed) == 0) || // Outside of region
+        (FM < f->minFM) || (FM > f->maxFM) || // minFM
+        ((f->flag & REQUIRE_PROPER) && (!(b->core.flag & BAM_FPROPER_PAIR))) || // skip improper pairs
+        ((f->flag & REQUIRE_DUPLEX) ? (RV == FM || RV == 0): ((f->flag & REFUSE_DUPLEX) && (RV != FM && RV != 0))) || // Requires
+        ((f->flag & REQUIRE_FP_PASS) && pdata && bam_aux2i(pdata) == 0) /* Fails barcode QC */) {
+            ++f->nskipped;
+            return;
+    }
+    seq = (uint8_t *)bam_get_seq(b);
+    qual = (uint8_t *)bam_get_qual(b);
+    cigar = bam_get_cigar(b);
+
+    if(++f->nread % 1000000 == 0) LOG_INFO("Records read: %" PRIu64 ".\n", f->nread);
+    if(b->core.tid != p->last_tid) {
+        p->last_tid = b->core.tid;
+        cond_free(p->ref);
+        LOG_DEBUG("Loading ref sequence for contig with name %s.\n", p->hdr->target_name[b->core.tid]);
+        p->ref = fai_fetch(p->fai, p->hdr->target_name[b->core.tid], &len);
+        if(p->ref == nullptr) LOG_EXIT("[Failed to load ref sequence for contig '%s'. Abort!\n", p->hdr->target_name[b->core.tid]);
+    }
+    const char *const ref(p->ref);
+    const readerr_t *const r = (b->core.flag & BAM_FREAD1) ? f->r1: f->r2;
+    pos = b->core.pos;
+    for(i = 0, rc = 0, fc = 0; i < b->core.n_cigar; ++i) {
+        length = bam_cigar_oplen(cigar[i]);
+        switch(bam_cigar_type(cigar[i])) {
+        case 1:
+            rc += length;
+            break;
+        case 2:
+            fc += length;
+            break;
+        case 3:
+            if((b->core.flag & BAM_FREVERSE)) {
+                for(ind = 0; ind < length; ++ind) {
+                    s = bam_seqi(seq, ind + rc);
+                    if(s == dlib::htseq::HTS_N || ref[pos + fc + ind] == 'N') continue;
+                    cycle = b->core.l_qseq - 1 - ind - rc;
+                    assert((int32_t)cycle < b->core.l_qseq);
+                    assert(bamseq2i[s] >= 0);
+                    if(pv_array && pv_array[cycle] < f->minPV) continue;
+                    ++r->obs[bamseq2i[s]][qual[ind + rc] - 2][cycle];
+                    if(seq_nt16_table[(int8_t)ref[pos + fc + ind]] != s)
+                        ++r->err[bamseq2i[s]][qual[ind + rc] - 2][cycle];
+                }
+            } else {
+                for(ind = 0; ind < length; ++ind) {
+                    cycle = ind + rc;
+                    if(pv_array && pv_array[cycle] < f->minPV) continue;
+                    s = bam_seqi(seq, cycle);
+                    assert(bamseq2i[s] >= 0);
+                    if(s == dlib::htseq::HTS_N || ref[pos + fc + ind] == 'N') continue;
+                    ++r->obs[bamseq2i[s]][qual[cycle] - 2][cycle];
+                    if(seq_nt16_table[(int8_t)ref[pos + fc + ind]] != s)
+                        ++r->err[bamseq2i[s]][qual[cycle] - 2][cycle];
                 }
-                rc += length; fc += length;
-                break;
             }
+            rc += length; fc += length;
+            break;
         }
     }
-    cond_free(ref);
+}
+
+
+void err_main_core(char *fname, faidx_t *fai, fullerr_t *f, htsFormat *open_fmt)
+{
+    samFile *fp(sam_open_format(fname, "r", open_fmt));
+    bam_hdr_t *hdr(sam_hdr_read(fp));
+    if (!hdr)
+        LOG_EXIT("Failed to read input header from bam %s. Abort!\n", fname);
+    bmf_thread_pool_attach(fp);
+    err_main_pass_t pass;
+    err_main_pass_init(&pass, f, fai, hdr);
+    bam1_t *b(bam_init1());
+    BmfTags tags;
+    while(LIKELY(sam_read1(fp, hdr, b) != -1)) {
+        tags.parse(b);
+        err_main_add(f, &pass, b, tags);
+    }
+    cond_free(pass.ref);
     bam_destroy1(b);
     bam_hdr_destroy(hdr), sam_close(fp);
 }
@@ -913,8 +926,8 @@ fmerr_t *fm_init(char *bedpath, bam_hdr_t *hdr, const char *refcontig, int paddi
         ret->bedpath = strdup(bedpath);
     }
     if(refcontig && *refcontig) ret->refcontig = strdup(refcontig);
-    ret->hash1 = kh_init(obs);
-    ret->hash2 = kh_init(obs);
+    ret->hist1 = new DenseHist<obserr_t>();
+    ret->hist2 = new DenseHist<obserr_t>();
     ret->flag = flag;
     ret->minmq = minmq;
     ret->minPV = minPV;
@@ -925,8 +938,8 @@ fmerr_t *fm_init(char *bedpath, bam_hdr_t *hdr, const char *refcontig, int paddi
 
 void fm_destroy(fmerr_t *fm) {
     if(fm->bed) kh_destroy(bed, fm->bed);
-    kh_destroy(obs, fm->hash1);
-    kh_destroy(obs, fm->hash2);
+    delete fm->hist1;
+    delete fm->hist2;
     cond_free(fm->refcontig);
     cond_free(fm->bedpath);
     free(fm);
@@ -966,120 +979,189 @@ int err_main(int argc, char *argv[])
 }
 
 
-int err_main_main(int argc, char *argv[])
-{
-    htsFormat open_fmt{sequence_data, bam, {1, 3}, gzip, 0, nullptr};
-    samFile *fp(nullptr);
-    bam_hdr_t *header(nullptr);
-    int c, minmq(0);
-    std::string outpath("");
-    if(argc < 2) return err_main_usage(EXIT_FAILURE);
-
-    if(strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) err_main_usage(EXIT_SUCCESS);
+struct err_main_opts_t {
+    FILE *d3, *df, *dbc, *dc, *global_fp;
+    char *outpath;
+    char *refcontig;
+    char *bedpath;
+    int padding, minFM, maxFM, flag, minmq;
+    uint32_t minPV;
+    uint64_t min_obs;
+};
 
 
-    FILE *ofp(nullptr), *d3(nullptr), *df(nullptr),
-        *dbc(nullptr), *dc(nullptr), *global_fp(nullptr);
-    char refcontig[200] = "";
-    char *bedpath(nullptr);
-    int padding(-1);
-    int minFM(0);
-    int maxFM(INT_MAX);
-    int flag(0);
-    uint32_t minPV(0);
-    uint64_t min_obs(default_min_obs);
+// Returns optind, leaving the positional arguments to the caller.
+static int err_main_parse(int argc, char *argv[], err_main_opts_t *opts)
+{
+    int c;
+    *opts = err_main_opts_t{};
+    opts->padding = -1;
+    opts->maxFM = INT_MAX;
+    opts->min_obs = default_min_obs;
     while ((c = getopt(argc, argv, "a:p:b:r:c:n:f:3:o:g:m:M:S:O:h?FdDP")) >= 0) {
         switch (c) {
-        case 'a': minmq = atoi(optarg); break;
-        case 'd': flag |= REQUIRE_DUPLEX; break;
-        case 'D': flag |= REFUSE_DUPLEX; break;
-        case 'P': flag |= REQUIRE_PROPER; break;
-        case 'F': flag |= REQUIRE_FP_PASS; break;
-        case 'm': minFM = atoi(optarg); break;
-        case 'M': maxFM = atoi(optarg); break;
-        case 'f': df = dlib::open_ofp(optarg); break;
-        case 'o': outpath = optarg; break;
-        case 'O': min_obs = strtoull(optarg, nullptr, 10); break;
-        case '3': d3 = dlib::open_ofp(optarg); break;
-        case 'c': dc = dlib::open_ofp(optarg); break;
-        case 'n': dbc = dlib::open_ofp(optarg); break;
-        case 'r': std::strcpy(refcontig, optarg); break;
-        case 'b': bedpath = optarg; break;
-        case 'p': padding = atoi(optarg); break;
-        case 'g': global_fp = dlib::open_ofp(optarg); break;
-        case 'S': minPV = strtoul(optarg, nullptr, 0); break;
-        case '?': case 'h': return err_main_usage(EXIT_SUCCESS);
+        case 'a': opts->minmq = atoi(optarg); break;
+        case 'd': opts->flag |= REQUIRE_DUPLEX; break;
+        case 'D': opts->flag |= REFUSE_DUPLEX; break;
+        case 'P': opts->flag |= REQUIRE_PROPER; break;
+        case 'F': opts->flag |= REQUIRE_FP_PASS; break;
+        case 'm': opts->minFM = atoi(optarg); break;
+        case 'M': opts->maxFM = atoi(optarg); break;
+        case 'f': opts->df = dlib::open_ofp(optarg); break;
+        case 'o': opts->outpath = optarg; break;
+        case 'O': opts->min_obs = strtoull(optarg, nullptr, 10); break;
+        case '3': opts->d3 = dlib::open_ofp(optarg); break;
+        case 'c': opts->dc = dlib::open_ofp(optarg); break;
+        case 'n': opts->dbc = dlib::open_ofp(optarg); break;
+        case 'r': opts->refcontig = optarg; break;
+        case 'b': opts->bedpath = optarg; break;
+        case 'p': opts->padding = atoi(optarg); break;
+        case 'g': opts->global_fp = dlib::open_ofp(optarg); break;
+        case 'S': opts->minPV = strtoul(optarg, nullptr, 0); break;
+        case '?': case 'h': err_main_usage(EXIT_SUCCESS);
         }
     }
 
-    if(padding < 0 && bedpath)
+    if(opts->padding < 0 && opts->bedpath)
         LOG_INFO((char *)"Padding not set. Setting to default value %i.\n", DEFAULT_PADDING);
+    return optind;
+}
 
-    if (argc != optind+2)
-        return err_main_usage(EXIT_FAILURE);
-
-    faidx_t *fai(fai_load(argv[optind]));
 
-    if ((fp = sam_open_format(argv[optind + 1], "r", &open_fmt)) == nullptr)
-        LOG_EXIT("Cannot open input file \"%s\"", argv[optind]);
+// Sets up the counts for bampath, taking the read length from its first record.
+static fullerr_t err_main_init(const err_main_opts_t *opts, char *bampath, htsFormat *open_fmt)
+{
+    samFile *fp(nullptr);
+    bam_hdr_t *header(nullptr);
+    if ((fp = sam_open_format(bampath, "r", open_fmt)) == nullptr)
+        LOG_EXIT("Cannot open input file \"%s\"", bampath);
     if ((header = sam_hdr_read(fp)) == nullptr)
-        LOG_EXIT("Failed to read header for \"%s\"", argv[optind]);
+        LOG_EXIT("Failed to read header for \"%s\"", bampath);
 
-    if(minPV) {
-        LOG_INFO("minPV: %u.\n", minPV);
-        dlib::check_bam_tag_exit(argv[optind + 1], "PV");
+    if(opts->minPV) {
+        LOG_INFO("minPV: %u.\n", opts->minPV);
+        dlib::check_bam_tag_exit(bampath, "PV");
     }
-    if(minFM || maxFM != INT_MAX) dlib::check_bam_tag_exit(argv[optind + 1], "FM");
+    if(opts->minFM || opts->maxFM != INT_MAX) dlib::check_bam_tag_exit(bampath, "FM");
 
     // Get read length from the first read
     bam1_t *b(bam_init1());
-    c = sam_read1(fp, header, b);
-    fullerr_t f(fullerr_init(b->core.l_qseq, bedpath, header,
-                             padding, minFM, maxFM, flag, minmq, minPV, min_obs));
+    sam_read1(fp, header, b);
+    fullerr_t f(fullerr_init(b->core.l_qseq, opts->bedpath, header,
+                             opts->padding, opts->minFM, opts->maxFM, opts->flag,
+                             opts->minmq, opts->minPV, opts->min_obs));
     sam_close(fp);
-    fp = nullptr;
     bam_destroy1(b);
-    if(*refcontig) f.refcontig = strdup(refcontig);
-    bam_hdr_destroy(header), header = nullptr;
-    err_main_core(argv[optind + 1], fai, &f, &open_fmt);
-    fai_destroy(fai);
-    set_max_readlen(&f);
-    fill_qvals(&f);
-    impute_scores(&f);
+    if(opts->refcontig && *opts->refcontig) f.refcontig = strdup(opts->refcontig);
+    bam_hdr_destroy(header);
+    return f;
+}
+
+
+// Finishes the counts and writes each requested table, closing its file.
+static void err_main_write(fullerr_t *f, err_main_opts_t *opts)
+{
+    set_max_readlen(f);
+    fill_qvals(f);
+    impute_scores(f);
     //fill_sufficient_obs(f); Try avoiding the fill sufficients and only use observations.
-    if(outpath.size()) {
-        ofp = fopen(outpath.c_str(), "w");
-        write_final(ofp, &f);
+    if(opts->outpath) {
+        FILE *ofp(fopen(opts->outpath, "w"));
+        if(ofp == nullptr) LOG_EXIT("Could not open %s for writing. Abort!\n", opts->outpath);
+        write_final(ofp, f);
         fclose(ofp);
     }
 
-    if(d3) {
-        write_3d_offsets(d3, &f);
-        fclose(d3), d3 = nullptr;
+    if(opts->d3) {
+        write_3d_offsets(opts->d3, f);
+        fclose(opts->d3), opts->d3 = nullptr;
     }
-    if(df) {
-        write_full_rates(df, &f);
-        fclose(df), df = nullptr;
+    if(opts->df) {
+        write_full_rates(opts->df, f);
+        fclose(opts->df), opts->df = nullptr;
     }
-    if(dbc) {
-        write_base_rates(dbc, &f);
-        fclose(dbc), dbc = nullptr;
+    if(opts->dbc) {
+        write_base_rates(opts->dbc, f);
+        fclose(opts->dbc), opts->dbc = nullptr;
     }
-    if(dc) {
-        write_cycle_rates(dc, &f);
-        fclose(dc), dc = nullptr;
+    if(opts->dc) {
+        write_cycle_rates(opts->dc, f);
+        fclose(opts->dc), opts->dc = nullptr;
     }
-    if(!global_fp) {
+    if(!opts->global_fp) {
         LOG_INFO("No global rate outfile provided. Defaulting to stderr.\n");
-        global_fp = stderr;
+        opts->global_fp = stderr;
     }
-    write_global_rates(global_fp, &f); fclose(global_fp);
+    write_global_rates(opts->global_fp, f); fclose(opts->global_fp);
+    opts->global_fp = nullptr;
+}
+
+
+int err_main_main(int argc, char *argv[])
+{
+    htsFormat open_fmt{sequence_data, bam, {1, 3}, gzip, 0, nullptr};
+    err_main_opts_t opts;
+    if(argc < 2) return err_main_usage(EXIT_FAILURE);
+
+    if(strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) err_main_usage(EXIT_SUCCESS);
+
+    const int i(err_main_parse(argc, argv, &opts));
+    if (argc != i + 2)
+        return err_main_usage(EXIT_FAILURE);
+
+    faidx_t *fai(fai_load(argv[i]));
+    fullerr_t f(err_main_init(&opts, argv[i + 1], &open_fmt));
+    err_main_core(argv[i + 1], fai, &f, &open_fmt);
+    fai_destroy(fai);
+    err_main_write(&f, &opts);
     fullerr_destroy(&f);
     LOG_INFO("Successfully completed bmftools err main!\n");
     return EXIT_SUCCESS;
 }
 
 
+class ErrMainReport: public QcReport {
+    err_main_opts_t opts;
+    faidx_t *fai;
+    bam_hdr_t *hdr;
+    fullerr_t f;
+    err_main_pass_t pass;
+public:
+    ErrMainReport(const err_main_opts_t &_opts, char *fapath, char *bampath):
+        QcReport("err_main"),
+        opts(_opts),
+        fai(fai_load(fapath)),
+        hdr(nullptr),
+        f(err_main_init(&opts, bampath, nullptr))
+    {
+        if(fai == nullptr) LOG_EXIT("Failed to load reference index for %s. Abort!\n", fapath);
+        samFile *fp(sam_open(bampath, "r"));
+        if(fp == nullptr || (hdr = sam_hdr_read(fp)) == nullptr)
+            LOG_EXIT("Failed to read header for \"%s\"", bampath);
+        sam_close(fp);
+        err_main_pass_init(&pass, &f, fai, hdr);
+    }
+    ~ErrMainReport() {
+        cond_free(pass.ref);
+        bam_hdr_destroy(hdr);
+        fai_destroy(fai);
+        fullerr_destroy(&f);
+    }
+    void add(bam1_t *b, const BmfTags &tags) override {err_main_add(&f, &pass, b, tags);}
+    // err main writes only to the files named in its options.
+    bool uses_stdout() const override {return false;}
+    void write(FILE *) override {err_main_write(&f, &opts);}
+};
+
+
+QcReport *err_main_qc(int argc, char *argv[], char *bampath)
+{
+    err_main_opts_t opts;
+    if(err_main_parse(argc, argv, &opts) != argc - 1) err_main_usage(EXIT_FAILURE);
+    return new ErrMainReport(opts, argv[argc - 1], bampath);
+}
+
+
 int err_fm_main(int argc, char *argv[])
 {
     htsFormat open_fmt;
@@ -1143,6 +1225,7 @@ int err_fm_main(int argc, char *argv[])
     if ((header = sam_hdr_read(fp)) == nullptr) {
         LOG_EXIT("Failed to read header for \"%s\"", argv[optind]);
     }
+    bmf_thread_pool_attach(fp);
     for(auto tag: {"FM", "FP"})
         dlib::check_bam_tag_exit(argv[optind + 1], tag);
     if(flag & (REQUIRE_DUPLEX | REFUSE_DUPLEX))
@@ -1164,13 +1247,15 @@ static int read_bam(RegionExpedition *navy, bam1_t *b)
 {
     int ret;
     uint8_t *fmdata, *fpdata;
+    BmfTags tags;
     for(;;)
     {
         if((ret = sam_itr_next(navy->fp, navy->iter, b)) < 0) break;
         if((b->core.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP)) ||
                 (int)b->core.qual < navy->minmq) continue;
-        fmdata = bam_aux_get(b, "FM");
-        fpdata = bam_aux_get(b, "FP");
+        tags.parse(b);
+        fmdata = tags.get(BmfTags::FM);
+        fpdata = tags.get(BmfTags::FP);
         if ((fmdata && bam_aux2i(fmdata) < navy->minFM) ||
             (navy->requireFP && fpdata && bam_aux2i(fpdata) == 0))
                 continue;
@@ -1,6 +1,11 @@
 #include <getopt.h>
 #include <algorithm>
 #include "dlib/bam_util.h"
+#include "lib/bam_shard.h"
+#include "lib/dense_hist.h"
+#include "lib/bmf_tags.h"
+#include "bmf_qc.h"
+#include "bmf_threads.h"
 #ifndef __STDC_FORMAT_MACROS
 #  define __STDC_FORMAT_MACROS
 #endif
@@ -18,13 +23,12 @@ int famstats_frac_usage(int exit_status)
                     "Usage: bmftools famstats frac <opts> <minFM> <in.bam>\n"
                     "-n: Set notification interval. Default: 1000000.\n"
                     "-h, -?: Return usage.\n"
+                    "Indexed bams are split by region across the threads set by bmftools -@.\n"
             );
     exit(exit_status);
     return exit_status; // This never happens
 }
 
-KHASH_MAP_INIT_INT64(fm, uint64_t)
-
 struct famstats_t {
     uint64_t n_pass;
     uint64_t n_fp_fail;
@@ -41,11 +45,9 @@ struct famstats_t {
     uint64_t dr_counts;
     uint64_t dr_rc_sum;
     double dr_rc_frac_sum;
-    khash_t(fm) *fm;
-    khash_t(fm) *np;
-    khash_t(fm) *rc;
-    khiter_t ki;
-    uint8_t *data;
+    DenseHist<uint64_t> fm;
+    DenseHist<uint64_t> np;
+    DenseHist<uint64_t> rc; // Reads without an RV tag are counted under -1.
 };
 
 struct famstats_fm_settings_t {
@@ -60,49 +62,76 @@ struct fm_t {
     uint64_t fm; // Number of times observed
 };
 
-static void print_hashstats(famstats_t *stats, FILE *fp)
+static famstats_t *famstats_init()
 {
-    std::vector<fm_t> fms(kh_size(stats->fm));
-    unsigned i;
-    khiter_t ki;
-    fprintf(fp, "#Family size\tNumber of families\n");
-    for(i = 0, ki = kh_begin(stats->fm); ki != kh_end(stats->fm); ++ki)
-        if(kh_exist(stats->fm, ki))
-            fms[i++] = {kh_val(stats->fm, ki), kh_key(stats->fm, ki)};
-    std::sort(fms.begin(), fms.end(), [](const fm_t a, const fm_t b){
-        return a.fm < b.fm;
+    return new famstats_t(); // Value-initialized, so the counters start at 0.
+}
+
+static void famstats_destroy(famstats_t *s)
+{
+    delete s;
+}
+
+/* Adds the counts and histograms in src to dest. */
+static void famstats_merge(famstats_t *dest, const famstats_t *src)
+{
+    dest->n_pass += src->n_pass;
+    dest->n_fp_fail += src->n_fp_fail;
+    dest->n_fm_fail += src->n_fm_fail;
+    dest->n_mq_fail += src->n_mq_fail;
+    dest->n_flag_fail += src->n_flag_fail;
+    dest->allfm_sum += src->allfm_sum;
+    dest->allfm_counts += src->allfm_counts;
+    dest->allrc_sum += src->allrc_sum;
+    dest->realfm_sum += src->realfm_sum;
+    dest->realfm_counts += src->realfm_counts;
+    dest->realrc_sum += src->realrc_sum;
+    dest->dr_sum += src->dr_sum;
+    dest->dr_counts += src->dr_counts;
+    dest->dr_rc_sum += src->dr_rc_sum;
+    dest->dr_rc_frac_sum += src->dr_rc_frac_sum;
+    dest->fm += src->fm;
+    dest->np += src->np;
+    dest->rc += src->rc;
+}
+
+/*
+ * Histogram entries sorted by key as unsigned integers, which places
+ * the -1 key used for missing RV tags last.
+ */
+static std::vector<fm_t> sorted_counts(const DenseHist<uint64_t> &hist)
+{
+    std::vector<fm_t> ret;
+    hist.for_each([&ret](int64_t key, uint64_t n) {
+        ret.push_back({n, (uint64_t)key});
     });
-    for(i = 0; i < stats->fm->n_occupied; ++i)
-        fprintf(fp, "%" PRIu64 "\t%" PRIu64 "\n", fms[i].fm, fms[i].n);
-
-    fms.resize(stats->rc->n_occupied);
-    for(i = 0, ki = kh_begin(stats->rc); ki != kh_end(stats->rc); ++ki)
-        if(kh_exist(stats->rc, ki))
-            fms[i++] = {kh_val(stats->rc, ki), kh_key(stats->rc, ki)};
-    std::sort(fms.begin(), fms.end(), [](const fm_t a, const fm_t b){
+    std::sort(ret.begin(), ret.end(), [](const fm_t a, const fm_t b){
         return a.fm < b.fm;
     });
-    if(fms[0].fm != (uint64_t)-1) {
+    return ret;
+}
+
+static void print_hashstats(famstats_t *stats, FILE *fp)
+{
+    std::vector<fm_t> fms(sorted_counts(stats->fm));
+    fprintf(fp, "#Family size\tNumber of families\n");
+    for(const fm_t &f: fms)
+        fprintf(fp, "%" PRIu64 "\t%" PRIu64 "\n", f.fm, f.n);
+
+    fms = sorted_counts(stats->rc);
+    if(fms.size() && fms[0].fm != (uint64_t)-1) {
         fprintf(fp, "#RV'd in family\tNumber of families\n");
-        for(i = 0; i < stats->rc->n_occupied; ++i)
-            fprintf(fp, "%" PRIu64 "\t%" PRIu64 "\n", fms[i].fm, fms[i].n);
+        for(const fm_t &f: fms)
+            fprintf(fp, "%" PRIu64 "\t%" PRIu64 "\n", f.fm, f.n);
     }
     // Handle stats->np
-    fms.resize(stats->np->n_occupied);
+    fms = sorted_counts(stats->np);
     size_t n_rsq_fams(0);
-    for(i = 0, ki = kh_begin(stats->np); ki != kh_end(stats->np); ++ki) {
-        if(kh_exist(stats->np, ki)) {
-            fms[i++] = {kh_val(stats->np, ki), kh_key(stats->np, ki)};
-            n_rsq_fams += kh_val(stats->np, ki);
-        }
-    }
-    std::sort(fms.begin(), fms.end(), [](const fm_t a, const fm_t b){
-        return a.fm < b.fm;
-    });
+    for(const fm_t &f: fms) n_rsq_fams += f.n;
     fprintf(fp, "#Number of families that were rescued: %lu\n", n_rsq_fams);
     fputs("#Number of pre-rescue reads in rescued\tNumber of families\n", fp);
-    for(i = 0; i < stats->np->n_occupied; ++i)
-        fprintf(fp, "%" PRIu64 "\t%" PRIu64 "\n", fms[i].fm, fms[i].n);
+    for(const fm_t &f: fms)
+        fprintf(fp, "%" PRIu64 "\t%" PRIu64 "\n", f.fm, f.n);
 }
 
 
@@ -139,9 +168,8 @@ static void print_stats(famstats_t *stats, FILE *fp, famstats_fm_settings_t *set
 }
 
 
-static inline void famstats_fm_loop(famstats_t *s, bam1_t *b, famstats_fm_settings_t *settings)
+static inline void famstats_fm_add(famstats_t *s, bam1_t *b, const BmfTags &tags, famstats_fm_settings_t *settings)
 {
-    uint8_t *data;
     if(b->core.flag & BAM_FREAD2) return; // Silently skip all read 2s since they have the same FM values.
     if((b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))) {
         ++s->n_flag_fail;
@@ -151,15 +179,15 @@ static inline void famstats_fm_loop(famstats_t *s, bam1_t *b, famstats_fm_settin
         ++s->n_mq_fail;
         return;
     }
-    const int FM(((data = bam_aux_get(b, "FM")) != nullptr ? bam_aux2i(data) : 0));
-    const int NP(((data = bam_aux_get(b, "NP")) != nullptr ? bam_aux2i(data) : -1));
-    int RV(((data = bam_aux_get(b, "RV")) != nullptr ? bam_aux2i(data) : -1));
+    const int FM(tags.itag(BmfTags::FM, 0));
+    const int NP(tags.itag(BmfTags::NP, -1));
+    int RV(tags.itag(BmfTags::RV, -1));
     if(UNLIKELY(FM == 0)) LOG_EXIT("Missing required FM tag. Abort!\n");
     if(FM < settings->minFM) {
         ++s->n_fm_fail;
         return;
     }
-    if(bam_itag(b, "FP") == 0) {
+    if(tags.itag(BmfTags::FP) == 0) {
         ++s->n_fp_fail;
         if(settings->skip_fp_fail) return;
     }
@@ -174,26 +202,12 @@ static inline void famstats_fm_loop(famstats_t *s, bam1_t *b, famstats_fm_settin
     s->allfm_sum += FM;
     s->allrc_sum += RV < 0 ? 0 : RV;
 
-    int khr;
-    // Have we seen this family size before?
-    if((s->ki = kh_get(fm, s->fm, FM)) == kh_end(s->fm))
-        // If not, put it into the hash table with a count of 1.
-        s->ki = kh_put(fm, s->fm, FM, &khr), kh_val(s->fm, s->ki) = 1;
-    else ++kh_val(s->fm, s->ki); // Otherwise increment counts
-    // Same, but for RV
-    if((s->ki = kh_get(fm, s->rc, RV)) == kh_end(s->rc))
-        s->ki = kh_put(fm, s->rc, RV, &khr), kh_val(s->rc, s->ki) = 1;
-    else ++kh_val(s->rc, s->ki);
-    // Same, but for NP
-    if(NP > 0) {
-        if((s->ki = kh_get(fm, s->np, NP)) == kh_end(s->np))
-            s->ki = kh_put(fm, s->np, NP, &khr), kh_val(s->np, s->ki) = 1;
-        else ++kh_val(s->np, s->ki);
-    }
+    ++s->fm[FM];
+    ++s->rc[RV];
+    if(NP > 0) ++s->np[NP];
 
     // If the Duplex Read tag is present, increment duplex read counts
-    uint8_t *const dr_data(bam_aux_get(b, "DR"));
-    if(dr_data && bam_aux2i(dr_data)) {
+    if(tags.itag(BmfTags::DR)) {
         if(RV < 0) RV = 0;
         s->dr_sum += FM;
         ++s->dr_counts;
@@ -202,16 +216,17 @@ static inline void famstats_fm_loop(famstats_t *s, bam1_t *b, famstats_fm_settin
     }
 }
 
+static inline void famstats_fm_loop(famstats_t *s, bam1_t *b, famstats_fm_settings_t *settings)
+{
+    famstats_fm_add(s, b, BmfTags(b), settings);
+}
+
 
 famstats_t *famstats_fm_core(dlib::BamHandle& handle, famstats_fm_settings_t *settings)
 {
     uint64_t count(0);
-    famstats_t *s((famstats_t*)calloc(1, sizeof(famstats_t)));
+    famstats_t *s(famstats_init());
     int ret;
-    s->fm = kh_init(fm);
-    s->rc = kh_init(fm);
-    s->np = kh_init(fm);
-    s->data = nullptr;
     while (LIKELY((ret = handle.next()) >= 0)) {
         famstats_fm_loop(s, handle.rec, settings);
         if(UNLIKELY(++count % settings->notification_interval == 0))
@@ -221,6 +236,27 @@ famstats_t *famstats_fm_core(dlib::BamHandle& handle, famstats_fm_settings_t *se
     return s;
 }
 
+/*
+ * famstats_fm_core for indexed bams, with each of n_threads threads counting
+ * its own shards into its own famstats_t. Returns nullptr if path has no index.
+ */
+famstats_t *famstats_fm_sharded(const char *path, famstats_fm_settings_t *settings, int n_threads)
+{
+    std::vector<famstats_t *> stats(n_threads);
+    for(auto &s: stats) s = famstats_init();
+    if(for_each_sharded(path, n_threads, [&](bam1_t *b, int thread) {
+        famstats_fm_loop(stats[thread], b, settings);
+    })) {
+        for(auto s: stats) famstats_destroy(s);
+        return nullptr;
+    }
+    for(int i(1); i < n_threads; ++i) {
+        famstats_merge(stats[0], stats[i]);
+        famstats_destroy(stats[i]);
+    }
+    return stats[0];
+}
+
 
 static int famstats_usage_exit(int exit_status)
 {
@@ -245,34 +281,64 @@ static int famstats_fm_usage(int exit_status)
                     "-m Set minimum mapping quality. Default: 0.\n"
                     "-f Set minimum family size. Default: 0.\n"
                     "-F Skip reads marked as qc fail. By default, includes.\n"
+                    "Indexed bams are split by region across the threads set by bmftools -@.\n"
             );
     exit(exit_status);
     return exit_status;
 }
 
 
-int famstats_fm_main(int argc, char *argv[])
+/* Parses famstats fm's options into settings and returns the index of the first positional argument. */
+static int famstats_fm_parse(int argc, char *argv[], famstats_fm_settings_t *settings)
 {
-    famstats_t *s;
     int c;
-    famstats_fm_settings_t settings{0};
-    settings.notification_interval = 1000000;
-
     while ((c = getopt(argc, argv, "m:f:n:Fh?")) >= 0) {
         switch (c) {
         case 'm':
-            settings.minmq = atoi(optarg); break;
+            settings->minmq = atoi(optarg); break;
             break;
         case 'f':
-            settings.minFM = atoi(optarg); break;
+            settings->minFM = atoi(optarg); break;
             break;
         case 'F':
-            settings.skip_fp_fail = 1; break;
-        case 'n': settings.notification_interval = strtoull(optarg, nullptr, 0); break;
+            settings->skip_fp_fail = 1; break;
+        case 'n': settings->notification_interval = strtoull(optarg, nullptr, 0); break;
         case '?': case 'h':
             return famstats_fm_usage(EXIT_SUCCESS);
         }
     }
+    return optind;
+}
+
+
+class FamstatsFmReport: public QcReport {
+    famstats_fm_settings_t settings;
+    famstats_t *s;
+public:
+    FamstatsFmReport(const famstats_fm_settings_t &_settings):
+        QcReport("famstats_fm"), settings(_settings), s(famstats_init()) {}
+    ~FamstatsFmReport() {famstats_destroy(s);}
+    void add(bam1_t *b, const BmfTags &tags) override {famstats_fm_add(s, b, tags, &settings);}
+    void write(FILE *fp) override {print_stats(s, fp, &settings);}
+};
+
+
+QcReport *famstats_fm_qc(int argc, char *argv[], char *bampath)
+{
+    famstats_fm_settings_t settings{0};
+    settings.notification_interval = 1000000;
+    if(famstats_fm_parse(argc, argv, &settings) != argc) famstats_fm_usage(EXIT_FAILURE);
+    for(const char *tag: tags_to_check) dlib::check_bam_tag_exit(bampath, tag);
+    return new FamstatsFmReport(settings);
+}
+
+
+int famstats_fm_main(int argc, char *argv[])
+{
+    famstats_t *s;
+    famstats_fm_settings_t settings{0};
+    settings.notification_interval = 1000000;
+    famstats_fm_parse(argc, argv, &settings);
 
     if (argc != optind+1) {
         return famstats_fm_usage((argc == optind) ? EXIT_SUCCESS: EXIT_FAILURE);
@@ -282,62 +348,112 @@ int famstats_fm_main(int argc, char *argv[])
     for(const char *tag: tags_to_check)
         dlib::check_bam_tag_exit(argv[optind], tag);
 
-    dlib::BamHandle handle(argv[optind]);
-    s = famstats_fm_core(handle, &settings);
+    const int n_threads(bmf_thread_pool_size());
+    if(n_threads <= 1 || (s = famstats_fm_sharded(argv[optind], &settings, n_threads)) == nullptr) {
+        dlib::BamHandle handle(argv[optind]);
+        bmf_thread_pool_attach(handle.fp);
+        s = famstats_fm_core(handle, &settings);
+    }
     print_stats(s, stdout, &settings);
-    kh_destroy(fm, s->fm);
-    kh_destroy(fm, s->np);
-    kh_destroy(fm, s->rc);
-    free(s);
+    famstats_destroy(s);
     LOG_INFO("Successfully completed bmftools famstats fm.\n");
     return EXIT_SUCCESS;
 }
 
 
-int famstats_frac_main(int argc, char *argv[])
+struct famstats_frac_t {
+    uint32_t minFM;
+    uint64_t fm_above;
+    uint64_t total_fm;
+};
+
+static inline void famstats_frac_add(famstats_frac_t *f, bam1_t *b, const BmfTags &tags)
 {
-    int c;
-    uint64_t notification_interval(1000000);
+    // Filter reads
+    if((b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY | BAM_FREAD2)) ||
+            tags.itag(BmfTags::FP) == 0)
+        return;
+    const int FM(tags.itag(BmfTags::FM));
+    f->total_fm += FM;
+    if((unsigned)FM >= f->minFM) f->fm_above += FM;
+}
 
+static void famstats_frac_write(const famstats_frac_t *f, FILE *fp)
+{
+    fprintf(fp, "#Fraction of raw reads with >= minFM %u:\t%f\n",
+            f->minFM, (double)f->fm_above / f->total_fm);
+}
+
+/* Parses famstats frac's options and returns the index of the first positional argument. */
+static int famstats_frac_parse(int argc, char *argv[], uint64_t *notification_interval)
+{
+    int c;
     if(argc < 2) famstats_frac_usage(EXIT_FAILURE);
     if(strcmp(argv[1], "--help") == 0) famstats_frac_usage(EXIT_SUCCESS);
 
     while ((c = getopt(argc, argv, "n:m:h?")) >= 0) {
         switch (c) {
         case 'n':
-            notification_interval = strtoull(optarg, nullptr, 0); break;
+            *notification_interval = strtoull(optarg, nullptr, 0); break;
         case '?': case 'h':
             return famstats_frac_usage(EXIT_SUCCESS);
         }
     }
+    return optind;
+}
+
+
+class FamstatsFracReport: public QcReport {
+    famstats_frac_t f;
+public:
+    FamstatsFracReport(uint32_t minFM): QcReport("famstats_frac"), f{minFM, 0, 0} {}
+    void add(bam1_t *b, const BmfTags &tags) override {famstats_frac_add(&f, b, tags);}
+    void write(FILE *fp) override {famstats_frac_write(&f, fp);}
+};
+
+
+QcReport *famstats_frac_qc(int argc, char *argv[], char *bampath)
+{
+    uint64_t notification_interval;
+    if(famstats_frac_parse(argc, argv, &notification_interval) != argc - 1)
+        famstats_frac_usage(EXIT_FAILURE);
+    for(const char *tag: tags_to_check) dlib::check_bam_tag_exit(bampath, tag);
+    return new FamstatsFracReport(strtoul(argv[argc - 1], nullptr, 10));
+}
+
+
+int famstats_frac_main(int argc, char *argv[])
+{
+    uint64_t notification_interval(1000000);
+    famstats_frac_parse(argc, argv, &notification_interval);
 
     if (argc != optind+2) {
         if (argc == optind) famstats_frac_usage(EXIT_SUCCESS);
         else famstats_frac_usage(EXIT_FAILURE);
     }
 
-    uint32_t minFM(strtoul(argv[optind], nullptr, 10));
-    LOG_INFO("MinFM %i.\n", minFM);
+    famstats_frac_t f{(uint32_t)strtoul(argv[optind], nullptr, 10), 0, 0};
+    LOG_INFO("MinFM %i.\n", f.minFM);
     for(const char *tag: tags_to_check) dlib::check_bam_tag_exit(argv[optind+1], tag);
-    dlib::BamHandle handle(argv[optind + 1]);
-    uint64_t fm_above(0), total_fm(0), count(0);
-    // Check to see if the required tags are present before starting.
-    int FM;
-    int ret;
-    while (LIKELY((ret = handle.next()) >= 0)) {
-        // Filter reads
-        if((handle.rec->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY | BAM_FREAD2)) ||
-                bam_itag(handle.rec, "FP") == 0)
-            continue;
-        FM = bam_itag(handle.rec, "FM");
-        total_fm += FM;
-        if((unsigned)FM >= minFM) fm_above += FM;
-        if(UNLIKELY(!(++count % notification_interval)))
-            LOG_INFO("Number of records processed: %" PRIu64 ".\n", count);
+    uint64_t count(0);
+    const int n_threads(bmf_thread_pool_size());
+    std::vector<famstats_frac_t> fracs(n_threads > 1 ? n_threads: 0, f);
+    if(n_threads > 1 && for_each_sharded(argv[optind + 1], n_threads, [&](bam1_t *b, int thread) {
+        famstats_frac_add(&fracs[thread], b, BmfTags(b));
+    }) == 0) {
+        for(const famstats_frac_t &tf: fracs) f.fm_above += tf.fm_above, f.total_fm += tf.total_fm;
+    } else {
+        dlib::BamHandle handle(argv[optind + 1]);
+        bmf_thread_pool_attach(handle.fp);
+        int ret;
+        while (LIKELY((ret = handle.next()) >= 0)) {
+            famstats_frac_add(&f, handle.rec, BmfTags(handle.rec));
+            if(UNLIKELY(!(++count % notification_interval)))
+                LOG_INFO("Number of records processed: %" PRIu64 ".\n", count);
+        }
+        if (ret != -1) LOG_WARNING("Truncated file? Continue anyway.\n");
     }
-    if (ret != -1) LOG_WARNING("Truncated file? Continue anyway.\n");
-    fprintf(stdout, "#Fraction of raw reads with >= minFM %u:\t%f\n",
-            minFM, (double)fm_above / total_fm);
+    famstats_frac_write(&f, stdout);
     LOG_INFO("Successfully completed bmftools famstats frac.\n");
     return EXIT_SUCCESS;
 }
@@ -350,6 +466,7 @@ int sum_usage(char **argv, int retcode=EXIT_FAILURE)
                     " and pairs for paired-end.\n"
                     "-o: Write to file. Default: stdout.\n"
                     "-h, -?: Return usage.\n"
+                    "Indexed bams are split by region across the threads set by bmftools -@.\n"
             );
     return retcode;
 }
@@ -364,21 +481,34 @@ int famstats_sum_main(int argc, char *argv[]) {
     FILE *ofp(stdout);
     while((c = getopt(argc, argv, "o:h?")) > -1) {
         switch(c) {
-        case 'o': ofp = fopen(optarg, "w"); break;
+        case 'o':
+            if((ofp = fopen(optarg, "w")) == nullptr) LOG_EXIT("Could not open %s for writing. Abort!\n", optarg);
+            break;
         case 'h': case '?': return sum_usage(argv, EXIT_SUCCESS);
         }
     }
     fputs("Filename: count\n", ofp);
-    for(int i(1); i < argc; ++i) {
+    const int n_threads(bmf_thread_pool_size());
+    auto add = [](bam1_t *b, size_t &count) {
+        if((b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY | BAM_FREAD2)) == 0)
+            count += bam_itag(b,"FM");
+    };
+    for(int i(optind); i < argc; ++i) {
         dlib::check_bam_tag_exit(argv[i], "FM");
-        dlib::BamHandle in(argv[i]);
-        bam1_t *b(bam_init1());
         size_t count(0);
-        while(sam_read1(in.fp, in.header, b) >= 0)
-            if((b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY | BAM_FREAD2)) == 0) 
-                count += bam_itag(b,"FM");
+        std::vector<size_t> counts(n_threads > 1 ? n_threads: 0);
+        if(n_threads > 1 && for_each_sharded(argv[i], n_threads, [&](bam1_t *b, int thread) {
+            add(b, counts[thread]);
+        }) == 0) {
+            for(const size_t c: counts) count += c;
+        } else {
+            dlib::BamHandle in(argv[i]);
+            bmf_thread_pool_attach(in.fp);
+            bam1_t *b(bam_init1());
+            while(sam_read1(in.fp, in.header, b) >= 0) add(b, count);
+            bam_destroy1(b);
+        }
         fprintf(ofp, "%s: %lu\n", argv[i], count);
-        bam_destroy1(b);
     }
     fclose(ofp);
     return EXIT_SUCCESS;
@@ -1,14 +1,24 @@
 #include <getopt.h>
+#include <algorithm>
 #include <functional>
+#include <vector>
 #include "dlib/bam_util.h"
+#include "lib/bam_batch.h"
+#include "lib/bed_cursor.h"
+#include "lib/bmf_tags.h"
+#include "lib/split_args.h"
+#include "bmf_threads.h"
 
 namespace bmf {
 
 int usage(char **argv, int retcode=EXIT_FAILURE) {
     fprintf(stderr,
                     "Filters a bam by a set of given parameters.\n"
-                    "Usage: bmftools filter <-l output_compression_level> in.bam out.bam\n"
+                    "Usage: bmftools filter <-l output_compression_level> in.bam out.bam [\"<flags> out2.bam\" ...]\n"
                     "Use - for stdin or stdout.\n"
+                    "Each further quoted argument is a set of the flags below with its own output bam,\n"
+                    "so that several filters can be applied in one pass. -l applies to all outputs.\n"
+                    "Records are tested in batches across the threads set by bmftools -@ and written in input order.\n"
                     "Flags:\n"
                     "-m\t\tFail reads with mapping quality < parameter.\n"
                     "-a\t\tFail read pairs where both reads' aligned fraction < parameter.\n"
@@ -31,7 +41,7 @@ struct opts {
     uint32_t skip_flag:16;
     uint32_t require_flag:16;
     float minAF;
-    khash_t(bed) *bed;
+    BedCursor *bed;
 };
 
 /* If FM tag absent, it's treated as if it were 1.
@@ -40,13 +50,13 @@ struct opts {
  * reads outside of the bed region.
 */
 static inline int test_core(bam1_t *b, opts *options) {
-    uint8_t *data;
-    if((((data = bam_aux_get(b, "FM")) != nullptr) ? bam_aux2i(data): 1) >= (int)(options->minFM))
+    const BmfTags tags(b);
+    if(tags.itag(BmfTags::FM, 1) >= (int)(options->minFM))
         if(b->core.qual >= options->minmq)
             if((b->core.flag & options->skip_flag) == 0)
                 if((b->core.flag & options->require_flag) == options->require_flag)
-                    if(options->bed ? dlib::bed_test(b, options->bed):1)
-                        if(((data = bam_aux_get(b, "MF")) == nullptr ? 1: bam_aux2i(data) >= options->minAF)
+                    if(options->bed ? options->bed->test(b):1)
+                        if((tags.get(BmfTags::MF) == nullptr ? 1: tags.itag(BmfTags::MF) >= options->minAF)
                            || dlib::bam_frac_align(b) >= options->minAF)
                             return 1;
     return 0;
@@ -63,7 +73,7 @@ static inline int test_core(bam1_t *b, opts *options) {
                 b->core.qual >= options->minmq &&
                 ((b->core.flag & options->skip_flag) == 0) &&
                 (b->core.flag & options->require_flag) == options->require_flag &&
-                (options->bed ? dlib::bed_test(b, options->bed):1) &&
+                (options->bed ? options->bed->test(b):1) &&
                 dlib::bam_frac_align(b) >= options->minAF;
     }
 
@@ -78,65 +88,121 @@ int bam_test(bam1_t *b, void *options) {
                                 : !test_core(b, (opts *)options);
 }
 
-int filter_split_core(dlib::BamHandle& in, dlib::BamHandle& out, dlib::BamHandle& refused, opts *param)
+/* One predicate, with the files its passing and, if set, failing records go to. */
+struct filter_output_t {
+    opts param;
+    char *bedpath;
+    int padding;
+    char *outpath;
+    char *refused_path;
+    dlib::BamHandle *out;
+    dlib::BamHandle *refused;
+};
+
+
+/* Parses one set of filter options into o, returning the index of the first positional argument. */
+static int filter_parse(int argc, char *argv[], filter_output_t *o, char *out_mode)
 {
-    uint64_t count(0);
-    while(in.next() >= 0) {
-        if(++count % 1000000 == 0) LOG_INFO("%lu records processed.\n", count);
-        if(bam_test(in.rec, (void *)param)) refused.write(in.rec);
-        else out.write(in.rec);
+    int c;
+    // The leading + stops at the first positional argument, so that the quoted output specs are not permuted into options.
+    while((c = getopt(argc, argv, "+s:a:r:P:b:m:F:f:l:hAv?")) > -1) {
+        switch(c) {
+        case 'a': o->param.minAF = atof(optarg); break;
+        case 'P': o->padding = atoi(optarg); break;
+        case 'b': o->bedpath = optarg; break;
+        case 'm': o->param.minmq = strtoul(optarg, nullptr, 0); break;
+        case 's': o->param.minFM = strtoul(optarg, nullptr, 0); break;
+        case 'F': o->param.skip_flag = strtoul(optarg, nullptr, 0); break;
+        case 'f': o->param.require_flag = strtoul(optarg, nullptr, 0); break;
+        case 'v': o->param.v = 1; break;
+        case 'r': o->refused_path = optarg; break;
+        case 'l': out_mode[2] = *optarg; break;
+        case '?': case 'h': exit(usage(nullptr, EXIT_SUCCESS));
+        }
     }
-    return EXIT_SUCCESS;
+    return optind;
 }
 
+
 int filter_main(int argc, char *argv[]) {
     if(argc < 3)
         return usage(argv);
     if(strcmp(argv[1], "--help") == 0)
         return usage(argv, EXIT_SUCCESS);
-    int c;
     char out_mode[4]{"wb"};
-    opts param{0};
-    char *bedpath(nullptr);
-    int padding(DEFAULT_PADDING);
-    std::string refused_path("");
-    while((c = getopt(argc, argv, "s:a:r:P:b:m:F:f:l:hAv?")) > -1) {
-        switch(c) {
-        case 'a': param.minAF = atof(optarg); break;
-        case 'P': padding = atoi(optarg); break;
-        case 'b': bedpath = optarg; break;
-        case 'm': param.minmq = strtoul(optarg, nullptr, 0); break;
-        case 's': param.minFM = strtoul(optarg, nullptr, 0); break;
-        case 'F': param.skip_flag = strtoul(optarg, nullptr, 0); break;
-        case 'f': param.require_flag = strtoul(optarg, nullptr, 0); break;
-        case 'v': param.v = 1; break;
-        case 'r': refused_path = optarg; break;
-        case 'l': out_mode[2] = *optarg; break;
-        case '?': case 'h': return usage(argv, EXIT_SUCCESS);
-        }
+    // Outputs after the first are given as quoted option sets, each ending with its output path.
+    std::vector<filter_output_t> outputs(1, filter_output_t{opts{0}, nullptr, DEFAULT_PADDING, nullptr, nullptr, nullptr, nullptr});
+    const int i(filter_parse(argc, argv, &outputs[0], out_mode));
+    if(argc < i + 2)
+        LOG_EXIT("Required: at least two positional arguments (in bam, out bam).\n");
+    char *const inpath(argv[i]);
+    outputs[0].outpath = argv[i + 1];
+    std::vector<std::vector<std::string>> words(argc - i - 2);
+    for(int j(i + 2); j < argc; ++j) {
+        std::vector<char *> spec(split_args((std::string("filter ") + argv[j]).c_str(), words[j - i - 2]));
+        outputs.push_back(filter_output_t{opts{0}, nullptr, DEFAULT_PADDING, nullptr, nullptr, nullptr, nullptr});
+        optind = 0;
+        const int k(filter_parse(spec.size() - 1, spec.data(), &outputs.back(), out_mode));
+        if(k != (int)spec.size() - 2)
+            LOG_EXIT("Output '%s' requires precisely one positional argument (out bam).\n", argv[j]);
+        outputs.back().outpath = spec[k];
     }
-    dlib::check_bam_tag_exit(argv[optind], "FM");
-    if(argc - 2 != optind)
-        LOG_EXIT("Required: precisely two positional arguments (in bam, out bam).\n");
-    dlib::BamHandle in(argv[optind]);
-    param.bed = bedpath ? dlib::parse_bed_hash(bedpath, in.header, padding)
-                        : nullptr;
+    if(outputs.size() > 64) LOG_EXIT("At most 64 outputs are supported, not %lu. Abort!\n", outputs.size());
+
+    dlib::check_bam_tag_exit(inpath, "FM");
+    dlib::BamHandle in(inpath);
+    bmf_thread_pool_attach(in.fp);
     dlib::add_pg_line(in.header, argc, argv, "bmftools filter", BMF_VERSION,
             "bmftools", "Filters or splits a bam by a set of criteria.");
-    if(param.minAF > 0 && param.is_se == 0)
-        dlib::check_bam_tag_exit(argv[optind], "MF");
-    dlib::BamHandle out(argv[optind + 1], in.header, out_mode);
+    for(filter_output_t &o: outputs) {
+        if(o.param.minAF > 0 && o.param.is_se == 0)
+            dlib::check_bam_tag_exit(inpath, "MF");
+        if(o.bedpath) {
+            khash_t(bed) *bed(dlib::parse_bed_hash(o.bedpath, in.header, o.padding));
+            o.param.bed = new BedCursor(bed);
+            dlib::bed_destroy_hash((void *)bed);
+        }
+        o.out = new dlib::BamHandle(o.outpath, in.header, out_mode);
+        bmf_thread_pool_attach(o.out->fp);
+        if(o.refused_path) {
+            LOG_DEBUG("Writing passing records to %s, failing to %s.\n", o.outpath, o.refused_path);
+            o.refused = new dlib::BamHandle(o.refused_path, in.header, out_mode);
+            bmf_thread_pool_attach(o.refused->fp);
+        }
+    }
+    // Each thread tests with its own copies of the settings, whose bed cursors move as they test.
+    const int n_threads(std::max(1, bmf_thread_pool_size()));
+    std::vector<std::vector<opts>> params(n_threads);
+    for(std::vector<opts> &thread_params: params) {
+        for(const filter_output_t &o: outputs) {
+            thread_params.push_back(o.param);
+            if(o.param.bed) thread_params.back().bed = new BedCursor(*o.param.bed);
+        }
+    }
     // Core
-    int ret(-1);
-    if(refused_path.size()) { // refused path is set.
-        LOG_DEBUG("Writing passing records to %s, failing to %s.\n", out.fp->fn, refused_path.c_str());
-        dlib::BamHandle refused(refused_path.c_str(), in.header, out_mode);
-        ret = filter_split_core(in, out, refused, &param);
-    } else ret = in.for_each(bam_test, out, (void *)&param);
+    const uint64_t count(for_each_batch(in.fp, in.header, n_threads, [&](bam1_t *b) {
+        std::vector<opts> &thread_params(params[omp_get_thread_num()]);
+        uint64_t passed(0);
+        for(size_t j(0); j < thread_params.size(); ++j)
+            if(bam_test(b, (void *)&thread_params[j]) == 0) passed |= UINT64_C(1) << j;
+        return passed;
+    }, [&](bam1_t *b, uint64_t passed) {
+        for(size_t j(0); j < outputs.size(); ++j) {
+            if(passed >> j & 1) outputs[j].out->write(b);
+            else if(outputs[j].refused) outputs[j].refused->write(b);
+        }
+    }));
+    LOG_INFO("%lu records processed.\n", count);
     // Clean up.
-    if(param.bed) dlib::bed_destroy_hash((void *)param.bed);
+    for(std::vector<opts> &thread_params: params)
+        for(opts &param: thread_params) delete param.bed;
+    for(filter_output_t &o: outputs) {
+        delete o.param.bed;
+        delete o.out;
+        delete o.refused;
+    }
     LOG_INFO("Successfully completed bmftools filter!\n");
-    return ret;
+    return EXIT_SUCCESS;
 }
 
 }
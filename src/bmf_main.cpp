@@ -1,10 +1,13 @@
 #include "bmf_main.h"
+#include "bmf_threads.h"
 
 static int bmftools_usage(int rc)
 {
     fprintf(stderr,
-                    "Usage: bmftools <subcommand>. See subcommand menus for usage.\n"
+                    "Usage: bmftools [-@ INT] <subcommand>. See subcommand menus for usage.\n"
                     "-v/--version:            Print bmftools version and exit.\n"
+                    "-@/--threads INT:        Share a pool of INT threads for bam/vcf compression and decompression\n"
+                    "                         across all files the subcommand opens. Also sort's default -@.\n"
                     "cap:                     Modifies the quality string as function of family metadata.\n"
                     "depth:                   Calculates depth of coverage over a set of bed intervals.\n"
                     "collapse:                Collapses fastq records by barcodes.\n"
@@ -14,6 +17,8 @@ static int bmftools_usage(int rc)
                     //"inmem:                   Performs dmp fully in memory. RAM-hungry but fast!\n"
                     //"hashdmp:                 Demultiplex inline barcoded experiments that have already been marked.\n"
                     "mark:                    Add tags including unclipped start positions.\n"
+                    "markrsq:                 Mark, sort, and rsq a name-sorted bam in one pass.\n"
+                    "qc:                      Compute several of famstats, target, and err main in one pass over a bam.\n"
                     "rsq:                     Rescue reads with using positional inference to collapse to unique observations in spite of errors in the barcode sequence.\n"
                     "sort:                    Sort for bam rescue.\n"
                     "stack:                   A maximally-permissive yet statistically-thorough variant caller using molecular barcode metadata.\n"
@@ -23,17 +28,12 @@ static int bmftools_usage(int rc)
     exit(rc);
 }
 
-int main(int argc, char *argv[])
+static int dispatch(int argc, char *argv[])
 {
-    if(argc == 1 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)
-        return bmftools_usage(EXIT_FAILURE);
-    if(strcmp(argv[1], "-v") == 0 || strcmp(argv[1], "--version") == 0) {
-        fprintf(stderr,"bmftools version: '%s'.\n", BMF_VERSION);
-        exit(EXIT_SUCCESS);
-    }
     if(strcmp(argv[1], "sort") == 0) return sort_main(argc - 1, argv + 1);
     if(strcmp(argv[1], "collapse") == 0) return bmf::collapse_main(argc - 1, argv + 1);
     if(strcmp(argv[1], "rsq") == 0) return bmf::rsq_main(argc - 1, argv + 1);
+    if(strcmp(argv[1], "markrsq") == 0) return bmf::markrsq_main(argc - 1, argv + 1);
     if(strcmp(argv[1], "hashdmp") == 0) return bmf::hashcollapse_main(argc - 1, argv + 1);
     if(strcmp(argv[1], "inmem") == 0) return bmf::hashdmp_inmem_main(argc - 1, argv + 1);
     if(strcmp(argv[1], "famstats") == 0) return bmf::famstats_main(argc - 1, argv + 1);
@@ -42,6 +42,7 @@ int main(int argc, char *argv[])
     if(strcmp(argv[1], "mark") == 0) return bmf::mark_main(argc - 1, argv + 1);
     if(strcmp(argv[1], "cap") == 0) return bmf::cap_main(argc - 1, argv + 1);
     if(strcmp(argv[1], "target") == 0) return bmf::target_main(argc - 1, argv + 1);
+    if(strcmp(argv[1], "qc") == 0) return bmf::qc_main(argc - 1, argv + 1);
     if(strcmp(argv[1], "depth") == 0) return bmf::depth_main(argc - 1, argv + 1);
     if(strcmp(argv[1], "stack") == 0) return bmf::stack_main(argc - 1, argv + 1);
     if(strcmp(argv[1], "filter") == 0) return bmf::filter_main(argc - 1, argv + 1);
@@ -56,3 +57,30 @@ int main(int argc, char *argv[])
     fprintf(stderr, "Unrecognized command %s. Abort!\n", argv[1]);
     return EXIT_FAILURE;
 }
+
+int main(int argc, char *argv[])
+{
+    int n_threads(0);
+    // Global options precede the subcommand.
+    while(argc > 1) {
+        if(strcmp(argv[1], "-@") == 0 || strcmp(argv[1], "--threads") == 0) {
+            if(argc < 3) return bmftools_usage(EXIT_FAILURE);
+            n_threads = atoi(argv[2]);
+            argc -= 2, argv += 2;
+        } else if(strncmp(argv[1], "-@", 2) == 0) {
+            n_threads = atoi(argv[1] + 2);
+            --argc, ++argv;
+        } else break;
+    }
+    if(argc == 1 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)
+        return bmftools_usage(EXIT_FAILURE);
+    if(strcmp(argv[1], "-v") == 0 || strcmp(argv[1], "--version") == 0) {
+        fprintf(stderr,"bmftools version: '%s'.\n", BMF_VERSION);
+        exit(EXIT_SUCCESS);
+    }
+    if(bmf_thread_pool_init(n_threads))
+        LOG_EXIT("Could not create a pool of %i threads. Abort!\n", n_threads);
+    const int ret(dispatch(argc, argv));
+    bmf_thread_pool_destroy();
+    return ret;
+}
@@ -20,6 +20,8 @@ extern int hashcollapse_main(int argc, char *argv[]);
 extern int hashdmp_inmem_main(int argc, char *argv[]);
 extern int idmp_main(int argc, char *argv[]);
 extern int mark_main(int argc, char *argv[]);
+extern int markrsq_main(int argc, char *argv[]);
+extern int qc_main(int argc, char *argv[]);
 extern int rsq_main(int argc, char *argv[]);
 extern int sdmp_main(int argc, char *argv[]);
 extern int stack_main(int argc, char *argv[]);
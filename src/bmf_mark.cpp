@@ -1,29 +1,18 @@
+#include "bmf_mark.h"
 #include <assert.h>
 #include <getopt.h>
+#include <string>
+#include <unordered_map>
 #include "dlib/bam_util.h"
 #include "dlib/cstr_util.h"
+#include "lib/bam_batch.h"
+#include "lib/mate_store.h"
+#include "lib/rescue_sort.h"
+#include "bmf_threads.h"
 
 namespace bmf {
 
-namespace {
-struct mark_settings_t {
-    // I might add more options later, hence the use of the bitfield.
-    uint32_t add_unclipped_start:1;
-    uint32_t remove_qcfail:1;
-    uint32_t min_insert_length:8;
-    double min_frac_unambiguous;
-    mark_settings_t() :
-        remove_qcfail(0),
-        min_insert_length(0),
-        min_frac_unambiguous(0.0)
-    {
-    }
-};
-
-}
-
-
-static int add_se_tags(bam1_t *b1, void *data)
+int add_se_tags(bam1_t *b1, void *data)
 {
     int ret(0);
     ret |= (dlib::bitset_qcfail_se(b1) & ((mark_settings_t *)data)->remove_qcfail);
@@ -40,7 +29,7 @@ static int add_se_tags(bam1_t *b1, void *data)
     return ret;
 }
 
-static int add_pe_tags(bam1_t *b1, bam1_t *b2, void *data)
+int add_pe_tags(bam1_t *b1, bam1_t *b2, void *data)
 {
     if(UNLIKELY(strcmp(bam_get_qname(b1), bam_get_qname(b2))))
         LOG_EXIT("Is this bam namesorted? These reads have different names.\n");
@@ -64,6 +53,185 @@ static int add_pe_tags(bam1_t *b1, bam1_t *b2, void *data)
     return ret;
 }
 
+static int is_coordinate_sorted(const bam_hdr_t *hdr)
+{
+    if(hdr->l_text < 3 || strncmp(hdr->text, "@HD", 3)) return 0;
+    const char *const eol(strchr(hdr->text, '\n'));
+    const char *const so(strstr(hdr->text, "\tSO:coordinate"));
+    return so && (eol == nullptr || so < eol);
+}
+
+// Tags of a mate that add_pe_tags reads. The rest of the mate's aux data is dropped from its buffered copy.
+static const char MATE_TAGS[][3] {"SA", "FP"};
+
+// Size of an aux value, from its type byte at s to its end.
+static size_t aux_value_size(const uint8_t *s)
+{
+    switch(*s) {
+        case 'A': case 'c': case 'C': return 2;
+        case 's': case 'S': return 3;
+        case 'i': case 'I': case 'f': return 5;
+        case 'd': return 9;
+        case 'Z': case 'H': return 2 + strlen((const char *)s + 1);
+        case 'B': {
+            uint32_t n;
+            memcpy(&n, s + 2, sizeof(n));
+            return 6 + (size_t)n * (s[1] == 'c' || s[1] == 'C' ? 1: s[1] == 's' || s[1] == 'S' ? 2: 4);
+        }
+    }
+    LOG_EXIT("Unrecognized aux type '%c'. Abort!\n", *s);
+    return 0;
+}
+
+// Drops all aux fields but MATE_TAGS from b, leaving what add_pe_tags needs of it as a mate.
+static void trim_mate(bam1_t *b)
+{
+    uint8_t *s(bam_get_aux(b)), *out(s);
+    const uint8_t *const end(b->data + b->l_data);
+    for(size_t len; s < end; s += len) {
+        len = 2 + aux_value_size(s + 2);
+        for(const char *tag: MATE_TAGS) {
+            if(s[0] == tag[0] && s[1] == tag[1]) {
+                memmove(out, s, len), out += len;
+                break;
+            }
+        }
+    }
+    b->l_data = out - b->data;
+}
+
+// Packs and unpacks the records MateStore holds, as rsq does for reads pending realignment.
+static void pack_record(const bam1_t *b, std::string &buf)
+{
+    buf.assign((const char *)&b->core, sizeof(bam1_core_t));
+    buf.append((const char *)b->data, b->l_data);
+}
+
+static void unpack_record(const MateStore::entry_t &e, bam1_t *b)
+{
+    memcpy(&b->core, e.val, sizeof(bam1_core_t));
+    b->l_data = e.len - sizeof(bam1_core_t);
+    if(b->m_data < b->l_data) {
+        b->m_data = b->l_data;
+        kroundup32(b->m_data);
+        b->data = (uint8_t *)realloc(b->data, b->m_data);
+    }
+    memcpy(b->data, e.val + sizeof(bam1_core_t), b->l_data);
+}
+
+/*
+ * Marks paired-end records from a coordinate-sorted bam without a name sort.
+ * The first pass copies each placed primary record, trimmed by trim_mate, into a MateSorter keyed by its mate's position.
+ * The second pass reads the bam again, gathering by name the copies keyed by each position as it is reached,
+ * so that every record meets a copy of its mate. add_pe_tags is called on that pair
+ * and only the record from the bam is written, so both reads of a pair receive the tags
+ * and the pass/fail decision that they would from a name-sorted bam, and the output stays coordinate-sorted.
+ * Unplaced records, which all share one position, are instead paired by name in a MateStore.
+ * Half of max_mem goes to each. Secondary, supplementary and unpaired records, and records whose mate
+ * is absent or whose mate coordinates do not point to it, are written unchanged. Returns the number of pairs marked.
+ */
+static uint64_t mark_coordinate(samFile *in, bam_hdr_t *hdr, samFile *out, const char *path,
+                                mark_settings_t *settings, size_t max_mem, const char *prefix)
+{
+    const uint16_t skip_flags(BAM_FSECONDARY | BAM_FSUPPLEMENTARY);
+    MateSorter mates(hdr, max_mem / 2, prefix);
+    bam1_t *b(bam_init1());
+    while(LIKELY(sam_read1(in, hdr, b) >= 0)) {
+        if((b->core.flag & (BAM_FPAIRED | skip_flags)) == BAM_FPAIRED && b->core.tid >= 0 && b->core.mtid >= 0) {
+            trim_mate(b);
+            mates.add(b);
+        }
+    }
+    mates.finalize();
+    if(mates.spills())
+        LOG_INFO("Mate buffer spilled %lu runs to disk.\n", mates.spills());
+
+    samFile *fp(sam_open(path, "r"));
+    bam_hdr_t *tmp;
+    if(fp == nullptr || (tmp = sam_hdr_read(fp)) == nullptr)
+        LOG_EXIT("Could not reopen %s for the second pass. Abort!\n", path);
+    bam_hdr_destroy(tmp);
+    bmf_thread_pool_attach(fp);
+    uint64_t n_pairs(0), n_orphans(0);
+    auto write = [out, hdr](const bam1_t *rec) {
+        if(UNLIKELY(sam_write1(out, hdr, rec) < 0))
+            LOG_EXIT("Failed to write marked record. Abort!\n");
+    };
+    // Unplaced pairs, joined by name.
+    MateStore unplaced(max_mem / 2, (std::string(prefix) + ".unplaced").c_str());
+    bam1_t *pair[2]{bam_init1(), bam_init1()};
+    std::string buf;
+    const MateStore::pair_fn mark_unplaced([&](const char *, const MateStore::entry_t &prev, const MateStore::entry_t &cur) {
+        unpack_record(prev, pair[0]), unpack_record(cur, pair[1]);
+        const int r1(!(pair[0]->core.flag & BAM_FREAD1));
+        if(add_pe_tags(pair[r1], pair[!r1], settings)) return;
+        write(pair[0]), write(pair[1]);
+        ++n_pairs;
+    });
+    // Mate copies whose mates sit at the current position, by name and read number.
+    std::unordered_map<std::string, bam1_t *> here;
+    auto clear_here = [&here]() {
+        for(auto &kv: here) bam_destroy1(kv.second);
+        here.clear();
+    };
+    bam1_t *head(bam_init1());
+    int have_head(mates.next(head) >= 0);
+    uint64_t key, cur(UINT64_MAX), last(0);
+    std::string name;
+    while(LIKELY(sam_read1(fp, hdr, b) >= 0)) {
+        if((key = b->core.tid < 0 ? MateSorter::pos_key(-1, -1): MateSorter::pos_key(b->core.tid, b->core.pos)) != cur) {
+            if(UNLIKELY(key < last))
+                LOG_EXIT("Is this bam coordinate-sorted? Record %s precedes the one before it.\n", bam_get_qname(b));
+            clear_here();
+            for(uint64_t hkey; have_head && (hkey = MateSorter::pos_key(head->core.mtid, head->core.mpos)) <= key;
+                have_head = mates.next(head) >= 0) {
+                if(hkey < key) continue;
+                name.assign(bam_get_qname(head));
+                name += (head->core.flag & BAM_FREAD1) ? '1': '2';
+                std::swap(here[name], head);
+                if(head == nullptr) head = bam_init1();
+            }
+            last = cur = key;
+        }
+        if((b->core.flag & (BAM_FPAIRED | skip_flags)) != BAM_FPAIRED) {
+            write(b);
+            continue;
+        }
+        if(b->core.tid < 0) {
+            pack_record(b, buf);
+            unplaced.add(bam_get_qname(b), buf, 0, mark_unplaced);
+            continue;
+        }
+        name.assign(bam_get_qname(b));
+        name += (b->core.flag & BAM_FREAD1) ? '2': '1';
+        auto it(here.find(name));
+        if(it == here.end()) {
+            ++n_orphans;
+            write(b);
+            continue;
+        }
+        const int ret((b->core.flag & BAM_FREAD1) ? add_pe_tags(b, it->second, settings)
+                                                   : add_pe_tags(it->second, b, settings));
+        bam_destroy1(it->second);
+        here.erase(it);
+        if(ret) continue;
+        write(b);
+        n_pairs += (b->core.flag & BAM_FREAD1) != 0;
+    }
+    n_orphans += unplaced.finish(mark_unplaced, [&](const char *, const MateStore::entry_t &e) {
+        unpack_record(e, pair[0]);
+        write(pair[0]);
+    });
+    clear_here();
+    bam_destroy1(pair[0]), bam_destroy1(pair[1]);
+    bam_destroy1(head);
+    bam_destroy1(b);
+    sam_close(fp);
+    if(n_orphans)
+        LOG_WARNING("Wrote %lu records unchanged, as their mates are not in the bam where their mate coordinates point.\n", n_orphans);
+    return n_pairs;
+}
+
 static void mark_usage() {
     fprintf(stderr,
                     "Adds positional bam tags for a read and its mate for bmftools rsq and bmftools infer.\n"
@@ -73,7 +241,11 @@ static void mark_usage() {
                     "\tms: Mate SA Tag. Supplemental Alignment tag. (Only if the mate has an SA tag).\n"
                     "Required for bmftools rsq using unclipped start.\n"
                     "Required for bmftools infer.\n"
-                    "Usage: bmftools mark <opts> <input.namesrt.bam> <output.bam>\n\n"
+                    "Usage: bmftools mark <opts> <input.namesrt.bam> <output.bam>\n"
+                    "Paired-end input whose header gives SO:coordinate is instead marked in two passes over the file,\n"
+                    "pairing each read with a copy of its mate sorted by mate position, and the output stays coordinate-sorted.\n"
+                    "Unplaced pairs are paired by name, and reads without a mate in the bam are written unchanged.\n"
+                    "Such input must be a file rather than stdin.\n\n"
                     "Flags:\n-l    Sets bam compression level. (Valid: 1-9). Default: 0.\n"
                     "-q    Skip read pairs which fail.\n"
                     "-d    Set bam compression level to default (6).\n"
@@ -81,6 +253,10 @@ static void mark_usage() {
                     "-u    Skip read pairs where both reads have a fraction of unambiguous base calls >= <FLOAT>\n"
                     "-U    Add unclipped start tags.\n"
                     "-S    Use this for single-end marking. Only sets the QC fail bit for reads failing barcode QC.\n"
+                    "-M    Memory limit for buffered mates of coordinate-sorted input. K/M/G suffixes allowed. Default: 768M.\n"
+                    "-T    Prefix for temporary files of buffered mates. Default: <output.bam>.mark, or bmftools_mark for stdout.\n"
+                    "With bmftools -@ INT, reads are tagged in batches of pairs across INT threads and written in input order,\n"
+                    "and the same pool decodes the input and compresses the output.\n"
                     "Set input.namesrt.bam to \'-\' or \'stdin\' to read from stdin.\n"
                     "Set output.bam to \'-\' or \'stdout\' or omit to stdout.\n"
             );
@@ -92,7 +268,9 @@ int mark_main(int argc, char *argv[])
     char wmode[4]{"wb0"};
     int c, is_se(0), ret(-1);
     mark_settings_t settings;
-    while ((c = getopt(argc, argv, "l:i:u:USdq?h")) >= 0) {
+    char *tmp_prefix(nullptr);
+    size_t max_mate_mem(768uL << 20);
+    while ((c = getopt(argc, argv, "l:i:u:M:T:USdq?h")) >= 0) {
         switch (c) {
         case 'u':
             settings.min_frac_unambiguous = atof(optarg); break;
@@ -111,6 +289,10 @@ int mark_main(int argc, char *argv[])
             is_se = 1; break;
         case 'U':
             settings.add_unclipped_start = 1; break;
+        case 'M':
+            max_mate_mem = parse_memory_string(optarg); break;
+        case 'T':
+            tmp_prefix = optarg; break;
         case '?': case 'h': mark_usage(); // Exits. No need for a break.
         }
     }
@@ -126,12 +308,40 @@ int mark_main(int argc, char *argv[])
         LOG_INFO("No input or output bam provided! Defaulting stdin and stdout.\n");
     }
     dlib::BamHandle inHandle(in);
+    bmf_thread_pool_attach(inHandle.fp);
     dlib::add_pg_line(inHandle.header, argc, argv, "bmftools mark", BMF_VERSION, "bmftools", "Adds mate information to aux tags");
-    dlib::BamHandle outHandle(out, inHandle.header, "wb");
-    ret = is_se ? dlib::abstract_single_iter(inHandle.fp, inHandle.header, outHandle.fp,
-                                             &add_se_tags, &settings)
-                : dlib::abstract_pair_iter(inHandle.fp, inHandle.header, outHandle.fp,
-                                           &add_pe_tags, &settings);
+    dlib::BamHandle outHandle(out, inHandle.header, wmode);
+    bmf_thread_pool_attach(outHandle.fp);
+    const int n_threads(bmf_thread_pool_size());
+    if(!is_se && is_coordinate_sorted(inHandle.header)) {
+        if(strcmp(in, "-") == 0 || strcmp(in, "stdin") == 0)
+            LOG_EXIT("Coordinate-sorted input is read twice and cannot come from stdin. Abort!\n");
+        const std::string prefix(tmp_prefix ? std::string(tmp_prefix)
+                                 : strcmp(out, "-") && strcmp(out, "stdout") ? std::string(out) + ".mark"
+                                                                             : std::string("bmftools_mark"));
+        const uint64_t count(mark_coordinate(inHandle.fp, inHandle.header, outHandle.fp, in,
+                                             &settings, max_mate_mem, prefix.c_str()));
+        LOG_DEBUG("Marked %lu coordinate-sorted pairs.\n", count);
+        ret = EXIT_SUCCESS;
+    } else if(n_threads > 1) {
+        uint64_t count;
+        if(is_se) {
+            count = for_each_batched(inHandle.fp, inHandle.header, outHandle.fp, n_threads, [&settings](bam1_t *b) {
+                // Secondary and supplementary records are written through unchanged, as in the paired path.
+                return (b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) ? 0: add_se_tags(b, &settings);
+            });
+        } else {
+            count = for_each_pair_batched(inHandle.fp, inHandle.header, outHandle.fp, n_threads,
+                                          [&settings](bam1_t *b1, bam1_t *b2) {return add_pe_tags(b1, b2, &settings);});
+        }
+        LOG_DEBUG("Marked %lu %s.\n", count, is_se ? "records": "pairs");
+        ret = EXIT_SUCCESS;
+    } else {
+        ret = is_se ? dlib::abstract_single_iter(inHandle.fp, inHandle.header, outHandle.fp,
+                                                 &add_se_tags, &settings)
+                    : dlib::abstract_pair_iter(inHandle.fp, inHandle.header, outHandle.fp,
+                                               &add_pe_tags, &settings);
+    }
 
     if(ret == EXIT_SUCCESS)
         LOG_INFO("Successfully completed bmftools mark.\n");
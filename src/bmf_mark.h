@@ -0,0 +1,32 @@
+#ifndef BMF_MARK_H
+#define BMF_MARK_H
+#include <cstdint>
+#include "htslib/sam.h"
+
+namespace bmf {
+
+struct mark_settings_t {
+    // I might add more options later, hence the use of the bitfield.
+    uint32_t add_unclipped_start:1;
+    uint32_t remove_qcfail:1;
+    uint32_t min_insert_length:8;
+    double min_frac_unambiguous;
+    mark_settings_t() :
+        add_unclipped_start(0),
+        remove_qcfail(0),
+        min_insert_length(0),
+        min_frac_unambiguous(0.0)
+    {
+    }
+};
+
+/*
+ * Per-record (single-end) and per-pair marking functions used by bmftools mark.
+ * data is a mark_settings_t *. Each returns nonzero if the read(s) should be skipped.
+ */
+int add_se_tags(bam1_t *b1, void *data);
+int add_pe_tags(bam1_t *b1, bam1_t *b2, void *data);
+
+} /* namespace bmf */
+
+#endif /* BMF_MARK_H */
@@ -0,0 +1,108 @@
+#include <getopt.h>
+#include <string>
+#include <vector>
+#include "dlib/bam_util.h"
+#include "lib/bmf_tags.h"
+#include "lib/split_args.h"
+#include "bmf_qc.h"
+#include "bmf_threads.h"
+#ifndef __STDC_FORMAT_MACROS
+#  define __STDC_FORMAT_MACROS
+#endif
+#include <cinttypes>
+
+namespace bmf {
+
+int qc_usage(int exit_status)
+{
+    fprintf(stderr,
+                    "Computes several QC reports in a single pass over a bam.\n"
+                    "Usage: bmftools qc <opts> <in.bam> <report> [<report> ...]\n"
+                    "Each report is a quoted subcommand with its options, leaving off the input bam:\n"
+                    "\"famstats fm <opts>\"\n"
+                    "\"famstats frac <opts> <minFM>\"\n"
+                    "\"target <opts>\"\n"
+                    "\"err main <opts> <reference.fasta>\"\n"
+                    "Each writes what the subcommand would, to the same files for options which name one.\n"
+                    "-o: Write each report's standard output to <prefix>.<index>.<report>.txt,\n"
+                    "    where index is the report's position on the command line, starting at 1. Default: all to stdout, in order.\n"
+                    "-n: Set notification interval. Default: 1000000.\n"
+                    "-h, -?: Return usage.\n"
+            );
+    exit(exit_status);
+    return exit_status; // This never happens
+}
+
+
+static QcReport *qc_report(const char *cmd, char *bampath, std::vector<std::string> &words)
+{
+    std::vector<char *> argv(split_args(cmd, words));
+    const int argc(argv.size() - 1);
+    // Each subcommand's parser expects getopt to start afresh.
+    optind = 0;
+    if(argc >= 2 && strcmp(argv[0], "famstats") == 0 && strcmp(argv[1], "fm") == 0)
+        return famstats_fm_qc(argc - 1, argv.data() + 1, bampath);
+    if(argc >= 2 && strcmp(argv[0], "famstats") == 0 && strcmp(argv[1], "frac") == 0)
+        return famstats_frac_qc(argc - 1, argv.data() + 1, bampath);
+    if(argc >= 1 && strcmp(argv[0], "target") == 0)
+        return target_qc(argc, argv.data(), bampath);
+    if(argc >= 2 && strcmp(argv[0], "err") == 0 && strcmp(argv[1], "main") == 0)
+        return err_main_qc(argc - 1, argv.data() + 1, bampath);
+    fprintf(stderr, "[E:%s] Unrecognized report '%s'. See usage.\n", __func__, cmd);
+    return qc_usage(EXIT_FAILURE), nullptr;
+}
+
+
+int qc_main(int argc, char *argv[])
+{
+    int c;
+    char *prefix(nullptr);
+    uint64_t notification_interval(1000000);
+    if(argc < 2) return qc_usage(EXIT_FAILURE);
+    if(strcmp(argv[1], "--help") == 0) return qc_usage(EXIT_SUCCESS);
+
+    while ((c = getopt(argc, argv, "o:n:h?")) >= 0) {
+        switch (c) {
+        case 'o': prefix = optarg; break;
+        case 'n': notification_interval = strtoull(optarg, nullptr, 0); break;
+        case '?': case 'h':
+            return qc_usage(EXIT_SUCCESS);
+        }
+    }
+    if(argc < optind + 2) return qc_usage(EXIT_FAILURE);
+
+    char *const bampath(argv[optind]);
+    const int n_reports(argc - optind - 1);
+    std::vector<std::vector<std::string>> words(n_reports);
+    std::vector<QcReport *> reports;
+    char **const cmds(argv + optind + 1);
+    for(int i(0); i < n_reports; ++i) reports.push_back(qc_report(cmds[i], bampath, words[i]));
+
+    dlib::BamHandle handle(bampath);
+    bmf_thread_pool_attach(handle.fp);
+    BmfTags tags;
+    uint64_t count(0);
+    while(LIKELY(handle.next() >= 0)) {
+        tags.parse(handle.rec);
+        for(QcReport *report: reports) report->add(handle.rec, tags);
+        if(UNLIKELY(++count % notification_interval == 0))
+            LOG_INFO("Number of records processed: %" PRIu64 ".\n", count);
+    }
+
+    for(size_t i(0); i < reports.size(); ++i) {
+        QcReport *const report(reports[i]);
+        if(prefix && report->uses_stdout()) {
+            // The index keeps two reports of the same kind from writing to one file.
+            const std::string path(std::string(prefix) + '.' + std::to_string(i + 1) + '.' + report->name + ".txt");
+            FILE *fp(fopen(path.c_str(), "w"));
+            if(fp == nullptr) LOG_EXIT("Could not open %s for writing. Abort!\n", path.c_str());
+            report->write(fp);
+            fclose(fp);
+        } else report->write(stdout);
+        delete report;
+    }
+    LOG_INFO("Successfully completed bmftools qc on %i reports.\n", n_reports);
+    return EXIT_SUCCESS;
+}
+
+} /* namespace bmf */
@@ -0,0 +1,36 @@
+#ifndef BMF_QC_H
+#define BMF_QC_H
+#include <cstdio>
+#include "htslib/sam.h"
+#include "lib/bmf_tags.h"
+
+namespace bmf {
+
+/*
+ * A report which bmftools qc computes alongside others in one pass over a bam.
+ * add() sees every record in file order with its tags already parsed,
+ * and write() emits what the standalone subcommand writes to stdout.
+ */
+class QcReport {
+public:
+    const char *const name; // Names the report's output file.
+    QcReport(const char *_name): name(_name) {}
+    virtual ~QcReport() {}
+    virtual void add(bam1_t *b, const BmfTags &tags) = 0;
+    // False for reports which write only to files named in their own options.
+    virtual bool uses_stdout() const {return true;}
+    virtual void write(FILE *fp) = 0;
+};
+
+/*
+ * Each takes the arguments of its subcommand, starting from the subcommand's name
+ * and leaving off the input bam, and exits with the subcommand's usage if they are invalid.
+ */
+QcReport *famstats_fm_qc(int argc, char *argv[], char *bampath);
+QcReport *famstats_frac_qc(int argc, char *argv[], char *bampath);
+QcReport *target_qc(int argc, char *argv[], char *bampath);
+QcReport *err_main_qc(int argc, char *argv[], char *bampath);
+
+} /* namespace bmf */
+
+#endif /* BMF_QC_H */
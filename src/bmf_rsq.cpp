@@ -1,8 +1,16 @@
 #include "bmf_rsq.h"
 #include <cstring>
 #include <getopt.h>
+#include <sys/stat.h>
+#include "htslib/bgzf.h"
 #include "dlib/cstr_util.h"
 #include "include/igamc_cephes.h" /// for igamc
+#include "include/sort_keys.h"
+#include "include/sort_order.h"
+#include "lib/mate_store.h"
+#include "lib/rescue_sort.h"
+#include "bmf_mark.h"
+#include "bmf_threads.h"
 #include <algorithm>
 
 namespace bmf {
@@ -11,8 +19,14 @@ static const char SO_STR[]{"positional_rescue"};
 
 static const int sp(1);
 
+// Flags for pending realignment mates.
+enum pending_flag: uint8_t {
+    PENDING_READ2 = 1,
+    PENDING_BAM = 2 // Serialized record whose alignment is still valid, rather than fastq text.
+};
+
 struct rsq_aux_t {
-    FILE *fqh;
+    BGZF *fqh; // Realignment fastq. Plain text or BGZF, depending on compression level.
     samFile *in;
     samFile *out;
     uint32_t mmlim:6;
@@ -21,11 +35,74 @@ struct rsq_aux_t {
     uint32_t infer:1; // Use inference instead of barcodes.
     uint32_t trust_unmasked:1;
     uint32_t accept_unbalanced:1;
+    uint32_t realign_all:1; // Realign merged reads even if their alignment is still valid.
     bam_hdr_t *hdr; // BAM header
-    std::unordered_map<std::string, std::string> realign_pairs;
+    MateStore *realign_pairs; // Reads to realign whose mates have not yet been seen.
+    kstring_t fqbuf;
+    kstring_t pendbuf;
+    bam1_t *mate_buf[2]; // Scratch records for unpacking pending mates.
+    uint64_t n_kept; // Merged reads written without realignment.
+    uint64_t n_realigned;
+    RescueSource *src; // Records already grouped for rescue. If null, records are read from in.
+    FILE *keys; // Sort key index from bmftools sort -K, read in step with in.
+    uint64_t key, mkey; // Keys for the record last read, if keys is set.
 };
 
-inline void bam2ffq(bam1_t *b, FILE *fp, const int is_supp=0);
+static inline int read_rescue(rsq_aux_t *settings, bam1_t *b)
+{
+    if(settings->src) return settings->src->next(b);
+    const int ret(sam_read1(settings->in, settings->hdr, b));
+    if(settings->keys && ret >= 0 && UNLIKELY(sort_keys_read1(settings->keys, &settings->key, &settings->mkey)))
+        LOG_EXIT("Sort key index ended before the input bam. Was it written by sort -K for this bam?\n");
+    return ret;
+}
+
+static void open_key_index(rsq_aux_t *settings, const char *path)
+{
+    int64_t flags;
+    if((settings->keys = fopen(path, "rb")) == nullptr)
+        LOG_EXIT("Could not open sort key index %s. Abort!\n", path);
+    if((flags = sort_keys_read_header(settings->keys)) < 0)
+        LOG_EXIT("%s is not a sort key index. Abort!\n", path);
+    if(!!(flags & SORT_KEYS_SE) != settings->is_se)
+        LOG_EXIT("Sort key index %s is for %s data, but rsq is in %s mode. Abort!\n", path,
+                 flags & SORT_KEYS_SE ? "single-end": "paired-end", settings->is_se ? "single-end": "paired-end");
+}
+
+static void close_key_index(rsq_aux_t *settings)
+{
+    if(fgetc(settings->keys) != EOF)
+        LOG_EXIT("Sort key index has more entries than the input bam. Was it written by sort -K for this bam?\n");
+    fclose(settings->keys);
+    settings->keys = nullptr;
+}
+
+static void check_rescue_order(rsq_aux_t *settings)
+{
+    if(settings->src) return;
+    if(strcmp(dlib::get_SO(settings->hdr).c_str(), SO_STR))
+        LOG_EXIT("Sort order (%s) is not expected %s for rescue mode. Abort!\n",
+                 dlib::get_SO(settings->hdr).c_str(), SO_STR);
+}
+
+/*
+ * A merged read can keep its alignment if no masked bases were filled in (NC == 0):
+ * its sequence length and position are unchanged, so its CIGAR is still valid.
+ * Bases masked by the merge no longer match its NM and MD tags, which add_realign_pair drops.
+ */
+static inline int keeps_alignment(rsq_aux_t *settings, uint8_t *ncdata)
+{
+    return !settings->realign_all && bam_aux2i(ncdata) == 0;
+}
+
+inline void bam2ffq(bam1_t *b, kstring_t *ks, const int is_supp=0);
+static inline void write_fq(BGZF *fp, const char *str, size_t len)
+{
+    if(UNLIKELY(bgzf_write(fp, str, len) != (ssize_t)len))
+        LOG_EXIT("Failed to write to realignment fastq. Abort!\n");
+}
+void add_realign_pair(rsq_aux_t *settings, bam1_t *b, const int is_supp=0);
+void finish_realign_pairs(rsq_aux_t *settings);
 inline void add_dummy_tags(bam1_t *b);
 
 void update_bam1(bam1_t *p, bam1_t *b);
@@ -40,6 +117,7 @@ struct Stack {
     unsigned m; // Maximum allocated
     bam1_t *a; // Array
     bam1_t **stack; // Pointers to reads.
+    uint64_t key, mkey; // Sort keys of the stack's records, if read from a sort key index.
 
     Stack(rsq_aux_t *settings, unsigned _m=0):
             mmlim(settings->mmlim),
@@ -48,7 +126,9 @@ struct Stack {
             n(0),
             m(_m),
             a((bam1_t *)calloc(m, sizeof(bam1_t))),
-            stack((bam1_t **)malloc(m * sizeof(bam1_t *)))
+            stack((bam1_t **)malloc(m * sizeof(bam1_t *))),
+            key(0),
+            mkey(0)
     {
         for(unsigned i(0); i < m; ++i) stack[i] = a + i;
     }
@@ -60,6 +140,17 @@ struct Stack {
         free(stack);
         free(a);
     }
+    // Whether b belongs in the current stack. With a sort key index, its keys are compared instead of re-derived.
+    int same_stack(rsq_aux_t *settings, bam1_t *b) {
+        if(!settings->keys) return fn(b, a);
+        return n && settings->key == key && settings->mkey == mkey &&
+               (!settings->is_se || b->core.l_qseq == a->core.l_qseq);
+    }
+    // Adds b, recording its keys if it starts the stack.
+    void push(rsq_aux_t *settings, const bam1_t *b) {
+        if(n == 0) key = settings->key, mkey = settings->mkey;
+        add(b);
+    }
     void add(const bam1_t *b) {
         if(n + 1 >= m) {
             m <<= 1;
@@ -91,12 +182,10 @@ template<int (*fn)(bam1_t *, bam1_t *)>
 void Stack<fn>::se_core_infer(rsq_aux_t *settings) {
     // This selects the proper function to use for deciding if reads belong in the same stack.
     // It chooses the single-end or paired-end based on is_se and the bmf or pos based on cmpkey.
-    if(strcmp(dlib::get_SO(settings->hdr).c_str(), SO_STR))
-        LOG_EXIT("Sort order (%s) is not expected %s for rescue mode. Abort!\n",
-                 dlib::get_SO(settings->hdr).c_str(), SO_STR);
+    check_rescue_order(settings);
     bam1_t *b(bam_init1());
     uint64_t count(0);
-    while (LIKELY(sam_read1(settings->in, settings->hdr, b) >= 0)) {
+    while (LIKELY(read_rescue(settings, b) >= 0)) {
         if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records read: %lu.\n", count);
         add_dummy_tags(b);
         if(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
@@ -104,20 +193,12 @@ void Stack<fn>::se_core_infer(rsq_aux_t *settings) {
             sam_write1(settings->out, settings->hdr, b); continue;
         }
         //LOG_DEBUG("Read a read!\n");
-        if(fn(b, a) == 0) write_stack_se(settings); // Flattens and clears stack.
-        add(b);
+        if(!same_stack(settings, b)) write_stack_se(settings); // Flattens and clears stack.
+        push(settings, b);
     }
     write_stack_se(settings);
     bam_destroy1(b);
-    // Handle any unpaired reads, though there shouldn't be any in real datasets.
-    if(settings->realign_pairs.size()) {
-#if !NDEBUG
-        for(auto& pair: settings->realign_pairs)
-            fputs(pair.second.c_str(), stdout);
-#endif
-        if(settings->accept_unbalanced == 0)
-            LOG_EXIT("There shouldn't be orphan reads in real datasets. Number found: %lu\n", settings->realign_pairs.size());
-    }
+    finish_realign_pairs(settings);
 }
 
 template<int (*fn)(bam1_t *, bam1_t *)>
@@ -125,12 +206,10 @@ void Stack<fn>::se_core(rsq_aux_t *settings) {
     // This selects the proper function to use for deciding if reads belong in the same stack.
     // It chooses the single-end or paired-end based on is_se and the bmf or pos based on cmpkey.
     if(infer) return se_core_infer(settings);
-    if(strcmp(dlib::get_SO(settings->hdr).c_str(), SO_STR))
-        LOG_EXIT("Sort order (%s) is not expected %s for rescue mode. Abort!\n",
-                 dlib::get_SO(settings->hdr).c_str(), SO_STR);
+    check_rescue_order(settings);
     bam1_t *b(bam_init1());
     uint64_t count(0);
-    while (LIKELY(sam_read1(settings->in, settings->hdr, b) >= 0)) {
+    while (LIKELY(read_rescue(settings, b) >= 0)) {
         if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records read: %lu.\n", count);
         if(b->core.flag & (BAM_FUNMAP | BAM_FMUNMAP)) {
             sam_write1(settings->out, settings->hdr, b);
@@ -138,21 +217,12 @@ void Stack<fn>::se_core(rsq_aux_t *settings) {
         }
         if(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
         //LOG_DEBUG("Read a read!\n");
-        if(fn(b, a) == 0) write_stack_se(settings); // Flattens and clears stack.
-        add(b);
+        if(!same_stack(settings, b)) write_stack_se(settings); // Flattens and clears stack.
+        push(settings, b);
     }
     write_stack_se(settings);
     bam_destroy1(b);
-    // Handle any unpaired reads, though there shouldn't be any in real datasets.
-    LOG_DEBUG("Number of orphan reads: %lu.\n", settings->realign_pairs.size());
-    if(settings->realign_pairs.size()) {
-#if !NDEBUG
-        for(auto pair: settings->realign_pairs)
-            puts(pair.second.c_str());
-#endif
-        if(settings->accept_unbalanced == 0)
-            LOG_EXIT("There shouldn't be orphan reads in real datasets. Number found: %lu\n", settings->realign_pairs.size());
-    }
+    finish_realign_pairs(settings);
 }
 
 template<int (*fn)(bam1_t *, bam1_t *)>
@@ -160,12 +230,10 @@ void Stack<fn>::pe_core_infer(rsq_aux_t *settings)
 {
     // This selects the proper function to use for deciding if reads belong in the same stack.
     // It chooses the single-end or paired-end based on is_se and the bmf or pos based on cmpkey.
-    if(strcmp(dlib::get_SO(settings->hdr).c_str(), SO_STR))
-        LOG_EXIT("Sort order (%s) is not expected %s for rescue mode. Abort!\n",
-                 dlib::get_SO(settings->hdr).c_str(), SO_STR);
+    check_rescue_order(settings);
     bam1_t *b(bam_init1());
     uint64_t count(0);
-    while (LIKELY(sam_read1(settings->in, settings->hdr, b) >= 0)) {
+    while (LIKELY(read_rescue(settings, b) >= 0)) {
         if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records read: %lu.\n", count);
         add_dummy_tags(b);
         if(b->core.flag & (BAM_FUNMAP | BAM_FMUNMAP)) {
@@ -174,22 +242,13 @@ void Stack<fn>::pe_core_infer(rsq_aux_t *settings)
         }
         if(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))
             continue;
-        if(n == 0 || fn(b, a) == 0)
+        if(n == 0 || !same_stack(settings, b))
             write_stack_pe(settings); // Flattens and clears stack.
-        add(b);
+        push(settings, b);
     }
     write_stack_pe(settings);
     bam_destroy1(b);
-    // Handle any unpaired reads, though there shouldn't be any in real datasets.
-    LOG_DEBUG("Number of orphan reads: %lu.\n", settings->realign_pairs.size());
-    if(settings->realign_pairs.size()) {
-#if !NDEBUG
-        for(auto pair: settings->realign_pairs)
-            puts(pair.second.c_str());
-#endif
-        if(settings->accept_unbalanced == 0)
-            LOG_EXIT("There shouldn't be orphan reads in real datasets. Number found: %lu\n", settings->realign_pairs.size());
-    }
+    finish_realign_pairs(settings);
 }
 
 template<int (*fn)(bam1_t *, bam1_t *)>
@@ -198,12 +257,10 @@ void Stack<fn>::pe_core(rsq_aux_t *settings)
     // This selects the proper function to use for deciding if reads belong in the same stack.
     // It chooses the single-end or paired-end based on is_se and the bmf or pos based on cmpkey.
     LOG_DEBUG("Core!\n");
-    if(strcmp(dlib::get_SO(settings->hdr).c_str(), SO_STR))
-        LOG_EXIT("Sort order (%s) is not expected %s for rescue mode. Abort!\n",
-                 dlib::get_SO(settings->hdr).c_str(), SO_STR);
+    check_rescue_order(settings);
     bam1_t *b(bam_init1());
     uint64_t count(0);
-    while (LIKELY(sam_read1(settings->in, settings->hdr, b) >= 0)) {
+    while (LIKELY(read_rescue(settings, b) >= 0)) {
         if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records read: %lu.\n", count);
         if(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
         if(b->core.flag & (BAM_FUNMAP | BAM_FMUNMAP)) {
@@ -211,26 +268,17 @@ void Stack<fn>::pe_core(rsq_aux_t *settings)
             continue;
         }
         //LOG_DEBUG("Read a read!\n");
-        if(fn(b, a) == 0) write_stack_pe(settings); // Flattens and clears stack.
+        if(!same_stack(settings, b)) write_stack_pe(settings); // Flattens and clears stack.
 #if !NDEBUG
         else {
             assert(bam_is_r1(b) == bam_is_r1(a));
         }
 #endif
-        add(b);
+        push(settings, b);
     }
     write_stack_pe(settings);
     bam_destroy1(b);
-    // Handle any unpaired reads, though there shouldn't be any in real datasets.
-    LOG_DEBUG("Number of orphan reads: %lu.\n", settings->realign_pairs.size());
-    if(settings->realign_pairs.size()) {
-#if !NDEBUG
-        for(auto pair: settings->realign_pairs)
-            puts(pair.second.c_str());
-#endif
-        if(settings->accept_unbalanced == 0)
-            LOG_EXIT("There shouldn't be orphan reads in real datasets. Number found: %lu\n", settings->realign_pairs.size());
-    }
+    finish_realign_pairs(settings);
 }
 
 template<int (*fn)(bam1_t *, bam1_t *)>
@@ -310,10 +358,15 @@ void Stack<fn>::write_stack_se(rsq_aux_t *settings)
 #endif
     for(unsigned i(0); i < n; ++i) {
         if((a + i)->data) {
-            if((data = bam_aux_get((a + i), "NC")))
-                bam2ffq((a + i), settings->fqh);
-            else
+            if((data = bam_aux_get((a + i), "NC")) && !keeps_alignment(settings, data)) {
+                settings->fqbuf.l = 0;
+                bam2ffq((a + i), &settings->fqbuf);
+                write_fq(settings->fqh, settings->fqbuf.s, settings->fqbuf.l);
+                ++settings->n_realigned;
+            } else {
+                if(data) ++settings->n_kept;
                 sam_write1(settings->out, settings->hdr, (a + i));
+            }
         }
     }
     clear();
@@ -327,50 +380,15 @@ void Stack<fn>::write_stack_pe(rsq_aux_t *settings)
     //size_t n = 0;
     //LOG_DEBUG("Starting to write stack\n");
     uint8_t *data;
-    std::string qname;
     for(unsigned i(0); i < n; ++i) {
         if(a[i].data) {
             if((data = bam_aux_get(a + i, "NC"))) {
-                //LOG_DEBUG("Trying to write.\n");
-                qname = bam_get_qname(a + i);
-                if(settings->realign_pairs.find(qname) == settings->realign_pairs.end()) {
-                    settings->realign_pairs.emplace(qname, dlib::bam2cppstr(a + i));
-                } else {
-                    // Write read 1 out first.
-                    if((a + i)->core.flag & BAM_FREAD2) {
-                        fputs(settings->realign_pairs[qname].c_str(), settings->fqh);
-                        bam2ffq((a + i), settings->fqh);
-                    } else {
-                        bam2ffq((a + i), settings->fqh);
-                        fputs(settings->realign_pairs[qname].c_str(), settings->fqh);
-                    }
-                    // Clear entry, as there can only be two.
-                    settings->realign_pairs.erase(qname);
-                }
+                add_realign_pair(settings, a + i);
             } else if(settings->write_supp & (bam_aux_get((a + i), "SA") || bam_aux_get((a + i), "ms"))) {
                 assert(((a + i)->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) == 0);
-                //LOG_DEBUG("Trying to write write supp or stuff.\n");
                 // Has an SA or ms tag, meaning that the read or its mate had a supplementary alignment
-                qname = bam_get_qname((a + i));
                 bam_aux_append(a + i, "SP", 'i', sizeof(int), const_cast<uint8_t *>(reinterpret_cast<const uint8_t*>(&sp)));
-                if(settings->realign_pairs.find(qname) == settings->realign_pairs.end()) {
-                    settings->realign_pairs[qname] = dlib::bam2cppstr((a + i));
-                } else {
-                    // Make sure the read names/barcodes match.
-                    //assert(memcmp(settings->realign_pairs[qname].c_str() + 1, qname.c_str(), qname.size() - 1) == 0);
-                    // Write read 1 out first.
-                    if((a + i)->core.flag & BAM_FREAD2) {
-                        fputs(settings->realign_pairs[qname].c_str(), settings->fqh);
-                        //bam2ffq((a + i), settings->fqh, qname);
-                        bam2ffq((a + i), settings->fqh, 1);
-                    } else {
-                        //bam2ffq((a + i), settings->fqh, qname);
-                        bam2ffq((a + i), settings->fqh, 1);
-                        fputs(settings->realign_pairs[qname].c_str(), settings->fqh);
-                    }
-                    // Clear entry, as there can only be two.
-                    settings->realign_pairs.erase(qname);
-                }
+                add_realign_pair(settings, a + i, 1);
             } else {
                 for(const char *tag: {"MU", "ms", "LM"})
                     if((data = bam_aux_get((a + i), tag)))
@@ -382,26 +400,146 @@ void Stack<fn>::write_stack_pe(rsq_aux_t *settings)
     clear();
 }
 
-inline void bam2ffq(bam1_t *b, FILE *fp, const int is_supp)
+static inline void unpack_pending(const MateStore::entry_t &e, bam1_t *b)
+{
+    memcpy(&b->core, e.val, sizeof(bam1_core_t));
+    b->l_data = e.len - sizeof(bam1_core_t);
+    if(b->m_data < b->l_data) {
+        b->m_data = b->l_data;
+        kroundup32(b->m_data);
+        b->data = (uint8_t *)realloc(b->data, b->m_data);
+    }
+    memcpy(b->data, e.val + sizeof(bam1_core_t), b->l_data);
+}
+
+static inline void write_pending_fq(rsq_aux_t *settings, const MateStore::entry_t &e)
+{
+    if(e.flag & PENDING_BAM) {
+        unpack_pending(e, settings->mate_buf[0]);
+        settings->fqbuf.l = 0;
+        bam2ffq(settings->mate_buf[0], &settings->fqbuf);
+        write_fq(settings->fqh, settings->fqbuf.s, settings->fqbuf.l);
+    } else write_fq(settings->fqh, e.val, e.len);
+}
+
+/*
+ * Points b's mate fields and mate tags at mate. A kept pair is joined by name,
+ * and when merging switched a record's name, its mate is no longer the record whose
+ * coordinates it carries, so these are recomputed rather than trusted.
+ */
+static void set_mate_fields(bam1_t *b, const bam1_t *mate)
+{
+    b->core.mtid = mate->core.tid;
+    b->core.mpos = mate->core.pos;
+    b->core.flag &= ~(BAM_FMREVERSE | BAM_FMUNMAP);
+    if(mate->core.flag & BAM_FREVERSE) b->core.flag |= BAM_FMREVERSE;
+    if(mate->core.flag & BAM_FUNMAP) b->core.flag |= BAM_FMUNMAP;
+    if(b->core.tid == mate->core.tid && !((b->core.flag | mate->core.flag) & BAM_FUNMAP)) {
+        const int32_t beg(std::min(b->core.pos, mate->core.pos)), end(std::max(bam_endpos(b), bam_endpos(mate)));
+        // The leftmost read gets the positive template length, and read 1 on a tie.
+        const int leftmost(b->core.pos != mate->core.pos ? b->core.pos < mate->core.pos: !!(b->core.flag & BAM_FREAD1));
+        b->core.isize = leftmost ? end - beg: beg - end;
+    } else b->core.isize = 0;
+    uint8_t *data;
+    if((data = bam_aux_get(b, "MQ"))) {
+        bam_aux_del(b, data);
+        const int32_t mq(mate->core.qual);
+        bam_aux_append(b, "MQ", 'i', sizeof(mq), (uint8_t *)&mq);
+    }
+    if((data = bam_aux_get(b, "MC"))) {
+        bam_aux_del(b, data);
+        kstring_t ks{0, 0, nullptr};
+        const uint32_t *cigar(bam_get_cigar(mate));
+        for(uint32_t i(0); i < mate->core.n_cigar; ++i) {
+            kputw(bam_cigar_oplen(cigar[i]), &ks);
+            kputc(bam_cigar_opchr(cigar[i]), &ks);
+        }
+        if(ks.l == 0) kputc('*', &ks);
+        bam_aux_append(b, "MC", 'Z', ks.l + 1, (uint8_t *)ks.s);
+        free(ks.s);
+    }
+}
+
+static void write_realign_pair(rsq_aux_t *settings, const MateStore::entry_t &prev, const MateStore::entry_t &cur)
+{
+    // Write read 1 out first so that the output is interleaved.
+    const MateStore::entry_t &r1(cur.flag & PENDING_READ2 ? prev: cur), &r2(cur.flag & PENDING_READ2 ? cur: prev);
+    if(r1.flag & r2.flag & PENDING_BAM) {
+        // Both alignments are still valid, so the pair skips realignment.
+        bam1_t *const b1(settings->mate_buf[0]), *const b2(settings->mate_buf[1]);
+        unpack_pending(r1, b1);
+        unpack_pending(r2, b2);
+        set_mate_fields(b1, b2);
+        set_mate_fields(b2, b1);
+        sam_write1(settings->out, settings->hdr, b1);
+        sam_write1(settings->out, settings->hdr, b2);
+        settings->n_kept += 2;
+    } else {
+        write_pending_fq(settings, r1);
+        write_pending_fq(settings, r2);
+        settings->n_realigned += 2;
+    }
+}
+
+void add_realign_pair(rsq_aux_t *settings, bam1_t *b, const int is_supp)
+{
+    uint8_t flag((b->core.flag & BAM_FREAD2) ? PENDING_READ2: 0);
+    uint8_t *data;
+    settings->pendbuf.l = 0;
+    if(!is_supp && keeps_alignment(settings, bam_aux_get(b, "NC"))) {
+        // Pairs are only kept if both mates qualify, so hold on to the record itself.
+        // Without the reference, NM and MD cannot be recomputed for the masked bases, so they are removed.
+        for(const char *tag: {"MU", "ms", "LM", "NM", "MD"})
+            if((data = bam_aux_get(b, tag)))
+                bam_aux_del(b, data);
+        kputsn((char *)&b->core, sizeof(bam1_core_t), &settings->pendbuf);
+        kputsn((char *)b->data, b->l_data, &settings->pendbuf);
+        flag |= PENDING_BAM;
+    } else bam2ffq(b, &settings->pendbuf, is_supp);
+    settings->realign_pairs->add(bam_get_qname(b), settings->pendbuf.s, settings->pendbuf.l, flag,
+                                 [settings](const char *, const MateStore::entry_t &prev, const MateStore::entry_t &cur) {
+        write_realign_pair(settings, prev, cur);
+    });
+}
+
+void finish_realign_pairs(rsq_aux_t *settings)
+{
+    // Pairs whose first mate was spilled to disk are joined and written here.
+    const uint64_t n_orphans(settings->realign_pairs->finish(
+        [settings](const char *, const MateStore::entry_t &prev, const MateStore::entry_t &cur) {
+            write_realign_pair(settings, prev, cur);
+        },
+        [](const char *qname, const MateStore::entry_t &orphan) {
+#if !NDEBUG
+            if(orphan.flag & PENDING_BAM) puts(qname);
+            else fwrite(orphan.val, 1, orphan.len, stdout);
+#endif
+        }));
+    // Handle any unpaired reads, though there shouldn't be any in real datasets.
+    LOG_DEBUG("Number of orphan reads: %lu.\n", n_orphans);
+    if(n_orphans && settings->accept_unbalanced == 0)
+        LOG_EXIT("There shouldn't be orphan reads in real datasets. Number found: %lu\n", n_orphans);
+}
+
+inline void bam2ffq(bam1_t *b, kstring_t *ks, const int is_supp)
 {
     int i;
     uint8_t *rvdata;
-    kstring_t ks{0, 120uL, (char *)malloc(120uL)};
-    kputc('@', &ks);
-    kputsn(bam_get_qname(b), b->core.l_qname - 1, &ks);
-    kputsnl(" PV:B:I", &ks);
+    kputc('@', ks);
+    kputsn(bam_get_qname(b), b->core.l_qname - 1, ks);
+    kputsnl(" PV:B:I", ks);
     auto fa((uint32_t *)dlib::array_tag(b, "FA"));
     auto pv((uint32_t *)dlib::array_tag(b, "PV"));
-    for(i = 0; i < b->core.l_qseq; ++i) ksprintf(&ks, ",%u", pv[i]);
-    kputsnl("\tFA:B:I", &ks);
-    for(i = 0; i < b->core.l_qseq; ++i) ksprintf(&ks, ",%u", fa[i]);
-    ksprintf(&ks, "\tFM:i:%i\tFP:i:%i", bam_itag(b, "FM"), bam_itag(b, "FP"));
-    write_if_found(rvdata, b, "RV", ks);
-    write_if_found(rvdata, b, "NC", ks);
-    write_if_found(rvdata, b, "DR", ks);
-    write_if_found(rvdata, b, "NP", ks);
-    if(is_supp) kputsnl("\tSP:i:1", &ks);
-    kputc('\n', &ks);
+    for(i = 0; i < b->core.l_qseq; ++i) ksprintf(ks, ",%u", pv[i]);
+    kputsnl("\tFA:B:I", ks);
+    for(i = 0; i < b->core.l_qseq; ++i) ksprintf(ks, ",%u", fa[i]);
+    ksprintf(ks, "\tFM:i:%i\tFP:i:%i", bam_itag(b, "FM"), bam_itag(b, "FP"));
+    write_if_found(rvdata, b, "RV", *ks);
+    write_if_found(rvdata, b, "NC", *ks);
+    write_if_found(rvdata, b, "DR", *ks);
+    write_if_found(rvdata, b, "NP", *ks);
+    if(is_supp) kputsnl("\tSP:i:1", ks);
+    kputc('\n', ks);
     uint8_t *seq(bam_get_seq(b));
     char *seqbuf((char *)malloc(b->core.l_qseq + 1));
     for (i = 0; i < b->core.l_qseq; ++i) seqbuf[i] = seq_nt16_str[bam_seqi(seq, i)];
@@ -416,8 +554,8 @@ inline void bam2ffq(bam1_t *b, FILE *fp, const int is_supp)
     }
     seqbuf[b->core.l_qseq] = '\0';
     assert(strlen(seqbuf) == (uint64_t)b->core.l_qseq);
-    kputsn(seqbuf, b->core.l_qseq, &ks);
-    kputsnl("\n+\n", &ks);
+    kputsn(seqbuf, b->core.l_qseq, ks);
+    kputsnl("\n+\n", ks);
     uint8_t *qual(bam_get_qual(b));
     for(i = 0; i < b->core.l_qseq; ++i) seqbuf[i] = 33 + qual[i];
     if (b->core.flag & BAM_FREVERSE) { // reverse
@@ -427,9 +565,8 @@ inline void bam2ffq(bam1_t *b, FILE *fp, const int is_supp)
             seqbuf[i] = t;
         }
     }
-    kputsn(seqbuf, b->core.l_qseq, &ks), free(seqbuf);
-    kputc('\n', &ks);
-    fputs(ks.s, fp), free(ks.s);
+    kputsn(seqbuf, b->core.l_qseq, ks), free(seqbuf);
+    kputc('\n', ks);
 }
 
 
@@ -748,6 +885,57 @@ void bam_rsq_bookends(rsq_aux_t *settings)
     }
 }
 
+static void open_realign_fq(rsq_aux_t *settings, const char *fqname, int level, int fifo)
+{
+    if(fifo) {
+        struct stat st;
+        if(stat(fqname, &st) == 0 ? !S_ISFIFO(st.st_mode): mkfifo(fqname, 0600))
+            LOG_EXIT("Could not create FIFO at %s. Abort!\n", fqname);
+        LOG_INFO("Waiting for a reader to open the realignment FIFO %s.\n", fqname);
+    }
+    if(level < 0) level = fifo ? 0: 1;
+    char fqmode[4]{'w', level ? (char)('0' + level): 'u', '\0'};
+    if((settings->fqh = bgzf_open(fqname, fqmode)) == nullptr)
+        LOG_EXIT("Failed to open output fastq for writing. Abort!\n");
+    if(level) bmf_thread_pool_attach_bgzf(settings->fqh);
+}
+
+/*
+ * Runs rescue over settings->src (or settings->in) and releases everything but in, out, and hdr.
+ */
+static void run_rescue(rsq_aux_t *settings, size_t max_pending_mem, const char *tmp_prefix, const char *fqname)
+{
+    settings->realign_pairs = new MateStore(max_pending_mem, tmp_prefix);
+    settings->mate_buf[0] = bam_init1(), settings->mate_buf[1] = bam_init1();
+    bam_rsq_bookends(settings);
+    LOG_INFO("Merged reads written without realignment: %lu. Merged reads to realign: %lu.\n",
+             settings->n_kept, settings->n_realigned);
+    delete settings->realign_pairs;
+    bam_destroy1(settings->mate_buf[0]), bam_destroy1(settings->mate_buf[1]);
+    free(settings->fqbuf.s);
+    free(settings->pendbuf.s);
+    if(bgzf_close(settings->fqh))
+        LOG_EXIT("Failed to close realignment fastq %s. Abort!\n", fqname);
+}
+
+// Options shared by rsq and markrsq.
+static const char RESCUE_USAGE[]{
+                    "-s      Flag to write reads with supplementary alignments . Default: False.\n"
+                    "-S      Flag to indicate that this rescue is for single-end data.\n"
+                    "-t      Mismatch limit. Default: 2\n"
+                    "-l      Set bam compression level. Valid: 0-9. (0 == uncompressed)\n"
+                    "-m      Trust unmasked bases if reads being collapsed disagree but one is unmasked. Default: mask anyways.\n"
+                    "-i      Flag to ignore barcodes and infer solely by positional information.\n"
+                    "-u      Ignore unbalanced pairs. Typically, unbalanced pairs means the bam is corrupted or unsorted.\n"
+                    "        Use this flag to still return a zero exit status, but only use if you know what you're doing.\n"
+                    "-M      Memory limit for reads to realign whose mates have not yet been found. K/M/G suffixes allowed. Default: 256M.\n"
+                    "-z      Compression level for the realignment fastq. 0 writes plain text. Default: 1, or 0 with -F.\n"
+                    "        Compressed output is BGZF, which can be read directly by the aligner,\n"
+                    "        and is compressed on the threads set by bmftools -@.\n"
+                    "-r      Realign all merged reads. Default: merged reads (and pairs) whose bases were only masked keep their alignments.\n"
+                    "-F      Create the realignment fastq path as a FIFO for the aligner to read from.\n"
+                    "        rsq blocks until a reader opens the other end.\n"
+};
 
 int rsq_usage(int retcode)
 {
@@ -759,16 +947,15 @@ int rsq_usage(int retcode)
                     "Usage:  bmftools rsq <input.srt.bam> <output.bam>\n\n"
                     "Flags:\n"
                     "-f      Path for the fastq for reads that need to be realigned. REQUIRED.\n"
-                    "-s      Flag to write reads with supplementary alignments . Default: False.\n"
-                    "-S      Flag to indicate that this rescue is for single-end data.\n"
-                    "-t      Mismatch limit. Default: 2\n"
-                    "-l      Set bam compression level. Valid: 0-9. (0 == uncompressed)\n"
-                    "-m      Trust unmasked bases if reads being collapsed disagree but one is unmasked. Default: mask anyways.\n"
-                    "-i      Flag to ignore barcodes and infer solely by positional information.\n"
-                    "-u      Ignore unbalanced pairs. Typically, unbalanced pairs means the bam is corrupted or unsorted.\n"
-                    "        Use this flag to still return a zero exit status, but only use if you know what you're doing.\n"
-                    "This flag adds artificial auxiliary tags to treat unbarcoded reads as if they were singletons.\n"
-            );
+                    "%s"
+                    "-T      Prefix for temporary files holding pending mates past the memory limit. Default: <output.bam>.rsq\n"
+                    "-P      Hash records into <INT> partitions by alignment signature instead of requiring positional_rescue sort order.\n"
+                    "        Accepts coordinate-sorted or unsorted (but marked) input. Default: 0 (disabled).\n"
+                    "-b      Memory limit for sorting each partition with -P. K/M/G suffixes allowed. Default: 768M.\n"
+                    "-K      Sort key index written alongside the input by bmftools sort -K.\n"
+                    "        Stacks are grouped by the stored keys rather than by re-deriving them from each record's tags.\n"
+                    "This flag adds artificial auxiliary tags to treat unbarcoded reads as if they were singletons.\n",
+            RESCUE_USAGE);
     return retcode;
 }
 
@@ -782,11 +969,14 @@ int rsq_main(int argc, char *argv[])
     settings.mmlim = 2;
     assert(!settings.is_se);
 
-    char *fqname(nullptr);
+    char *fqname(nullptr), *tmp_prefix(nullptr), *key_path(nullptr);
+    size_t max_pending_mem(256uL << 20), max_sort_mem(768uL << 20);
+    int fq_level(-1), fq_fifo(0);
+    unsigned n_parts(0);
 
     if(argc < 3) return rsq_usage(EXIT_FAILURE);
 
-    while ((c = getopt(argc, argv, "l:f:t:miSHsh?")) >= 0) {
+    while ((c = getopt(argc, argv, "K:P:b:z:T:M:l:f:t:rFmiSHsuh?")) >= 0) {
         switch (c) {
         case 's': settings.write_supp = 1; break;
         case 'S': settings.is_se = 1; break;
@@ -796,6 +986,14 @@ int rsq_main(int argc, char *argv[])
         case 'f': fqname = optarg; break;
         case 'l': wmode[2] = atoi(optarg)%10 + '0';break;
         case 'i': settings.infer = 1; break;
+        case 'M': max_pending_mem = parse_memory_string(optarg); break;
+        case 'T': tmp_prefix = optarg; break;
+        case 'z': fq_level = atoi(optarg) % 10; break;
+        case 'F': fq_fifo = 1; break;
+        case 'r': settings.realign_all = 1; break;
+        case 'P': n_parts = strtoul(optarg, nullptr, 10); break;
+        case 'b': max_sort_mem = parse_memory_string(optarg); break;
+        case 'K': key_path = optarg; break;
         case '?': case 'h': case 'H': return rsq_usage(EXIT_SUCCESS);
         }
     }
@@ -806,12 +1004,10 @@ int rsq_main(int argc, char *argv[])
         fprintf(stderr, "Fastq path for rescued reads required. Abort!\n");
         return rsq_usage(EXIT_FAILURE);
     }
+    if(key_path && n_parts)
+        LOG_EXIT("A sort key index (-K) follows the input's order, so it cannot be combined with -P. Abort!\n");
 
-    settings.fqh = fopen(fqname, "w");
-
-    if(!settings.fqh)
-        LOG_EXIT("Failed to open output fastq for writing. Abort!\n");
-
+    open_realign_fq(&settings, fqname, fq_level, fq_fifo);
 
     if(!settings.infer)
         for(const char *tag: {"FM", "FA", "PV", "FP"})
@@ -828,14 +1024,170 @@ int rsq_main(int argc, char *argv[])
     settings.out = sam_open(argv[optind+1], wmode);
     if (settings.in == 0 || settings.out == 0)
         LOG_EXIT("fail to read/write input files\n");
+    bmf_thread_pool_attach(settings.in);
+    bmf_thread_pool_attach(settings.out);
     sam_hdr_write(settings.out, settings.hdr);
 
-    bam_rsq_bookends(&settings);
+    const std::string prefix(tmp_prefix ? std::string(tmp_prefix): std::string(argv[optind + 1]) + ".rsq");
+    RescuePartitioner *parts(nullptr);
+    if(n_parts) {
+        parts = new RescuePartitioner(settings.hdr, n_parts, max_sort_mem, prefix.c_str(), settings.is_se);
+        parts->partition(settings.in);
+        settings.src = parts;
+    }
+    if(key_path) open_key_index(&settings, key_path);
+    run_rescue(&settings, max_pending_mem, prefix.c_str(), fqname);
+    if(key_path) close_key_index(&settings);
+    delete parts;
     bam_hdr_destroy(settings.hdr);
     sam_close(settings.in); sam_close(settings.out);
-    if(settings.fqh) fclose(settings.fqh);
     LOG_INFO("Successfully completed bmftools rsq.\n");
     return EXIT_SUCCESS;
 }
 
+int markrsq_usage(int retcode)
+{
+    fprintf(stderr,
+                    "Marks, sorts, and positionally rescues a name-sorted bam in one pass.\n"
+                    "Equivalent to bmftools mark | bmftools sort | bmftools rsq, "
+                    "but records are tagged in flight and sorted in memory, only spilling to disk past the sort memory limit.\n"
+                    "Usage:  bmftools markrsq <opts> <input.namesrt.bam> <output.bam>\n\n"
+                    "Flags:\n"
+                    "-f      Path for the fastq for reads that need to be realigned. REQUIRED.\n"
+                    "-b      Memory limit for the sort buffer. K/M/G suffixes allowed. Default: 768M.\n"
+                    "Mark options:\n"
+                    "-q      Skip read pairs which fail.\n"
+                    "-I      Skip read pairs whose insert size is less than <INT>.\n"
+                    "-n      Skip read pairs where both reads have a fraction of unambiguous base calls >= <FLOAT>\n"
+                    "-U      Add unclipped start tags.\n"
+                    "Rescue options (see bmftools rsq):\n"
+                    "%s"
+                    "-T      Prefix for temporary files (sorted runs and pending mates). Default: <output.bam>.rsq\n",
+            RESCUE_USAGE);
+    return retcode;
+}
+
+/*
+ * Reads a name-sorted bam, marks it as bmftools mark would, and buffers the marked records
+ * in a RescueSorter, which then stands in for the positional_rescue-sorted input to rsq.
+ * Each pair must be a read 1 followed by its read 2, as in a name-sorted bam, or this exits.
+ */
+static void mark_into(RescueSorter &sorter, samFile *in, bam_hdr_t *hdr, mark_settings_t *mark, int is_se)
+{
+    bam1_t *b(bam_init1()), *b1(bam_init1());
+    uint64_t count(0), n_skipped(0);
+    while(LIKELY(sam_read1(in, hdr, b) >= 0)) {
+        if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records marked: %lu.\n", count);
+        if(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
+        if(is_se) {
+            if(add_se_tags(b, mark) == 0) sorter.add(b);
+            else ++n_skipped;
+            continue;
+        }
+        switch(b->core.flag & (BAM_FREAD1 | BAM_FREAD2)) {
+        case BAM_FREAD1:
+            if(UNLIKELY(b1->l_data))
+                LOG_EXIT("Read 1 %s has no read 2. Is this bam namesorted?\n", bam_get_qname(b1));
+            bam_copy1(b1, b);
+            continue;
+        case BAM_FREAD2:
+            if(UNLIKELY(b1->l_data == 0))
+                LOG_EXIT("Read 2 %s has no preceding read 1. Is this bam namesorted?\n", bam_get_qname(b));
+            if(UNLIKELY(strcmp(bam_get_qname(b1), bam_get_qname(b))))
+                LOG_EXIT("Read 1 %s is followed by read 2 %s. Is this bam namesorted?\n",
+                         bam_get_qname(b1), bam_get_qname(b));
+            break;
+        default:
+            LOG_EXIT("Record %s is not read 1 or read 2 of a pair. Use -S for single-end data.\n", bam_get_qname(b));
+        }
+        if(add_pe_tags(b1, b, mark) == 0) sorter.add(b1), sorter.add(b);
+        else n_skipped += 2;
+        b1->l_data = 0;
+    }
+    if(UNLIKELY(b1->l_data))
+        LOG_EXIT("Read 1 %s has no read 2. Is this bam namesorted?\n", bam_get_qname(b1));
+    LOG_INFO("Marked %lu records, skipped %lu.\n", sorter.size(), n_skipped);
+    bam_destroy1(b1);
+    bam_destroy1(b);
+    sorter.finalize();
+}
+
+int markrsq_main(int argc, char *argv[])
+{
+    int c;
+    char wmode[4]{"wb"};
+
+    rsq_aux_t settings{0};
+    settings.mmlim = 2;
+    mark_settings_t mark;
+
+    char *fqname(nullptr), *tmp_prefix(nullptr);
+    size_t max_pending_mem(256uL << 20), max_sort_mem(768uL << 20);
+    int fq_level(-1), fq_fifo(0);
+
+    if(argc < 3) return markrsq_usage(EXIT_FAILURE);
+
+    while ((c = getopt(argc, argv, "b:I:n:z:T:M:l:f:t:qUrFmiSsuh?")) >= 0) {
+        switch (c) {
+        case 'b': max_sort_mem = parse_memory_string(optarg); break;
+        case 'q': mark.remove_qcfail = 1; break;
+        case 'I': mark.min_insert_length = (uint32_t)atoi(optarg); break;
+        case 'n': mark.min_frac_unambiguous = atof(optarg); break;
+        case 'U': mark.add_unclipped_start = 1; break;
+        case 's': settings.write_supp = 1; break;
+        case 'S': settings.is_se = 1; break;
+        case 'm': settings.trust_unmasked = 1; break;
+        case 'u': settings.accept_unbalanced = 1; break;
+        case 't': settings.mmlim = atoi(optarg); break;
+        case 'f': fqname = optarg; break;
+        case 'l': wmode[2] = atoi(optarg)%10 + '0';break;
+        case 'i': settings.infer = 1; break;
+        case 'M': max_pending_mem = parse_memory_string(optarg); break;
+        case 'T': tmp_prefix = optarg; break;
+        case 'z': fq_level = atoi(optarg) % 10; break;
+        case 'F': fq_fifo = 1; break;
+        case 'r': settings.realign_all = 1; break;
+        case '?': case 'h': return markrsq_usage(EXIT_SUCCESS);
+        }
+    }
+    if (optind + 2 > argc)
+        return markrsq_usage(EXIT_FAILURE);
+
+    if(!fqname) {
+        fprintf(stderr, "Fastq path for rescued reads required. Abort!\n");
+        return markrsq_usage(EXIT_FAILURE);
+    }
+    const std::string prefix(tmp_prefix ? std::string(tmp_prefix): std::string(argv[optind + 1]) + ".rsq");
+
+    if(!settings.infer)
+        for(const char *tag: {"FM", "FA", "PV", "FP"})
+            dlib::check_bam_tag_exit(argv[optind], tag);
+    settings.in = sam_open(argv[optind], "r");
+    if(settings.in == nullptr || (settings.hdr = sam_hdr_read(settings.in)) == nullptr || settings.hdr->n_targets == 0)
+        LOG_EXIT("input SAM does not have header. Abort!\n");
+    bmf_thread_pool_attach(settings.in);
+    dlib::add_pg_line(settings.hdr, argc, argv, "bmftools markrsq", BMF_VERSION, "bmftools",
+            "Adds mate information and uses positional information to rescue reads with errors in the barcode.");
+    // The output is in rescue order, as from rsq, rather than in the input's name order.
+    if(change_SO(settings.hdr, SO_STR))
+        LOG_EXIT("Could not set the sort order of the output header. Abort!\n");
+
+    RescueSorter sorter(settings.hdr, max_sort_mem, (prefix + ".sort").c_str(), settings.is_se);
+    mark_into(sorter, settings.in, settings.hdr, &mark, settings.is_se);
+    if(sorter.spills())
+        LOG_INFO("Sort buffer spilled %lu runs to disk.\n", sorter.spills());
+    settings.src = &sorter;
+
+    open_realign_fq(&settings, fqname, fq_level, fq_fifo);
+    if((settings.out = sam_open(argv[optind+1], wmode)) == nullptr)
+        LOG_EXIT("fail to read/write input files\n");
+    bmf_thread_pool_attach(settings.out);
+    sam_hdr_write(settings.out, settings.hdr);
+    run_rescue(&settings, max_pending_mem, prefix.c_str(), fqname);
+    bam_hdr_destroy(settings.hdr);
+    sam_close(settings.in); sam_close(settings.out);
+    LOG_INFO("Successfully completed bmftools markrsq.\n");
+    return EXIT_SUCCESS;
+}
+
 }
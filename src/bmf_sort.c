@@ -34,6 +34,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <string.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <assert.h>
@@ -43,6 +44,11 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/kstring.h"
 #include "htslib/sam.h"
 #include "sam_opts.h"
+#include "lz_block.h"
+#include "memory_string.h"
+#include "sort_order.h"
+#include "sort_keys.h"
+#include "bmf_threads.h"
 #include "bmf_sort.h"
 
 #if !defined(__DARWIN_C_LEVEL) || __DARWIN_C_LEVEL < 900000L
@@ -1091,6 +1097,16 @@ static inline uint64_t heap_pos(bam1_t *const b)
  * file. Finally we write our chosen read it to the output file.
  */
 
+/*
+ * Runs fp's BGZF work on the bmftools -@ pool if there is one, so that sort does not start
+ * a second set of threads alongside it, or on a pool of its own otherwise.
+ */
+static void sort_set_threads(htsFile *fp, int n_threads)
+{
+    if (bmf_thread_pool()) bmf_thread_pool_attach(fp);
+    else if (n_threads > 1) hts_set_threads(fp, n_threads);
+}
+
 /*!
   @abstract    Merge multiple sorted BAM.
   @param  l_cmpkey whether to sort by query name
@@ -1349,7 +1365,7 @@ int bam_merge_core2(int merge_cmpkey, const char *out, const char *mode,
         sam_close(fpout);
         return -1;
     }
-    if (!(flag & MERGE_UNCOMP)) hts_set_threads(fpout, n_threads);
+    if (!(flag & MERGE_UNCOMP)) sort_set_threads(fpout, n_threads);
 
     // Begin the actual merge
     ks_heapmake(heap, n, heap);
@@ -1575,40 +1591,6 @@ end:
 
 #include <pthread.h>
 
-static int change_SO(bam_hdr_t *h, const char *so)
-{
-    char *p, *q, *beg = NULL, *end = NULL, *newtext;
-    if (h->l_text > 3) {
-        if (strncmp(h->text, "@HD", 3) == 0) {
-            if ((p = strchr(h->text, '\n')) == 0) return -1;
-            *p = '\0';
-            if ((q = strstr(h->text, "\tSO:")) != 0) {
-                *p = '\n'; // change back
-                if (strncmp(q + 4, so, p - q - 4) != 0) {
-                    beg = q;
-                    for (q += 4; *q != '\n' && *q != '\t'; ++q);
-                    end = q;
-                } else return 0; // no need to change
-            } else beg = end = p, *p = '\n';
-        }
-    }
-    if (beg == NULL) { // no @HD
-        h->l_text += strlen(so) + 15;
-        newtext = (char*)malloc(h->l_text + 1);
-        sprintf(newtext, "@HD\tVN:1.3\tSO:%s\n", so);
-        strcat(newtext, h->text);
-    } else { // has @HD but different or no SO
-        h->l_text = (beg - h->text) + (4 + strlen(so)) + (h->text + h->l_text - end);
-        newtext = (char*)malloc(h->l_text + 1);
-        strncpy(newtext, h->text, beg - h->text);
-        sprintf(newtext + (beg - h->text), "\tSO:%s", so);
-        strcat(newtext, end);
-    }
-    free(h->text);
-    h->text = newtext;
-    return 0;
-}
-
 static inline int bam1_lt_bmf(const bam1_p a, const bam1_p b)
 {
     if(is_se) return bmfsort_se_key(a) < bmfsort_se_key(b);
@@ -1618,29 +1600,711 @@ static inline int bam1_lt_bmf(const bam1_p a, const bam1_p b)
                             : bmfsort_mate_key(a) < bmfsort_mate_key(b);
 }
 
-KSORT_INIT(sort, bam1_p, bam1_lt_bmf)
+/*
+ * Sort keys are computed once per record and packed alongside the record pointer,
+ * then sorted with a stable LSD radix sort or by merging presorted runs. This produces
+ * the same order as a merge sort with bam1_lt_bmf, without rederiving keys on each comparison.
+ */
+typedef struct {
+    uint64_t key; // bmfsort_core_key, or bmfsort_se_key if is_se.
+    uint64_t mkey; // bmfsort_mate_key, or 0 if is_se.
+    bam1_p b;
+} bmf_sort_rec_t;
+
+static inline void sort_keys(bam1_p b, uint64_t *key, uint64_t *mkey)
+{
+    if (is_se) *key = bmfsort_se_key(b), *mkey = 0;
+    else *key = bmfsort_core_key(b), *mkey = bmfsort_mate_key(b);
+}
+
+static inline uint8_t sort_rec_byte(const bmf_sort_rec_t *r, int pass)
+{
+    // Passes 0-7 cover the mate key, least significant byte first, then 8-15 the core key.
+    return pass < 8 ? (uint8_t)(r->mkey >> (pass << 3)): (uint8_t)(r->key >> ((pass - 8) << 3));
+}
+
+static inline int sort_rec_lt(const bmf_sort_rec_t *a, const bmf_sort_rec_t *b)
+{
+    return a->key != b->key ? a->key < b->key: a->mkey < b->mkey;
+}
+
+// Stable merge of src[lo, mid) and src[mid, hi) into dst[lo, hi).
+static void merge_recs(const bmf_sort_rec_t *src, bmf_sort_rec_t *dst, size_t lo, size_t mid, size_t hi)
+{
+    size_t i = lo, j = mid, k = lo;
+    while (i < mid && j < hi) dst[k++] = sort_rec_lt(src + j, src + i) ? src[j++]: src[i++];
+    while (i < mid) dst[k++] = src[i++];
+    while (j < hi) dst[k++] = src[j++];
+}
+
+/*
+ * Merges the n_runs ascending runs already present in recs pairwise, alternating with tmp.
+ * Returns whichever of recs or tmp holds the sorted records, or NULL on allocation failure.
+ */
+static bmf_sort_rec_t *natural_merge_recs(size_t n, size_t n_runs, bmf_sort_rec_t *recs, bmf_sort_rec_t *tmp)
+{
+    size_t i, r, *bounds;
+    bmf_sort_rec_t *swap;
+    if ((bounds = (size_t*)malloc((n_runs + 1) * sizeof(size_t))) == NULL) return NULL;
+    bounds[0] = 0;
+    for (i = 1, r = 0; i < n; ++i)
+        if (sort_rec_lt(recs + i, recs + i - 1)) bounds[++r] = i;
+    bounds[n_runs] = n;
+    while (n_runs > 1) {
+        for (r = 0; r < n_runs; r += 2) {
+            merge_recs(recs, tmp, bounds[r], bounds[r + 1], r + 2 <= n_runs ? bounds[r + 2]: n);
+            bounds[r >> 1] = bounds[r];
+        }
+        n_runs = (n_runs + 1) >> 1;
+        bounds[n_runs] = n;
+        swap = recs, recs = tmp, tmp = swap;
+    }
+    free(bounds);
+    return recs;
+}
+
+/*
+ * Sorts recs, whose keys have already been filled in, using tmp (also n long) as scratch.
+ * Input often arrives in long ascending runs (e.g., merged sorted shards or re-sorting sorted output),
+ * so runs are counted alongside the radix histograms. If merging the runs takes fewer passes
+ * than the radix sort would, they are merged instead, and already-sorted input is left as is.
+ * Returns whichever of recs or tmp holds the sorted records, or NULL on allocation failure.
+ */
+static bmf_sort_rec_t *sort_recs(size_t n, bmf_sort_rec_t *recs, bmf_sort_rec_t *tmp)
+{
+    size_t i, n_runs = 1, (*counts)[256];
+    int pass, j, n_passes = 0, n_rounds = 0;
+    bmf_sort_rec_t *swap;
+    if (n < 2) return recs;
+    if ((counts = calloc(16, sizeof(*counts))) == NULL) return NULL;
+    // Every pass's histogram and the number of ascending runs in a single sweep.
+    for (i = 0; i < n; ++i) {
+        for (pass = 0; pass < 16; ++pass) ++counts[pass][sort_rec_byte(recs + i, pass)];
+        if (i && sort_rec_lt(recs + i, recs + i - 1)) ++n_runs;
+    }
+    // Bytes which are identical across the buffer (e.g., high bytes of tid or all of mkey for single-end) need no pass.
+    for (pass = 0; pass < 16; ++pass) n_passes += counts[pass][sort_rec_byte(recs, pass)] != n;
+    while (((size_t)1 << n_rounds) < n_runs) ++n_rounds;
+    if (n_rounds <= n_passes) {
+        free(counts);
+        return natural_merge_recs(n, n_runs, recs, tmp);
+    }
+    for (pass = 0; pass < 16; ++pass) {
+        size_t offset = 0, c;
+        if (counts[pass][sort_rec_byte(recs, pass)] == n) continue;
+        for (j = 0; j < 256; ++j) c = counts[pass][j], counts[pass][j] = offset, offset += c;
+        for (i = 0; i < n; ++i) tmp[counts[pass][sort_rec_byte(recs + i, pass)]++] = recs[i];
+        swap = recs, recs = tmp, tmp = swap;
+    }
+    free(counts);
+    return recs;
+}
+
+// Returns 0 for success, -1 on allocation failure.
+static int radix_sort_bmf(size_t n, bam1_p *buf)
+{
+    size_t i;
+    bmf_sort_rec_t *recs, *tmp, *out;
+    if (n < 2) return 0;
+    recs = (bmf_sort_rec_t*)malloc(n * sizeof(bmf_sort_rec_t));
+    tmp = (bmf_sort_rec_t*)malloc(n * sizeof(bmf_sort_rec_t));
+    if (!recs || !tmp) {
+        free(recs); free(tmp);
+        return -1;
+    }
+    for (i = 0; i < n; ++i) {
+        recs[i].b = buf[i];
+        sort_keys(buf[i], &recs[i].key, &recs[i].mkey);
+    }
+    if ((out = sort_recs(n, recs, tmp)) != NULL)
+        for (i = 0; i < n; ++i) buf[i] = out[i].b;
+    free(recs); free(tmp);
+    return out ? 0: -1;
+}
+
+/*
+ * Parallel in-memory sort, for input which fits in the sort buffers.
+ * Each thread computes keys for and radix sorts its own slice, then adjacent slices
+ * are merged pairwise (in parallel within each round) until one sorted array remains.
+ * Ties are taken from the left slice, so the result is the same as radix_sort_bmf's.
+ */
+typedef struct {
+    bmf_sort_rec_t *recs, *tmp;
+    bam1_p *buf;
+    size_t lo, mid, hi;
+    int error;
+} mem_sort_t;
+
+static void *mem_sort_worker(void *data)
+{
+    mem_sort_t *m = (mem_sort_t*)data;
+    bmf_sort_rec_t *recs = m->recs + m->lo, *out;
+    size_t i, n = m->hi - m->lo;
+    for (i = 0; i < n; ++i) {
+        recs[i].b = m->buf[m->lo + i];
+        sort_keys(recs[i].b, &recs[i].key, &recs[i].mkey);
+    }
+    if ((out = sort_recs(n, recs, m->tmp + m->lo)) == NULL) m->error = 1;
+    else if (out != recs) memcpy(recs, out, n * sizeof(*recs));
+    return 0;
+}
+
+// Merges recs[lo, mid) and recs[mid, hi) into tmp[lo, hi).
+static void *mem_merge_worker(void *data)
+{
+    mem_sort_t *m = (mem_sort_t*)data;
+    merge_recs(m->recs, m->tmp, m->lo, m->mid, m->hi);
+    return 0;
+}
+
+// Returns 0 for success, -1 on allocation failure.
+static int mem_sort_bmf(size_t n, bam1_p *buf, int n_threads)
+{
+    size_t i;
+    int t, m, width, ret = -1;
+    bmf_sort_rec_t *recs, *tmp, *swap;
+    mem_sort_t *w;
+    pthread_t *tid;
+    if (n_threads < 2 || n < (size_t)(n_threads << 6)) return radix_sort_bmf(n, buf);
+    recs = (bmf_sort_rec_t*)malloc(n * sizeof(bmf_sort_rec_t));
+    tmp = (bmf_sort_rec_t*)malloc(n * sizeof(bmf_sort_rec_t));
+    w = (mem_sort_t*)calloc(n_threads, sizeof(mem_sort_t));
+    tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+    if (!recs || !tmp || !w || !tid) goto end;
+#define SLICE(x) (n * (size_t)((x) < n_threads ? (x): n_threads) / n_threads)
+    for (t = 0; t < n_threads; ++t) {
+        w[t].recs = recs, w[t].tmp = tmp, w[t].buf = buf;
+        w[t].lo = SLICE(t), w[t].hi = SLICE(t + 1);
+        pthread_create(&tid[t], NULL, mem_sort_worker, &w[t]);
+    }
+    for (t = 0; t < n_threads; ++t) pthread_join(tid[t], 0);
+    for (t = 0; t < n_threads; ++t) if (w[t].error) goto end;
+    for (width = 1; width < n_threads; width <<= 1) {
+        for (t = m = 0; t < n_threads; t += width << 1, ++m) {
+            w[m].recs = recs, w[m].tmp = tmp;
+            w[m].lo = SLICE(t), w[m].mid = SLICE(t + width), w[m].hi = SLICE(t + (width << 1));
+            pthread_create(&tid[m], NULL, mem_merge_worker, &w[m]);
+        }
+        while (m--) pthread_join(tid[m], 0);
+        swap = recs, recs = tmp, tmp = swap;
+    }
+#undef SLICE
+    for (i = 0; i < n; ++i) buf[i] = recs[i].b;
+    ret = 0;
+ end:
+    free(recs); free(tmp); free(w); free(tid);
+    return ret;
+}
+
+/*
+ * Temporary sorted runs. TMP_BGZF and TMP_RAW are written as BAM through htslib.
+ * TMP_LZ writes records in their in-memory layout (core, l_data, data), packed into blocks,
+ * each preceded by its uncompressed and stored lengths and compressed with lz_block
+ * unless that does not make it smaller. Runs are only ever read back by this process.
+ */
+enum tmp_codec {
+    TMP_BGZF,
+    TMP_RAW,
+    TMP_LZ
+};
+
+static int g_tmp_codec = TMP_BGZF;
+
+#define TMP_LZ_BLOCK_SIZE (1 << 20)
+#define TMP_INDEX_INTERVAL (1 << 14) // Records between seek points in BAM runs. LZ runs mark each block.
+
+// Seek point in a run: the key of the record written at off.
+typedef struct {
+    uint64_t key, mkey;
+    int64_t off; // BGZF virtual offset or, for TMP_LZ, the file offset of a block.
+} run_mark_t;
+
+typedef struct {
+    run_mark_t *a;
+    size_t n, m;
+} run_index_t;
+
+typedef struct {
+    samFile *fp; // TMP_BGZF and TMP_RAW
+    FILE *lz; // TMP_LZ
+    uint8_t *block, *zblock;
+    size_t l, m, off; // Bytes used, block capacity, and read offset
+    int is_write;
+    uint64_t n_written;
+    run_index_t *idx; // If set, seek points are added while writing.
+} tmp_run_t;
+
+static int run_index_add(run_index_t *idx, const bam1_t *b, int64_t off)
+{
+    if (idx->n == idx->m) {
+        run_mark_t *a;
+        size_t m = idx->m ? idx->m << 1: 64;
+        if ((a = (run_mark_t*)realloc(idx->a, m * sizeof(run_mark_t))) == NULL) return -1;
+        idx->a = a, idx->m = m;
+    }
+    sort_keys((bam1_p)b, &idx->a[idx->n].key, &idx->a[idx->n].mkey);
+    idx->a[idx->n++].off = off;
+    return 0;
+}
+
+static int tmp_run_reserve(tmp_run_t *r, size_t m)
+{
+    uint8_t *block, *zblock;
+    if (m <= r->m) return 0;
+    if ((block = (uint8_t*)realloc(r->block, m)) == NULL) return -1;
+    r->block = block;
+    if ((zblock = (uint8_t*)realloc(r->zblock, lzb_bound(m))) == NULL) return -1;
+    r->zblock = zblock;
+    r->m = m;
+    return 0;
+}
+
+static int tmp_run_close(tmp_run_t *r);
+
+static tmp_run_t *tmp_run_open(const char *fn, int is_write, const bam_hdr_t *h)
+{
+    tmp_run_t *r = (tmp_run_t*)calloc(1, sizeof(tmp_run_t));
+    bam_hdr_t *tmp;
+    if (r == NULL) return NULL;
+    r->is_write = is_write;
+    if (g_tmp_codec == TMP_LZ) {
+        if ((r->lz = fopen(fn, is_write ? "wb": "rb")) == NULL || tmp_run_reserve(r, TMP_LZ_BLOCK_SIZE)) goto fail;
+    } else if (is_write) {
+        if ((r->fp = sam_open(fn, g_tmp_codec == TMP_RAW ? "wbu": "wbx1")) == NULL) goto fail;
+        if (sam_hdr_write(r->fp, h) != 0) goto fail;
+    } else {
+        if ((r->fp = sam_open(fn, "r")) == NULL || (tmp = sam_hdr_read(r->fp)) == NULL) goto fail;
+        bam_hdr_destroy(tmp);
+    }
+    return r;
+ fail:
+    tmp_run_close(r);
+    return NULL;
+}
+
+static int tmp_run_flush(tmp_run_t *r)
+{
+    uint32_t lens[2];
+    size_t zlen;
+    if (r->l == 0) return 0;
+    zlen = lzb_compress(r->block, r->l, r->zblock, lzb_bound(r->m));
+    lens[0] = r->l;
+    lens[1] = zlen && zlen < r->l ? zlen: r->l;
+    if (fwrite(lens, sizeof(lens), 1, r->lz) != 1 ||
+        fwrite(lens[1] < lens[0] ? r->zblock: r->block, 1, lens[1], r->lz) != lens[1]) return -1;
+    r->l = 0;
+    return 0;
+}
+
+static int tmp_run_write1(tmp_run_t *r, const bam_hdr_t *h, const bam1_t *b)
+{
+    const size_t need = sizeof(bam1_core_t) + sizeof(int32_t) + b->l_data;
+    const int32_t l_data = b->l_data;
+    if (r->fp) {
+        if (r->idx && r->n_written++ % TMP_INDEX_INTERVAL == 0 &&
+            run_index_add(r->idx, b, bgzf_tell(r->fp->fp.bgzf)) < 0) return -1;
+        return sam_write1(r->fp, h, b) < 0 ? -1: 0;
+    }
+    if (r->l + need > r->m && tmp_run_flush(r) < 0) return -1;
+    if (need > r->m && tmp_run_reserve(r, need) < 0) return -1;
+    if (r->idx && r->l == 0 && run_index_add(r->idx, b, ftello(r->lz)) < 0) return -1;
+    memcpy(r->block + r->l, &b->core, sizeof(bam1_core_t));
+    memcpy(r->block + r->l + sizeof(bam1_core_t), &l_data, sizeof(int32_t));
+    memcpy(r->block + r->l + sizeof(bam1_core_t) + sizeof(int32_t), b->data, b->l_data);
+    r->l += need;
+    return 0;
+}
+
+// Returns >= 0 on success, -1 at the end of the run, and < -1 on error.
+static int tmp_run_read1(tmp_run_t *r, bam_hdr_t *h, bam1_t *b)
+{
+    uint32_t lens[2];
+    int32_t l_data;
+    if (r->fp) return sam_read1(r->fp, h, b);
+    if (r->off == r->l) {
+        if (fread(lens, sizeof(lens), 1, r->lz) != 1) return feof(r->lz) ? -1: -2;
+        if (tmp_run_reserve(r, lens[0] > lens[1] ? lens[0]: lens[1]) < 0) return -2;
+        if (lens[1] == lens[0]) {
+            if (fread(r->block, 1, lens[0], r->lz) != lens[0]) return -2;
+        } else if (fread(r->zblock, 1, lens[1], r->lz) != lens[1] ||
+                   lzb_decompress(r->zblock, lens[1], r->block, r->m) != (long)lens[0]) return -2;
+        r->l = lens[0], r->off = 0;
+    }
+    if (r->l - r->off < sizeof(bam1_core_t) + sizeof(int32_t)) return -2;
+    memcpy(&b->core, r->block + r->off, sizeof(bam1_core_t));
+    memcpy(&l_data, r->block + r->off + sizeof(bam1_core_t), sizeof(int32_t));
+    r->off += sizeof(bam1_core_t) + sizeof(int32_t);
+    if (l_data < 0 || (size_t)l_data > r->l - r->off) return -2;
+    if (b->m_data < l_data) {
+        uint8_t *data;
+        b->m_data = l_data;
+        kroundup32(b->m_data);
+        if ((data = (uint8_t*)realloc(b->data, b->m_data)) == NULL) return -2;
+        b->data = data;
+    }
+    memcpy(b->data, r->block + r->off, l_data);
+    b->l_data = l_data;
+    r->off += l_data;
+    return 0;
+}
+
+static int tmp_run_seek(tmp_run_t *r, int64_t off)
+{
+    if (r->fp) return bgzf_seek(r->fp->fp.bgzf, off, SEEK_SET) < 0 ? -1: 0;
+    r->l = r->off = 0;
+    return fseeko(r->lz, off, SEEK_SET);
+}
+
+static int tmp_run_close(tmp_run_t *r)
+{
+    int ret = 0;
+    if (r->lz) {
+        if (r->is_write && tmp_run_flush(r) < 0) ret = -1;
+        if (fclose(r->lz) != 0) ret = -1;
+    }
+    if (r->fp && sam_close(r->fp) < 0) ret = -1;
+    free(r->block); free(r->zblock); free(r);
+    return ret;
+}
+
+// Returns 0 for success
+//        -1 for failure
+static int write_run(const char *fn, size_t l, bam1_p *buf, const bam_hdr_t *h, run_index_t *idx)
+{
+    size_t i;
+    tmp_run_t *r = tmp_run_open(fn, 1, h);
+    if (r == NULL) return -1;
+    r->idx = idx;
+    for (i = 0; i < l; ++i) {
+        if (tmp_run_write1(r, h, buf[i]) < 0) {
+            tmp_run_close(r);
+            return -1;
+        }
+    }
+    return tmp_run_close(r);
+}
+
+typedef struct {
+    uint64_t key, mkey;
+    int i; // Run index, so that equal keys keep their input order.
+} run_head_t;
+
+#define run_head_lt(a, b) ((a).key != (b).key ? (a).key > (b).key \
+                           : (a).mkey != (b).mkey ? (a).mkey > (b).mkey \
+                                                  : (a).i > (b).i)
+
+KSORT_INIT(runheap, run_head_t, run_head_lt)
+
+static inline int key_lt(uint64_t akey, uint64_t amkey, const run_head_t *b)
+{
+    return akey != b->key ? akey < b->key: amkey < b->mkey;
+}
+
+/*
+ * Reads the next record of run r whose key is in [lo, hi), setting *key and *mkey.
+ * lo and hi may be NULL for unbounded. Returns 0 on success, -1 once past hi or
+ * at the end of the run, and < -1 on error.
+ */
+static int tmp_run_next_in(tmp_run_t *r, bam_hdr_t *h, bam1_t *b, const run_head_t *lo, const run_head_t *hi,
+                           uint64_t *key, uint64_t *mkey)
+{
+    int ret;
+    do {
+        if ((ret = tmp_run_read1(r, h, b)) < 0) return ret;
+        sort_keys(b, key, mkey);
+    } while (lo && key_lt(*key, *mkey, lo));
+    return hi && !key_lt(*key, *mkey, hi) ? -1: 0;
+}
+
+/*
+ * Merges the records with keys in [lo, hi) from the sorted runs, passing each to write.
+ * If idx is given, each run is first seeked to its last seek point below lo.
+ * If keys is given, each record's keys are appended to it as a sort key index.
+ * Returns 0 for success, -1 for failure.
+ */
+static int merge_range(int n, char *const *fns, const run_index_t *idx, const run_head_t *lo, const run_head_t *hi,
+                       bam_hdr_t *h, int (*write)(void *, bam_hdr_t *, bam1_t *), void *out, FILE *keys)
+{
+    int i, r, ret = -1, n_live = 0;
+    size_t j;
+    tmp_run_t **runs = (tmp_run_t**)calloc(n, sizeof(tmp_run_t*));
+    bam1_t **heads = (bam1_t**)calloc(n, sizeof(bam1_t*));
+    run_head_t *heap = (run_head_t*)calloc(n, sizeof(run_head_t));
+    if (runs == NULL || heads == NULL || heap == NULL) goto end;
+    for (i = 0; i < n; ++i) {
+        if ((runs[i] = tmp_run_open(fns[i], 0, h)) == NULL) {
+            fprintf(stderr, "[bam_sort_core] failed to open temporary file \"%s\": %s\n", fns[i], strerror(errno));
+            goto end;
+        }
+        if (idx && lo) {
+            for (j = idx[i].n; j > 0 && !key_lt(idx[i].a[j - 1].key, idx[i].a[j - 1].mkey, lo); --j);
+            if (j > 0 && tmp_run_seek(runs[i], idx[i].a[j - 1].off) < 0) {
+                fprintf(stderr, "[bam_sort_core] failed to seek in temporary file \"%s\"\n", fns[i]);
+                goto end;
+            }
+        }
+        heads[i] = bam_init1();
+        if ((r = tmp_run_next_in(runs[i], h, heads[i], lo, hi, &heap[n_live].key, &heap[n_live].mkey)) >= 0) {
+            heap[n_live++].i = i;
+        } else if (r < -1) {
+            fprintf(stderr, "[bam_sort_core] failed to read temporary file \"%s\"\n", fns[i]);
+            goto end;
+        }
+    }
+    ks_heapmake(runheap, n_live, heap);
+    while (n_live) {
+        const int k = heap->i;
+        if (write(out, h, heads[k]) < 0) goto end;
+        if (keys && sort_keys_write1(keys, heap->key, heap->mkey) < 0) goto end;
+        if ((r = tmp_run_next_in(runs[k], h, heads[k], NULL, hi, &heap->key, &heap->mkey)) == -1) {
+            heap[0] = heap[--n_live];
+        } else if (r < -1) {
+            fprintf(stderr, "[bam_sort_core] failed to read temporary file \"%s\"\n", fns[k]);
+            goto end;
+        }
+        ks_heapadjust(runheap, 0, n_live, heap);
+    }
+    ret = 0;
+ end:
+    for (i = 0; i < n; ++i) {
+        if (runs && runs[i]) tmp_run_close(runs[i]);
+        if (heads && heads[i]) bam_destroy1(heads[i]);
+    }
+    free(runs); free(heads); free(heap);
+    return ret;
+}
+
+static int merge_write_sam(void *fp, bam_hdr_t *h, bam1_t *b)
+{
+    return sam_write1((samFile*)fp, h, b);
+}
+
+static int merge_write_bgzf(void *fp, bam_hdr_t *h, bam1_t *b)
+{
+    return bam_write1((BGZF*)fp, b);
+}
+
+typedef struct {
+    int n;
+    char *const *fns;
+    const run_index_t *idx;
+    const run_head_t *lo, *hi;
+    bam_hdr_t *h;
+    char fn[1024]; // Part file for this range.
+    char keys_fn[1032]; // Part of the sort key index for this range, if one is written.
+    const char *mode;
+    hts_tpool *pool;
+    int error;
+} range_worker_t;
+
+static void *range_worker(void *data)
+{
+    range_worker_t *w = (range_worker_t*)data;
+    BGZF *fp = bgzf_open(w->fn, w->mode);
+    FILE *keys = NULL;
+    w->error = 1;
+    if (fp == NULL) return 0;
+    if (*w->keys_fn && (keys = fopen(w->keys_fn, "wb")) == NULL) {
+        bgzf_close(fp);
+        return 0;
+    }
+    if (w->pool) bgzf_thread_pool(fp, w->pool, 0);
+    if (merge_range(w->n, w->fns, w->idx, w->lo, w->hi, w->h, merge_write_bgzf, fp, keys) == 0) w->error = 0;
+    if (bgzf_close(fp) < 0) w->error = 1;
+    if (keys && fclose(keys) != 0) w->error = 1;
+    return 0;
+}
+
+static int run_mark_cmp(const void *a, const void *b)
+{
+    const run_mark_t *ra = (const run_mark_t*)a, *rb = (const run_mark_t*)b;
+    if (ra->key != rb->key) return ra->key < rb->key ? -1: 1;
+    return ra->mkey != rb->mkey ? (ra->mkey < rb->mkey ? -1: 1): 0;
+}
+
+/*
+ * Splits the key space into n_threads ranges at quantiles of the runs' seek points
+ * and merges each range into its own BGZF part in parallel, compressing through a shared
+ * thread pool: the bmftools -@ pool if there is one, or a pool of n_threads otherwise. The parts are then concatenated after the header, dropping each part's EOF block.
+ * Sort key index parts, if any, are concatenated in the same order.
+ * Every range opens all n runs, so the number of ranges is capped to keep the open files under RLIMIT_NOFILE.
+ * Returns 0 for success, -1 for failure, and 1 if there are too few seek points or descriptors to split
+ * or the thread pool cannot be created, in which case the caller merges serially.
+ */
+static int merge_runs_parallel(int n, char *const *fns, const run_index_t *idx, const char *fnout,
+                               const char *modeout, bam_hdr_t *h, int n_threads, const char *prefix, FILE *keys)
+{
+    static const uint8_t BGZF_EOF[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+    int i, n_ranges = 0, ret = -1;
+    size_t j, n_marks = 0, len;
+    run_mark_t *marks;
+    run_head_t *bounds;
+    range_worker_t *w;
+    pthread_t *tid;
+    hts_tpool *pool, *own_pool = NULL;
+    BGZF *out;
+    char mode[8], *buf;
+    FILE *part;
+    struct rlimit lim;
+    int max_ranges = n_threads;
+    // Each range holds the n runs plus its part and key index part. Leave some room for everything else.
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur != RLIM_INFINITY) {
+        const rlim_t per_range = n + 2, avail = lim.rlim_cur > 64 ? lim.rlim_cur - 64: 0;
+        if (avail / per_range < (rlim_t)max_ranges) max_ranges = avail / per_range;
+    }
+    if (max_ranges < 2) {
+        fprintf(stderr, "[bam_sort_core] too many runs (%d) to merge key ranges in parallel under the open file limit\n", n);
+        return 1;
+    }
+    for (i = 0; i < n; ++i) n_marks += idx[i].n;
+    if (n_marks < (size_t)max_ranges << 2) return 1;
+    marks = (run_mark_t*)malloc(n_marks * sizeof(run_mark_t));
+    bounds = (run_head_t*)calloc(n_threads, sizeof(run_head_t));
+    w = (range_worker_t*)calloc(n_threads, sizeof(range_worker_t));
+    tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+    buf = (char*)malloc(1 << 20);
+    if (!marks || !bounds || !w || !tid || !buf) goto end;
+    for (i = 0, n_marks = 0; i < n; ++i)
+        for (j = 0; j < idx[i].n; ++j) marks[n_marks++] = idx[i].a[j];
+    qsort(marks, n_marks, sizeof(run_mark_t), run_mark_cmp);
+    // bounds[r] is the inclusive lower bound of range r + 1. Identical quantiles are collapsed.
+    for (i = 1; i < max_ranges; ++i) {
+        const run_mark_t *q = marks + n_marks * i / max_ranges;
+        if (n_ranges && q->key == bounds[n_ranges - 1].key && q->mkey == bounds[n_ranges - 1].mkey) continue;
+        bounds[n_ranges].key = q->key, bounds[n_ranges++].mkey = q->mkey;
+    }
+    ++n_ranges;
+    snprintf(mode, sizeof(mode), "w%s", modeout + 2); // Keep the output compression level.
+    if ((pool = bmf_thread_pool()) == NULL && (pool = own_pool = hts_tpool_init(n_threads)) == NULL) {
+        fprintf(stderr, "[bam_sort_core] failed to create a thread pool; merging serially\n");
+        ret = 1;
+        goto end;
+    }
+    fprintf(stderr, "[bam_sort_core] merging %d key ranges in parallel...\n", n_ranges);
+    for (i = 0; i < n_ranges; ++i) {
+        w[i].n = n, w[i].fns = fns, w[i].idx = idx, w[i].h = h, w[i].mode = mode, w[i].pool = pool;
+        w[i].lo = i ? bounds + i - 1: NULL;
+        w[i].hi = i < n_ranges - 1 ? bounds + i: NULL;
+        snprintf(w[i].fn, sizeof(w[i].fn), "%s.merge.%.4d.bam", prefix, i);
+        if (keys) snprintf(w[i].keys_fn, sizeof(w[i].keys_fn), "%s.merge.%.4d.keys", prefix, i);
+        pthread_create(&tid[i], NULL, range_worker, &w[i]);
+    }
+    for (i = 0; i < n_ranges; ++i) pthread_join(tid[i], 0);
+    for (i = 0; i < n_ranges; ++i) {
+        if (w[i].error) {
+            fprintf(stderr, "[bam_sort_core] failed to merge into \"%s\"\n", w[i].fn);
+            goto cleanup;
+        }
+    }
+    if ((out = bgzf_open(fnout, mode)) == NULL || bam_hdr_write(out, h) < 0 || bgzf_flush(out) < 0) {
+        fprintf(stderr, "[bam_sort_core] failed to create \"%s\": %s\n", fnout, strerror(errno));
+        if (out) bgzf_close(out);
+        goto cleanup;
+    }
+    for (i = 0; i < n_ranges; ++i) {
+        int64_t size, copied = 0;
+        if ((part = fopen(w[i].fn, "rb")) == NULL || fseeko(part, 0, SEEK_END) < 0 || (size = ftello(part)) < 0) {
+            fprintf(stderr, "[bam_sort_core] failed to read \"%s\"\n", w[i].fn);
+            if (part) fclose(part);
+            bgzf_close(out);
+            goto cleanup;
+        }
+        // Every part ends with an empty EOF block, which only belongs at the end of the output.
+        if (size >= (int64_t)sizeof(BGZF_EOF)) size -= sizeof(BGZF_EOF);
+        rewind(part);
+        while (copied < size && (len = fread(buf, 1, size - copied < (1 << 20) ? size - copied: (1 << 20), part)) > 0) {
+            if (bgzf_raw_write(out, buf, len) != (ssize_t)len) break;
+            copied += len;
+        }
+        fclose(part);
+        if (copied != size) {
+            fprintf(stderr, "[bam_sort_core] failed to copy \"%s\" to \"%s\"\n", w[i].fn, fnout);
+            bgzf_close(out);
+            goto cleanup;
+        }
+    }
+    ret = bgzf_close(out) < 0 ? -1: 0;
+    for (i = 0; keys && ret == 0 && i < n_ranges; ++i) {
+        if ((part = fopen(w[i].keys_fn, "rb")) == NULL) ret = -1;
+        else {
+            while ((len = fread(buf, 1, 1 << 20, part)) > 0)
+                if (fwrite(buf, 1, len, keys) != len) break;
+            if (ferror(part) || len) ret = -1;
+            fclose(part);
+        }
+        if (ret < 0) fprintf(stderr, "[bam_sort_core] failed to copy sort key index part \"%s\"\n", w[i].keys_fn);
+    }
+ cleanup:
+    for (i = 0; i < n_ranges; ++i) {
+        unlink(w[i].fn);
+        if (keys) unlink(w[i].keys_fn);
+    }
+    if (own_pool) hts_tpool_destroy(own_pool);
+ end:
+    free(marks); free(bounds); free(w); free(tid); free(buf);
+    return ret;
+}
+
+/*
+ * Merges sorted temporary runs written by sort_blocks into the final output.
+ * All runs share the sort header, so no header or tid translation is needed.
+ * With multiple threads and BAM output, key ranges are merged in parallel.
+ * If keys is given, a sort key index is written to it alongside the output.
+ * Returns 0 for success, -1 for failure.
+ */
+static int merge_runs(int n, char *const *fns, const run_index_t *idx, const char *fnout, const char *modeout,
+                      bam_hdr_t *h, int n_threads, const htsFormat *out_fmt, const char *prefix, FILE *keys)
+{
+    int ret;
+    samFile *out;
+    if (n_threads > 1 && strncmp(modeout, "wb", 2) == 0 &&
+        (out_fmt == NULL || out_fmt->format == unknown_format || out_fmt->format == bam) &&
+        (ret = merge_runs_parallel(n, fns, idx, fnout, modeout, h, n_threads, prefix, keys)) <= 0)
+        return ret;
+    if ((out = sam_open_format(fnout, modeout, out_fmt)) == NULL) {
+        fprintf(stderr, "[bam_sort_core] failed to create \"%s\": %s\n", fnout, strerror(errno));
+        return -1;
+    }
+    sort_set_threads(out, n_threads);
+    if (sam_hdr_write(out, h) != 0) {
+        sam_close(out);
+        return -1;
+    }
+    ret = merge_range(n, fns, NULL, NULL, NULL, h, merge_write_sam, out, keys);
+    if (sam_close(out) < 0) ret = -1;
+    if (ret < 0) fprintf(stderr, "[bam_sort_core] failed to merge into \"%s\"\n", fnout);
+    return ret;
+}
 
 typedef struct {
     size_t buf_len;
     const char *prefix;
     bam1_p *buf;
     const bam_hdr_t *h;
+    run_index_t *idx;
     int index;
     int error;
 } worker_t;
 
 // Returns 0 for success
 //        -1 for failure
-static int write_buffer(const char *fn, const char *mode, size_t l, bam1_p *buf, const bam_hdr_t *h, int n_threads, const htsFormat *fmt)
+// If keys is given, each record's keys are appended to it as a sort key index.
+static int write_buffer(const char *fn, const char *mode, size_t l, bam1_p *buf, const bam_hdr_t *h, int n_threads, const htsFormat *fmt,
+                        FILE *keys)
 {
     size_t i;
+    uint64_t key, mkey;
     samFile* fp;
     fp = sam_open_format(fn, mode, fmt);
     if (fp == NULL) return -1;
     if (sam_hdr_write(fp, h) != 0) goto fail;
-    if (n_threads > 1) hts_set_threads(fp, n_threads);
+    sort_set_threads(fp, n_threads);
     for (i = 0; i < l; ++i) {
         if (sam_write1(fp, h, buf[i]) < 0) goto fail;
+        if (keys) {
+            sort_keys(buf[i], &key, &mkey);
+            if (sort_keys_write1(keys, key, mkey) < 0) goto fail;
+        }
     }
     if (sam_close(fp) < 0) return -1;
     return 0;
@@ -1654,11 +2318,11 @@ static void *worker(void *data)
     worker_t *w = (worker_t*)data;
     char *name;
     w->error = 0;
-    ks_mergesort(sort, w->buf_len, w->buf, 0);
+    if (radix_sort_bmf(w->buf_len, w->buf) < 0) { w->error = errno; return 0; }
     name = (char*)calloc(strlen(w->prefix) + 20, 1);
     if (!name) { w->error = errno; return 0; }
     sprintf(name, "%s.%.4d.bam", w->prefix, w->index);
-    if (write_buffer(name, "wbx1", w->buf_len, w->buf, w->h, 0, NULL) < 0)
+    if (write_run(name, w->buf_len, w->buf, w->h, w->idx) < 0)
         w->error = errno;
 
 // Consider using CRAM temporary files if the final output is CRAM.
@@ -1668,14 +2332,15 @@ static void *worker(void *data)
 //        {"no_ref",      CRAM_OPT_NO_REF,  {1},     NULL}
 //    };
 //    opt[0].next = &opt[1];
-//    if (write_buffer(name, "wc1", w->buf_len, w->buf, w->h, 0, opt) < 0)
+//    if (write_buffer(name, "wc1", w->buf_len, w->buf, w->h, 0, opt, NULL) < 0)
 //        w->error = errno;
 
     free(name);
     return 0;
 }
 
-static int sort_blocks(int n_files, size_t k, bam1_p *buf, const char *prefix, const bam_hdr_t *h, int n_threads)
+static int sort_blocks(int n_files, size_t k, bam1_p *buf, const char *prefix, const bam_hdr_t *h, int n_threads,
+                       run_index_t **idx)
 {
     int i;
     size_t rest;
@@ -1691,6 +2356,8 @@ static int sort_blocks(int n_files, size_t k, bam1_p *buf, const char *prefix, c
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
     w = (worker_t*)calloc(n_threads, sizeof(worker_t));
     tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+    *idx = (run_index_t*)realloc(*idx, (n_files + n_threads) * sizeof(run_index_t));
+    memset(*idx + n_files, 0, n_threads * sizeof(run_index_t));
     b = buf; rest = k;
     for (i = 0; i < n_threads; ++i) {
         w[i].buf_len = rest / (n_threads - i);
@@ -1698,6 +2365,7 @@ static int sort_blocks(int n_files, size_t k, bam1_p *buf, const char *prefix, c
         w[i].prefix = prefix;
         w[i].h = h;
         w[i].index = n_files + i;
+        w[i].idx = *idx + n_files + i;
         b += w[i].buf_len; rest -= w[i].buf_len;
         pthread_create(&tid[i], &attr, worker, &w[i]);
     }
@@ -1721,73 +2389,226 @@ static int sort_blocks(int n_files, size_t k, bam1_p *buf, const char *prefix, c
   @param  prefix   prefix of the temporary files (prefix.NNNN.bam are written)
   @param  fnout    name of the final output file to be written
   @param  modeout  sam_open() mode to be used to create the final output file
-  @param  max_mem  approxiate maximum memory (very inaccurate)
+  @param  max_mem  maximum memory for record data, its index and sort scratch, per thread.
+                   Ignored if g_total_mem is set.
   @param  in_fmt   input file format options
   @param  out_fmt  output file format and options
   @return 0 for successful sorting, negative on errors
 
   @discussion It may create multiple temporary subalignment files
-  and then merge them by calling bam_merge_core2(). This function is
+  and then merge them by calling merge_runs(). This function is
   NOT thread safe.
+
+  Record data is packed back-to-back into a single slab, indexed by an array
+  of bam1_t whose data pointers point into the slab. Neither is reallocated
+  per record. The bytes actually used by the slab, the allocated index, and
+  the scratch the sort threads will need for the records are counted against
+  max_mem, so peak usage does not depend on the thread count.
+  max_mem is split between two such buffers: while one is sorted and spilled
+  in the background, the other is filled from the input. The first buffer is
+  held until both are full, so input which fits in max_mem is sorted in
+  memory across all threads and written directly, without temporary files.
+  Once the second buffer is half full, the held one is spilled in the
+  background but kept, so that reading does not stall if the second fills.
+  That spill is discarded if the input ends first.
  */
 
 #define SORT_KEY "positional_rescue"
 
+static size_t g_total_mem = 0; // If set (-M), the memory budget for the whole sort, regardless of thread count.
+static const char *g_key_index = NULL; // If set (-K), path for a sort key index aligned with the output.
+
+typedef struct {
+    uint8_t *slab;
+    size_t slab_size, slab_used;
+    bam1_t *recs;
+    bam1_p *buf;
+    size_t k, max_k;
+    size_t limit; // Bytes this buffer may use, as counted by sort_buf_bytes().
+} sort_buf_t;
+
+static const size_t SORT_REC_INDEX = sizeof(bam1_t) + sizeof(bam1_p);
+// Keys and swap space for sort_recs(), plus the combined index for an in-memory sort.
+static const size_t SORT_REC_SCRATCH = 2 * sizeof(bmf_sort_rec_t) + sizeof(bam1_p);
+
+// Bytes used by sb once a further l_data bytes in n_recs records are added.
+static inline size_t sort_buf_bytes(const sort_buf_t *sb, size_t l_data, size_t n_recs)
+{
+    const size_t k = sb->k + n_recs;
+    return sb->slab_used + l_data + (k > sb->max_k ? k: sb->max_k) * SORT_REC_INDEX + k * SORT_REC_SCRATCH;
+}
+
+static inline int sort_buf_full(const sort_buf_t *sb, const bam1_t *b)
+{
+    return sb->k && sort_buf_bytes(sb, b->l_data, 1) > sb->limit;
+}
+
+// Returns 0 on success, -1 on allocation failure.
+static int sort_buf_add(sort_buf_t *sb, const bam1_t *b)
+{
+    if (sb->slab_used + b->l_data > sb->slab_size) { // Only possible for a single record larger than the buffer.
+        uint8_t *slab;
+        assert(sb->k == 0);
+        if ((slab = (uint8_t*)realloc(sb->slab, b->l_data)) == NULL) return -1;
+        sb->slab = slab, sb->slab_size = b->l_data;
+    }
+    if (sb->k == sb->max_k) {
+        bam1_t *recs;
+        bam1_p *buf;
+        size_t used = sort_buf_bytes(sb, b->l_data, 1) - (sb->k + 1) * SORT_REC_INDEX, fit;
+        sb->max_k = sb->max_k? sb->max_k<<1 : 0x10000;
+        // Only grow the index as far as the limit allows.
+        fit = used < sb->limit ? (sb->limit - used) / SORT_REC_INDEX: 0;
+        if (sb->max_k > fit) sb->max_k = fit > sb->k ? fit: sb->k + 1;
+        if ((recs = (bam1_t*)realloc(sb->recs, sb->max_k * sizeof(bam1_t))) == NULL) return -1;
+        sb->recs = recs;
+        if ((buf = (bam1_p*)realloc(sb->buf, sb->max_k * sizeof(bam1_p))) == NULL) return -1;
+        sb->buf = buf;
+    }
+    memcpy(sb->slab + sb->slab_used, b->data, b->l_data);
+    sb->recs[sb->k] = *b;
+    sb->recs[sb->k].data = sb->slab + sb->slab_used;
+    sb->recs[sb->k].m_data = b->l_data;
+    sb->slab_used += b->l_data;
+    ++sb->k;
+    return 0;
+}
+
+// Points buf at the records, which may have moved since they were added.
+static void sort_buf_index(sort_buf_t *sb)
+{
+    size_t i;
+    for (i = 0; i < sb->k; ++i) sb->buf[i] = sb->recs + i;
+}
+
+static void sort_buf_free(sort_buf_t *sb)
+{
+    free(sb->slab); free(sb->recs); free(sb->buf);
+    memset(sb, 0, sizeof(*sb));
+}
+
+typedef struct {
+    sort_buf_t *sb;
+    int n_files;
+    const char *prefix;
+    const bam_hdr_t *h;
+    int n_threads;
+    run_index_t **idx;
+    int ret; // sort_blocks() return value.
+} spill_t;
+
+static void *spill_worker(void *data)
+{
+    spill_t *s = (spill_t*)data;
+    s->ret = sort_blocks(s->n_files, s->sb->k, s->sb->buf, s->prefix, s->h, s->n_threads, s->idx);
+    return 0;
+}
+
 int bam_sort_core_ext(int l_cmpkey, const char *fn, const char *prefix,
                       const char *fnout, const char *modeout,
                       size_t _max_mem, int n_threads,
                       const htsFormat *in_fmt, const htsFormat *out_fmt)
 {
-    int ret = -1, i, n_files = 0;
-    size_t mem, max_k, k, max_mem;
+    int ret = -1, i, n_files = 0, spilling = 0, speculative = 0;
+    size_t max_mem, buf_mem;
     bam_hdr_t *header = NULL;
     samFile *fp;
-    bam1_t *b, **buf;
+    bam1_t *b;
+    sort_buf_t bufs[2], *cur = bufs;
+    spill_t spill;
+    pthread_t spill_tid;
+    run_index_t *idx = NULL; // Seek points for each temporary file, for parallel merging.
+    FILE *keys = NULL;
 
     if (n_threads < 2) n_threads = 1;
     g_cmpkey = l_cmpkey;
-    max_k = k = 0; mem = 0;
-    max_mem = _max_mem * n_threads;
-    buf = NULL;
+    max_mem = g_total_mem ? g_total_mem: _max_mem * n_threads;
+    buf_mem = max_mem >> 1;
+    memset(bufs, 0, sizeof(bufs));
+    // Pages are only touched as records are packed, so small inputs do not pay for the full slabs.
+    for (i = 0; i < 2; ++i) {
+        bufs[i].limit = buf_mem;
+        bufs[i].slab = (uint8_t*)malloc(bufs[i].slab_size = buf_mem);
+    }
+    b = bam_init1();
     fp = sam_open_format(fn, "r", in_fmt);
     if (fp == NULL) {
         const char *message = strerror(errno);
         fprintf(stderr, "[bam_sort_core] fail to open '%s': %s\n", fn, message);
+        sort_buf_free(bufs); sort_buf_free(bufs + 1); bam_destroy1(b);
         return -2;
     }
+    if (bufs[0].slab == NULL || bufs[1].slab == NULL) {
+        fprintf(stderr, "[bam_sort_core] failed to allocate %lu bytes for the sort buffers\n", (unsigned long)max_mem);
+        goto err;
+    }
+    sort_set_threads(fp, n_threads);
     header = sam_hdr_read(fp);
     if (header == NULL) {
         fprintf(stderr, "[bam_sort_core] failed to read header for '%s'\n", fn);
         goto err;
     }
     change_SO(header, SORT_KEY);
+    if (g_key_index && ((keys = fopen(g_key_index, "wb")) == NULL ||
+                        sort_keys_write_header(keys, is_se ? SORT_KEYS_SE: 0) < 0)) {
+        fprintf(stderr, "[bam_sort_core] failed to create sort key index \"%s\": %s\n", g_key_index, strerror(errno));
+        goto err;
+    }
     uint64_t count = 0;
     // write sub files
     for (;;) {
-        if (k == max_k) {
-            size_t kk, old_max = max_k;
-            max_k = max_k? max_k<<1 : 0x10000;
-            buf = (bam1_t**)realloc(buf, max_k * sizeof(bam1_t*));
-            for (kk = old_max; kk < max_k; ++kk) buf[kk] = NULL;
-        }
-        if (buf[k] == NULL) buf[k] = bam_init1();
-        b = buf[k];
         if(++count % 1000000 == 0) LOG_INFO("%lu records read.\n", count);
         if ((ret = sam_read1(fp, header, b)) < 0) break;
-        if (b->l_data < b->m_data>>2) { // shrink
-            b->m_data = b->l_data;
-            kroundup32(b->m_data);
-            b->data = (uint8_t*)realloc(b->data, b->m_data);
-        }
-        mem += sizeof(bam1_t) + b->m_data + sizeof(void*) + sizeof(void*); // two sizeof(void*) for the data allocated to pointer arrays
-        ++k;
-        if (mem >= max_mem) {
-            n_files = sort_blocks(n_files, k, buf, prefix, header, n_threads);
-            if (n_files < 0) {
+        if (sort_buf_full(cur, b)) {
+            sort_buf_t *next = cur == bufs ? bufs + 1: bufs;
+            if (n_files == 0 && !spilling && next->k == 0) {
+                // Hold on to this buffer in case the rest of the input fits in the other.
+                cur = next;
+                goto add;
+            }
+            // The other buffer may still be spilling. Wait for it, then spill this one while refilling that.
+            if (spilling) {
+                pthread_join(spill_tid, 0);
+                spilling = speculative = 0;
+                if ((n_files = spill.ret) < 0) {
+                    ret = -1;
+                    goto err;
+                }
+                next->k = next->slab_used = 0;
+            } else if (next->k) { // Held, and this buffer filled before the held one could be spilled in the background.
+                sort_buf_index(next);
+                if ((n_files = sort_blocks(n_files, next->k, next->buf, prefix, header, n_threads, &idx)) < 0) {
+                    ret = -1;
+                    goto err;
+                }
+                next->k = next->slab_used = 0;
+            }
+            sort_buf_index(cur);
+            spill.sb = cur, spill.n_files = n_files, spill.prefix = prefix, spill.h = header;
+            spill.n_threads = n_threads, spill.idx = &idx, spill.ret = -1;
+            if (pthread_create(&spill_tid, NULL, spill_worker, &spill) != 0) {
+                fprintf(stderr, "[bam_sort_core] failed to start spill thread\n");
                 ret = -1;
                 goto err;
             }
-            mem = k = 0;
+            spilling = 1;
+            cur = next;
+        }
+    add:
+        if (sort_buf_add(cur, b) < 0) {
+            fprintf(stderr, "[bam_sort_core] failed to allocate memory for the sort buffer\n");
+            ret = -1;
+            goto err;
+        }
+        if (n_files == 0 && !spilling && (cur == bufs ? bufs + 1: bufs)->k &&
+            sort_buf_bytes(cur, 0, 0) > cur->limit >> 1) {
+            // The input may not fit after all. Spill the held buffer now, keeping its records in case it does.
+            sort_buf_t *held = cur == bufs ? bufs + 1: bufs;
+            sort_buf_index(held);
+            spill.sb = held, spill.n_files = 0, spill.prefix = prefix, spill.h = header;
+            spill.n_threads = n_threads, spill.idx = &idx, spill.ret = -1;
+            // If the thread cannot start, the held buffer is spilled once this one fills.
+            if (pthread_create(&spill_tid, NULL, spill_worker, &spill) == 0) spilling = speculative = 1;
         }
     }
     if (ret != -1) {
@@ -1795,22 +2616,63 @@ int bam_sort_core_ext(int l_cmpkey, const char *fn, const char *prefix,
         ret = -1;
         goto err;
     }
+    if (spilling) {
+        pthread_join(spill_tid, 0);
+        spilling = 0;
+        if ((n_files = spill.ret) < 0) {
+            ret = -1;
+            goto err;
+        }
+        if (speculative) {
+            // Everything fit, so drop the held buffer's runs and sort both buffers in memory.
+            char name[1024];
+            for (i = 0; i < n_files; ++i) {
+                snprintf(name, sizeof(name), "%s.%.4d.bam", prefix, i);
+                unlink(name);
+                free(idx[i].a);
+            }
+            free(idx), idx = NULL;
+            n_files = speculative = 0;
+        }
+    }
 
     // write the final output
-    if (n_files == 0) { // a single block
-        ks_mergesort(sort, k, buf, 0);
-        if (write_buffer(fnout, modeout, k, buf, header, n_threads, out_fmt) != 0) {
+    if (n_files == 0) { // everything fit in memory
+        // Index both buffers together, oldest records first, so that ties keep input order.
+        size_t k = 0, n = bufs[0].k + bufs[1].k, j;
+        bam1_p *all = (bam1_p*)malloc((n ? n: 1) * sizeof(bam1_p));
+        if (all == NULL) {
+            fprintf(stderr, "[bam_sort_core] failed to allocate the sort index\n");
+            ret = -1;
+            goto err;
+        }
+        for (i = 0; i < 2; ++i) {
+            sort_buf_t *sb = cur == bufs ? bufs + 1 - i: bufs + i;
+            for (j = 0; j < sb->k; ++j) all[k++] = sb->recs + j;
+        }
+        if (mem_sort_bmf(n, all, n_threads) < 0) {
+            fprintf(stderr, "[bam_sort_core] failed to allocate sort keys: %s\n", strerror(errno));
+            free(all);
+            ret = -1;
+            goto err;
+        }
+        if (write_buffer(fnout, modeout, n, all, header, n_threads, out_fmt, keys) != 0) {
             fprintf(stderr, "[bam_sort_core] failed to create \"%s\": %s\n", fnout, strerror(errno));
+            free(all);
             ret = -1;
             goto err;
         }
+        free(all);
     } else { // then merge
         char **fns;
-        n_files = sort_blocks(n_files, k, buf, prefix, header, n_threads);
+        sort_buf_index(cur);
+        n_files = sort_blocks(n_files, cur->k, cur->buf, prefix, header, n_threads, &idx);
         if (n_files == -1) {
             ret = -1;
             goto err;
         }
+        // Release the sort buffers before merging.
+        sort_buf_free(bufs); sort_buf_free(bufs + 1);
         fprintf(stderr, "[bam_sort_core] merging from %d files...\n", n_files);
         fns = (char**)calloc(n_files, sizeof(char*));
         for (i = 0; i < n_files; ++i) {
@@ -1818,11 +2680,8 @@ int bam_sort_core_ext(int l_cmpkey, const char *fn, const char *prefix,
             sprintf(fns[i], "%s.%.4d.bam", prefix, i);
         }
         assert(l_cmpkey == g_cmpkey);
-        if (bam_merge_core2(l_cmpkey, fnout, modeout, NULL, n_files, fns,
-                            MERGE_COMBINE_RG|MERGE_COMBINE_PG|MERGE_FIRST_CO,
-                            NULL, n_threads, in_fmt, out_fmt) < 0) {
-            // Propagate bam_merge_core2() failure; it has already emitted a
-            // message explaining the failure, so no further message is needed.
+        if (merge_runs(n_files, fns, idx, fnout, modeout, header, n_threads, out_fmt, prefix, keys) < 0) {
+            // merge_runs() has already emitted a message explaining the failure.
             goto err;
         }
         for (i = 0; i < n_files; ++i) {
@@ -1835,9 +2694,16 @@ int bam_sort_core_ext(int l_cmpkey, const char *fn, const char *prefix,
     ret = 0;
 
  err:
-    // free
-    for (k = 0; k < max_k; ++k) bam_destroy1(buf[k]);
-    free(buf);
+    // free. Records in the buffers point into their slabs, so they are not destroyed individually.
+    if (spilling) pthread_join(spill_tid, 0);
+    if (keys && fclose(keys) != 0 && ret == 0) {
+        fprintf(stderr, "[bam_sort_core] failed to write sort key index \"%s\"\n", g_key_index);
+        ret = -1;
+    }
+    sort_buf_free(bufs); sort_buf_free(bufs + 1);
+    for (i = 0; i < n_files; ++i) free(idx[i].a);
+    free(idx);
+    bam_destroy1(b);
     bam_hdr_destroy(header);
     sam_close(fp);
     return ret;
@@ -1861,11 +2727,18 @@ static void sort_usage(FILE *fp)
 "Options:\n"
 "  -l INT     Set compression level, from 0 (uncompressed) to 9 (best)\n"
 "  -m INT     Set maximum memory per thread; suffix K/M/G recognized [768M]\n"
+"             Split between two buffers so that reading overlaps sorting and spilling.\n"
+"  -M INT     Set total memory for the sort, shared by all threads; overrides -m.\n"
+"             Suffix K/M/G recognized.\n"
 "  -o FILE    Write final output to FILE rather than standard output\n"
 "  -T PREFIX  Write temporary files to PREFIX.nnnn.bam\n"
+"  -K FILE    Write each output record's sort keys to FILE, for use by rsq -K\n"
 "  -@, --threads INT\n"
 "             Set number of sorting and compression threads [1]\n"
-"   -S        Single-end mode.\n");
+"   -S        Single-end mode.\n"
+"  --tmp-codec STR\n"
+"             Codec for temporary files: bgzf (BAM, level 1), raw (uncompressed BAM),\n"
+"             or lz (fast in-tree LZ block codec) [bgzf]\n");
     sam_global_opt_help(fp, "-.O..");
 }
 
@@ -1882,29 +2755,29 @@ int sort_main(int argc, char *argv[])
         SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 0),
         { "threads", required_argument, NULL, '@' },
         { "single-end", no_argument, NULL, 'S' },
+        { "tmp-codec", required_argument, NULL, 1 },
         { NULL, 0, NULL, 0 }
     };
 
-    while ((c = getopt_long(argc, argv, "l:m:o:O:T:@:Sh?", lopts, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "l:m:M:o:O:T:K:@:Sh?", lopts, NULL)) >= 0) {
         switch (c) {
         case 'o': fnout = optarg; o_seen = 1; break;
-        case 'm': {
-                char *q;
-                max_mem = strtol(optarg, &q, 0);
-                switch(*q) {
-                case 'g': case 'G':
-                    max_mem <<= 10; /* fall-through */
-                case 'm': case 'M':
-                    max_mem <<= 10; /* fall-through */
-                case 'k': case 'K':
-                    max_mem <<= 10;
-                }
-                break;
-            }
+        case 'm': max_mem = parse_memory_string(optarg); break;
+        case 'M': g_total_mem = parse_memory_string(optarg); break;
+        case 'K': g_key_index = optarg; break;
         case 'S': is_se = 1; break;
         case 'T': kputs(optarg, &tmpprefix); break;
         case '@': n_threads = atoi(optarg); break;
         case 'l': level = atoi(optarg); break;
+        case 1:
+            if (strcmp(optarg, "bgzf") == 0) g_tmp_codec = TMP_BGZF;
+            else if (strcmp(optarg, "raw") == 0) g_tmp_codec = TMP_RAW;
+            else if (strcmp(optarg, "lz") == 0) g_tmp_codec = TMP_LZ;
+            else {
+                fprintf(stderr, "[bam_sort] Unrecognized temporary file codec '%s'\n", optarg);
+                sort_usage(stderr); ret = EXIT_FAILURE; goto sort_end;
+            }
+            break;
         default:  if (parse_sam_global_opt(c, optarg, lopts, &ga) == 0) break;
                   /* else fall-through */
         case 'h': case '?': sort_usage(stderr); ret = EXIT_FAILURE; goto sort_end;
@@ -1936,6 +2809,9 @@ int sort_main(int argc, char *argv[])
     sam_open_mode(modeout+1, fnout, NULL);
     if (level >= 0) sprintf(strchr(modeout, '\0'), "%d", level < 9? level : 9);
 
+    // Without -@, follow bmftools -@.
+    if (n_threads == 0) n_threads = bmf_thread_pool_size();
+
     if (tmpprefix.l == 0) {
         if (strcmp(fnout, "-") != 0) ksprintf(&tmpprefix, "%s.tmp", fnout);
         else kputc('.', &tmpprefix);
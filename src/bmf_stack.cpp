@@ -1,4 +1,5 @@
 #include "bmf_stack.h"
+#include "bmf_threads.h"
 
 #include <getopt.h>
 #include <algorithm>
@@ -344,6 +345,9 @@ int stack_main(int argc, char *argv[]) {
                          outvcf, vh, conf);
     bcf_hdr_destroy(vh);
     bam_hdr_destroy(hdr);
+    bmf_thread_pool_attach(aux.tumor.fp);
+    bmf_thread_pool_attach(aux.normal.fp);
+    bmf_thread_pool_attach(aux.vcf.vcf);
     if(!(aux.fai = fai_load(refpath))) LOG_EXIT("failed to open fai. Abort!\n");
     LOG_DEBUG("Bedpath: %s.\n", bedpath);
     if(!(aux.bed = dlib::parse_bed_hash(bedpath, aux.tumor.header, padding)))
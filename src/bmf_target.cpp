@@ -1,22 +1,19 @@
+#include "bmf_target.h"
+#include <algorithm>
+#include <vector>
 #include "dlib/compiler_util.h"
 #include "dlib/bam_util.h"
 #include "dlib/bed_util.h"
+#include "lib/bam_shard.h"
+#include "lib/bed_cursor.h"
+#include "bmf_qc.h"
+#include "bmf_threads.h"
 #define __STDC_FORMAT_MACROS
 #include <cinttypes>
 #include <getopt.h>
 
 namespace bmf {
 
-struct target_counts_t {
-    uint64_t count;
-    uint64_t n_skipped;
-    uint64_t target;
-    uint64_t rfm_count;
-    uint64_t rfm_target;
-    uint64_t raw_count;
-    uint64_t raw_target;
-};
-
 int target_usage(int retcode)
 {
     fprintf(stderr,
@@ -28,93 +25,273 @@ int target_usage(int retcode)
                     "-m\tSet minimum mapping quality for inclusion.\n"
                     "-p\tSet padding - number of bases around target region to consider as on-target. Default: 0.\n"
                     "-n\tSet notification interval - number of reads between logging statements. Default: 1000000.\n"
+                    "-o\tWrite to <path> instead of stdout.\n"
+                    "-i\tCount on-target reads by querying the index for each bed interval, and off-target reads\n"
+                    "\tfrom the stretches between intervals and the unplaced records, so that each record is read once.\n"
+                    "\tQueries are split across the threads set by bmftools -@. Requires an indexed bam.\n"
             );
     exit(retcode);
     return retcode; // This never happens.
 }
 
+/* Counts b, whose FM tag (or 1 if it has none) is FM. Returns 0 if b was skipped, 1 otherwise. */
+static inline int target_add(target_counts_t &counts, bam1_t *b, int FM, BedCursor &bed, uint32_t minmq)
+{
+    if((b->core.qual < minmq) || (b->core.flag & (3844))) { // 3844 is unmapped, secondary, supplementary, qcfail, duplicate
+        ++counts.n_skipped;
+        return 0;
+    }
+    const int test(bed.test(b));
+    ++counts.count;
+    counts.target += test;
+    counts.raw_count += FM;
+    counts.raw_target += FM * test;
+    if(FM > 1) {
+        counts.rfm_target += test;
+        ++counts.rfm_count;
+    }
+    return 1;
+}
+
+static void target_write(const target_counts_t &counts, FILE *ofp, uint32_t padding, uint32_t minmq)
+{
+    fprintf(ofp, "Number of reads skipped: %" PRIu64 "\n", counts.n_skipped);
+    fprintf(ofp, "Number of real FM reads total: %" PRIu64 "\n", counts.rfm_count);
+    fprintf(ofp, "Number of real FM reads on target: %" PRIu64 "\n", counts.rfm_target);
+    fprintf(ofp, "Number of reads total: %" PRIu64 "\n", counts.count);
+    fprintf(ofp, "Number of reads on target: %" PRIu64 "\n", counts.target);
+    fprintf(ofp, "Fraction of dmp reads on target with padding of %u bases and %i minmq: %0.12f\n",
+            padding, minmq, (double)counts.target / counts.count);
+    fprintf(ofp, "Fraction of raw reads on target with padding of %u bases and %i minmq: %0.12f\n",
+            padding, minmq, (double)counts.raw_target / counts.raw_count);
+    fprintf(ofp, "Fraction of families of size >= 2 on target with padding of %u bases and %i minmq: %0.12f\n",
+            padding, minmq, (double)counts.rfm_target / counts.rfm_count);
+}
+
+static BedCursor target_bed(char *bedpath, bam_hdr_t *hdr, uint32_t padding)
+{
+    khash_t(bed) *hash(dlib::parse_bed_hash(bedpath, hdr, padding));
+    BedCursor ret(hash);
+    dlib::bed_destroy_hash(hash);
+    return ret;
+}
+
 target_counts_t target_core(char *bedpath, char *bampath, uint32_t padding, uint32_t minmq, uint64_t notification_interval)
 {
     dlib::BamHandle handle(bampath);
-    khash_t(bed) *bed(dlib::parse_bed_hash(bedpath, handle.header, padding));
+    bmf_thread_pool_attach(handle.fp);
+    BedCursor bed(target_bed(bedpath, handle.header, padding));
     target_counts_t counts{0};
     uint8_t *data;
-    int test;
     while (LIKELY(handle.next() >= 0)) {
-        if((handle.rec->core.qual < minmq) || (handle.rec->core.flag & (3844))) { // 3844 is unmapped, secondary, supplementary, qcfail, duplicate
-            ++counts.n_skipped;
-            continue;
-        }
         const int FM(((data = bam_aux_get(handle.rec, "FM")) != nullptr) ? bam_aux2i(data): 1);
-        test = dlib::bed_test(handle.rec, bed);
-        if(UNLIKELY(++counts.count % notification_interval == 0))
+        if(target_add(counts, handle.rec, FM, bed, minmq) &&
+           UNLIKELY(counts.count % notification_interval == 0))
             LOG_INFO("Number of records processed: %" PRIu64 ".\n", counts.count);
-        counts.target += test;
-        counts.raw_count += FM;
-        counts.raw_target += FM * test;
-        if(FM > 1) {
-            counts.rfm_target += test;
-            ++counts.rfm_count;
-        }
     }
-    dlib::bed_destroy_hash(bed);
     return counts;
 }
 
+// Longest off-target stretch queried as one job by target_core_indexed.
+static const int64_t TARGET_GAP_LEN(1 << 22);
 
-int target_main(int argc, char *argv[])
+// Splits the off-target stretch [beg, end) of tid into jobs for target_core_indexed.
+static void add_target_gaps(std::vector<BamShard> &gaps, int tid, int64_t beg, int64_t end)
 {
-    char *bedpath(nullptr);
-    uint32_t padding((uint32_t)-1), minmq(0);
-    uint64_t notification_interval(1000000);
-    FILE *ofp(stdout);
+    for(int64_t stop; beg < end; beg = stop) {
+        stop = std::min(beg + TARGET_GAP_LEN, end);
+        gaps.push_back(BamShard{tid, (int)beg, (int)stop});
+    }
+}
 
+/* Interval of a query in target_core_indexed. */
+struct target_window_t {
+    int tid;
+    int beg;
+    int end;
+    int prev_end; // Furthest end of the earlier windows on tid, whose reads have been counted there.
+};
 
-    if(argc < 4) return target_usage(EXIT_SUCCESS);
+/*
+ * Counts what target_core does. Reads overlapping the bed intervals come from index queries on the intervals.
+ * The off-target remainder comes from the stretches between them, where each read is taken
+ * from the stretch it starts in unless it overlaps an interval, and from the unplaced records.
+ */
+target_counts_t target_core_indexed(char *bedpath, char *bampath, uint32_t padding, uint32_t minmq, int n_threads)
+{
+    target_counts_t ret{0};
+    khash_t(bed) *bed;
+    std::vector<target_window_t> windows;
+    std::vector<BamShard> gaps;
+    int n_targets;
+    std::vector<int64_t> target_len;
+    {
+        ShardReader probe(bampath);
+        if(!probe.ok()) LOG_EXIT("Could not open %s and its index. target -i requires an indexed bam. Abort!\n", bampath);
+        bed = dlib::parse_bed_hash(bedpath, probe.hdr, padding);
+        n_targets = probe.hdr->n_targets;
+        target_len.assign(probe.hdr->target_len, probe.hdr->target_len + n_targets);
+    }
+    for(khiter_t k: dlib::make_sorted_keys(bed)) {
+        const size_t start(windows.size());
+        for(uint64_t i(0); i < kh_val(bed, k).n; ++i) {
+            // The index and BedCursor agree on overlap, so the query returns every read the cursor accepts.
+            windows.push_back(target_window_t{(int)kh_key(bed, k),
+                                              (int)get_start(kh_val(bed, k).intervals[i]),
+                                              (int)get_stop(kh_val(bed, k).intervals[i]), 0});
+        }
+        std::sort(windows.begin() + start, windows.end(),
+                  [](const target_window_t &a, const target_window_t &b) {return a.beg < b.beg;});
+        int prev_end(-1);
+        for(auto it(windows.begin() + start); it != windows.end(); ++it)
+            it->prev_end = prev_end, prev_end = std::max(prev_end, it->end);
+    }
+    std::vector<int64_t> covered(n_targets, 0);
+    for(const target_window_t &w: windows) {
+        if(w.tid < 0 || w.tid >= n_targets) continue;
+        add_target_gaps(gaps, w.tid, covered[w.tid], w.beg);
+        covered[w.tid] = std::max(covered[w.tid], (int64_t)w.end);
+    }
+    for(int tid(0); tid < n_targets; ++tid) add_target_gaps(gaps, tid, covered[tid], target_len[tid]);
+    gaps.push_back(BamShard{HTS_IDX_NOCOOR, 0, 0});
+    std::vector<target_counts_t> counts(n_threads, target_counts_t{0});
+    const int n_windows(windows.size()), n_jobs(n_windows + gaps.size());
+    LOG_DEBUG("Querying %s for %i intervals and %lu off-target stretches with %i threads.\n",
+              bampath, n_windows, gaps.size(), n_threads);
+    #pragma omp parallel num_threads(n_threads)
+    {
+        ShardReader reader(bampath);
+        BedCursor cursor(bed);
+        target_counts_t &c(counts[omp_get_thread_num()]);
+        uint8_t *data;
+        if(UNLIKELY(!reader.ok())) LOG_EXIT("Could not open %s and its index. Abort!\n", bampath);
+        #pragma omp for schedule(dynamic, 1)
+        for(int i = 0; i < n_jobs; ++i) {
+            if(i >= n_windows) {
+                const BamShard &s(gaps[i - n_windows]);
+                if(UNLIKELY(reader.read(s, [&](bam1_t *b) {
+                    if(cursor.test(b)) return; // Counted with the interval it overlaps.
+                    const int FM(((data = bam_aux_get(b, "FM")) != nullptr) ? bam_aux2i(data): 1);
+                    target_add(c, b, FM, cursor, minmq);
+                }) < 0))
+                    LOG_EXIT("Failed to read %i:%i-%i of %s. Truncated file? Abort!\n", s.tid, s.beg, s.end, bampath);
+                continue;
+            }
+            const target_window_t &w(windows[i]);
+            // A read overlapping several windows is counted at the first, which it must overlap if it starts before prev_end.
+            if(UNLIKELY(reader.query(w.tid, w.beg, w.end, [&](bam1_t *b) {
+                if(b->core.pos < w.prev_end) return;
+                const int FM(((data = bam_aux_get(b, "FM")) != nullptr) ? bam_aux2i(data): 1);
+                target_add(c, b, FM, cursor, minmq);
+            }) < 0))
+                LOG_EXIT("Failed to read %i:%i-%i of %s. Truncated file? Abort!\n", w.tid, w.beg, w.end, bampath);
+        }
+    }
+    for(const target_counts_t &c: counts) {
+        ret.count += c.count;
+        ret.n_skipped += c.n_skipped;
+        ret.target += c.target;
+        ret.rfm_count += c.rfm_count;
+        ret.rfm_target += c.rfm_target;
+        ret.raw_count += c.raw_count;
+        ret.raw_target += c.raw_target;
+    }
+    dlib::bed_destroy_hash(bed);
+    return ret;
+}
 
-    if(strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) return target_usage(EXIT_SUCCESS);
+struct target_opts_t {
+    char *bedpath;
+    uint32_t padding;
+    uint32_t minmq;
+    uint64_t notification_interval;
+    FILE *ofp;
+    int indexed;
+};
 
+/* Parses target's options and returns the index of the first positional argument. */
+static int target_parse(int argc, char *argv[], target_opts_t *opts)
+{
     int c;
-    while ((c = getopt(argc, argv, "m:b:p:n:o:h?")) >= 0) {
+    while ((c = getopt(argc, argv, "m:b:p:n:o:ih?")) >= 0) {
         switch (c) {
-        case 'm': minmq = strtoul(optarg, nullptr, 0); break;
-        case 'b': bedpath = optarg; break;
-        case 'o': ofp = fopen(optarg, "r"); break;
-        case 'p': padding = strtoul(optarg, nullptr, 0); break;
-        case 'n': notification_interval = strtoull(optarg, nullptr, 0); break;
+        case 'i': opts->indexed = 1; break;
+        case 'm': opts->minmq = strtoul(optarg, nullptr, 0); break;
+        case 'b': opts->bedpath = optarg; break;
+        case 'o':
+            if((opts->ofp = fopen(optarg, "w")) == nullptr)
+                LOG_EXIT("Could not open %s for writing. Abort!\n", optarg);
+            break;
+        case 'p': opts->padding = strtoul(optarg, nullptr, 0); break;
+        case 'n': opts->notification_interval = strtoull(optarg, nullptr, 0); break;
         case '?': case 'h': return target_usage(EXIT_SUCCESS);
         }
     }
 
 
-    if(padding == (uint32_t)-1) {
+    if(opts->padding == (uint32_t)-1) {
         LOG_INFO("Padding not set. Setting to default (%u).\n", DEFAULT_PADDING);
-        padding = DEFAULT_PADDING;
+        opts->padding = DEFAULT_PADDING;
+    }
+    return optind;
+}
+
+
+class TargetReport: public QcReport {
+    target_opts_t opts;
+    BedCursor bed;
+    target_counts_t counts;
+public:
+    TargetReport(const target_opts_t &_opts, bam_hdr_t *hdr):
+        QcReport("target"), opts(_opts), bed(target_bed(opts.bedpath, hdr, opts.padding)), counts{0} {}
+    ~TargetReport() {
+        if(opts.ofp) fclose(opts.ofp);
     }
+    void add(bam1_t *b, const BmfTags &tags) override {
+        target_add(counts, b, tags.itag(BmfTags::FM, 1), bed, opts.minmq);
+    }
+    // Honors target's own -o, writing to fp only without it.
+    bool uses_stdout() const override {return opts.ofp == nullptr;}
+    void write(FILE *fp) override {target_write(counts, opts.ofp ? opts.ofp: fp, opts.padding, opts.minmq);}
+};
+
+
+QcReport *target_qc(int argc, char *argv[], char *bampath)
+{
+    target_opts_t opts{nullptr, (uint32_t)-1, 0, 1000000, nullptr};
+    if(target_parse(argc, argv, &opts) != argc || !opts.bedpath) {
+        fprintf(stderr, "[E:%s] Bed path required for bmftools target. See usage.\n", __func__);
+        target_usage(EXIT_FAILURE);
+    }
+    if(opts.indexed) LOG_EXIT("target -i queries the index by region and cannot share a streaming pass. Abort!\n");
+    dlib::BamHandle handle(bampath);
+    return new TargetReport(opts, handle.header);
+}
+
+
+int target_main(int argc, char *argv[])
+{
+    target_opts_t opts{nullptr, (uint32_t)-1, 0, 1000000, stdout};
+    if(argc < 4) return target_usage(EXIT_SUCCESS);
+
+    if(strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) return target_usage(EXIT_SUCCESS);
+
+    target_parse(argc, argv, &opts);
 
     if (argc != optind+1)
         return target_usage((argc == optind) ?  EXIT_SUCCESS: EXIT_FAILURE);
 
-    if(!bedpath) {
+    if(!opts.bedpath) {
         fprintf(stderr, "[E:%s] Bed path required for bmftools target. See usage.\n", __func__);
         return target_usage(EXIT_FAILURE);
     }
 
-    target_counts_t counts(target_core(bedpath, argv[optind], padding, minmq, notification_interval));;
-
-    fprintf(ofp, "Number of reads skipped: %" PRIu64 "\n", counts.n_skipped);
-    fprintf(ofp, "Number of real FM reads total: %" PRIu64 "\n", counts.rfm_count);
-    fprintf(ofp, "Number of real FM reads on target: %" PRIu64 "\n", counts.rfm_target);
-    fprintf(ofp, "Number of reads total: %" PRIu64 "\n", counts.count);
-    fprintf(ofp, "Number of reads on target: %" PRIu64 "\n", counts.target);
-    fprintf(ofp, "Fraction of dmp reads on target with padding of %u bases and %i minmq: %0.12f\n",
-            padding, minmq, (double)counts.target / counts.count);
-    fprintf(ofp, "Fraction of raw reads on target with padding of %u bases and %i minmq: %0.12f\n",
-            padding, minmq, (double)counts.raw_target / counts.raw_count);
-    fprintf(ofp, "Fraction of families of size >= 2 on target with padding of %u bases and %i minmq: %0.12f\n",
-            padding, minmq, (double)counts.rfm_target / counts.rfm_count);
+    const target_counts_t counts(opts.indexed
+        ? target_core_indexed(opts.bedpath, argv[optind], opts.padding, opts.minmq, std::max(1, bmf_thread_pool_size()))
+        : target_core(opts.bedpath, argv[optind], opts.padding, opts.minmq, opts.notification_interval));
+    target_write(counts, opts.ofp, opts.padding, opts.minmq);
     LOG_INFO("Successfully completed bmftools target!\n");
-    fclose(ofp);
+    fclose(opts.ofp);
     return EXIT_SUCCESS;
 }
 
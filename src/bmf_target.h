@@ -1,5 +1,6 @@
 #ifndef BMF_TARGET_H
 #define BMF_TARGET_H
+#include <cstdint>
 
 namespace bmf {
 struct target_counts_t {
@@ -8,9 +9,12 @@ struct target_counts_t {
     uint64_t target;
     uint64_t rfm_count;
     uint64_t rfm_target;
+    uint64_t raw_count;
+    uint64_t raw_target;
 };
 
 target_counts_t target_core(char *bedpath, char *bampath, uint32_t padding, uint32_t minmq, uint64_t notification_interval);
+target_counts_t target_core_indexed(char *bedpath, char *bampath, uint32_t padding, uint32_t minmq, int n_threads);
 } /* namespace bmf */
 
 #endif /* ifndef BMF_TARGET_H */
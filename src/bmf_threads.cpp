@@ -0,0 +1,43 @@
+#include "bmf_threads.h"
+#include "htslib/thread_pool.h"
+
+static htsThreadPool pool{nullptr, 0};
+static int pool_size(0);
+
+int bmf_thread_pool_init(int n_threads)
+{
+    if(n_threads <= 1 || pool.pool) return 0;
+    if((pool.pool = hts_tpool_init(n_threads)) == nullptr) return -1;
+    pool_size = n_threads;
+    return 0;
+}
+
+void bmf_thread_pool_destroy(void)
+{
+    if(!pool.pool) return;
+    hts_tpool_destroy(pool.pool);
+    pool.pool = nullptr;
+    pool_size = 0;
+}
+
+int bmf_thread_pool_size(void)
+{
+    return pool_size;
+}
+
+hts_tpool *bmf_thread_pool(void)
+{
+    return pool.pool;
+}
+
+int bmf_thread_pool_attach(htsFile *fp)
+{
+    if(!pool.pool || !fp) return 0;
+    return hts_set_thread_pool(fp, &pool) ? -1: 0;
+}
+
+int bmf_thread_pool_attach_bgzf(BGZF *fp)
+{
+    if(!pool.pool || !fp) return 0;
+    return bgzf_thread_pool(fp, pool.pool, pool.qsize) ? -1: 0;
+}
@@ -0,0 +1,34 @@
+#ifndef BMF_THREADS_H
+#define BMF_THREADS_H
+#include "htslib/hts.h"
+#include "htslib/bgzf.h"
+#include "htslib/thread_pool.h"
+
+/*
+ * Process-wide htslib thread pool, created from `bmftools -@ INT <subcommand>` before dispatch.
+ * Subcommands attach every bam/vcf handle they open, so BGZF compression and decompression
+ * for all of a command's inputs and outputs share one set of workers.
+ * Without -@ (or with -@ 1), no pool exists and attaching is a no-op.
+ * Declared extern "C" so that sort, which is C, can use them too.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Creates the pool. Returns 0 on success, -1 on failure. */
+int bmf_thread_pool_init(int n_threads);
+void bmf_thread_pool_destroy(void);
+/* Number of threads in the pool, or 0 if there is none. */
+int bmf_thread_pool_size(void);
+/* The pool itself, for code which drives BGZF streams directly, or NULL if there is none. */
+hts_tpool *bmf_thread_pool(void);
+/* Attach the pool to fp, if one exists. Return 0 on success or if there is no pool, -1 on failure. */
+int bmf_thread_pool_attach(htsFile *fp);
+int bmf_thread_pool_attach_bgzf(BGZF *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BMF_THREADS_H */
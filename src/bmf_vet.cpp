@@ -9,6 +9,8 @@
 #include "dlib/vcf_util.h"
 #include "include/igamc_cephes.h"
 #include "htslib/tbx.h"
+#include "lib/bmf_tags.h"
+#include "bmf_threads.h"
 
 namespace bmf {
 
@@ -82,6 +84,7 @@ static int read_bam(void *data, bam1_t *b)
 {
     vetter_aux_t *aux((vetter_aux_t*)data); // data in fact is a pointer to an auxiliary structure
     int ret;
+    BmfTags tags;
     for(;;)
     {
         if(!aux->iter) LOG_EXIT("Need to access bam with index.\n");
@@ -94,9 +97,11 @@ static int read_bam(void *data, bam1_t *b)
         // Skip AF < minAF
         if ((b->core.flag & aux->skip_flag) ||
             (aux->skip_improper && ((b->core.flag & BAM_FPROPER_PAIR) == 0)) || // Skip improper if set.
-            (int)b->core.qual < aux->minmq ||
-            (bam_itag(b, "FP") == 0) || (aux->minAF && bam_aux2f(bam_aux_get(b, "AF")) < aux->minAF))
+            (int)b->core.qual < aux->minmq)
                 continue;
+        tags.parse(b);
+        if(tags.itag(BmfTags::FP) == 0 || (aux->minAF && tags.ftag(BmfTags::AF) < aux->minAF))
+            continue;
         break;
     }
     return ret;
@@ -189,15 +194,16 @@ void bmf_var_tests(bcf1_t *vrec, const bam_pileup1_t *plp, int n_plp, vetter_aux
         //LOG_DEBUG("Checking stack for reads with base %c.\n", allele);
         for(int i(0); i < n_plp; ++i) {
             if(plp[i].is_del || plp[i].is_refskip) continue;
-            if((tmptag = bam_aux_get(plp[i].b, "SK")) != nullptr) continue;
+            const BmfTags tags(plp[i].b);
+            if((tmptag = tags.get(BmfTags::SK)) != nullptr) continue;
 
             seq = bam_get_seq(plp[i].b);
-            FA1 = (uint32_t *)dlib::array_tag(plp[i].b, "FA");
-            PV1 = (uint32_t *)dlib::array_tag(plp[i].b, "PV");
+            FA1 = tags.array(BmfTags::FA);
+            PV1 = tags.array(BmfTags::PV);
             if(bam_seqi(seq, plp[i].qpos) == seq_nt16_table[(uint8_t)allele]) { // Match!
                 //LOG_DEBUG("Found read supporting allele '%i', '%c'.\n", bam_seqi(seq, plp[i].qpos), allele);
                 const int32_t arr_qpos1(dlib::arr_qpos(&plp[i]));
-                if(bam_itag(plp[i].b, "FM") < aux->minFM ||
+                if(tags.itag(BmfTags::FM) < aux->minFM ||
                    FA1[arr_qpos1] < aux->minFA ||
                         PV1[arr_qpos1] < aux->minPV ||
                         (double)FA1[arr_qpos1] / (tmptag ? bam_aux2i(tmptag): 1 ) < aux->min_fr) {
@@ -216,10 +222,9 @@ void bmf_var_tests(bcf1_t *vrec, const bam_pileup1_t *plp, int n_plp, vetter_aux
                     confident_phreds[j].push_back(PV1[arr_qpos1]);
                     qscore_sums[j] += PV1[arr_qpos1];
                     ++n_obs[j];
-                    if((tmptag = bam_aux_get(plp[i].b, "DR")) != nullptr)
-                        if(bam_aux2i(tmptag)) ++n_duplex[j]; // Has DR tag and its value is nonzero.
-                            //LOG_DEBUG("Found a duplex read!\n");
-                    if((tmptag = bam_aux_get(plp[i].b, "KR")) != nullptr) {
+                    if(tags.itag(BmfTags::DR)) ++n_duplex[j]; // Has DR tag and its value is nonzero.
+                    // KR is deleted below, which invalidates tags, so it is the last one read.
+                    if((tmptag = tags.get(BmfTags::KR)) != nullptr) {
                         ++n_overlaps[j];
                         bam_aux_del(plp[i].b, tmptag);
                     }
@@ -590,6 +595,7 @@ int vet_main(int argc, char *argv[])
     aux.fp = sam_open_format(argv[optind + 1], "r", &open_fmt);
     if(!aux.fp) LOG_EXIT("Could not open input bam %s. Abort!\n", argv[optind + 1]);
     aux.header = sam_hdr_read(aux.fp);
+    bmf_thread_pool_attach(aux.fp);
 
     // Open input vcf
     if(!aux.header || aux.header->n_targets == 0)
@@ -601,6 +607,7 @@ int vet_main(int argc, char *argv[])
 
     if((aux.vcf_fp = vcf_open(argv[optind], "r")) == nullptr) LOG_EXIT("Could not open input vcf (%s).\n", argv[optind]);
     if((aux.vcf_header = bcf_hdr_read(aux.vcf_fp)) == nullptr) LOG_EXIT("Could not read variant header from file (%s).\n", aux.vcf_fp->fn);
+    bmf_thread_pool_attach(aux.vcf_fp);
 
     // Add lines to header
     for(auto line: bmf_header_lines)
@@ -626,6 +633,7 @@ int vet_main(int argc, char *argv[])
 
     if((aux.vcf_ofp = vcf_open(outvcf, vcf_wmode)) == nullptr)
         LOG_EXIT("Could not open output vcf '%s' for writing. Abort!\n", outvcf);
+    bmf_thread_pool_attach(aux.vcf_ofp);
     bcf_hdr_write(aux.vcf_ofp, aux.vcf_header);
 
     // Open out vcf
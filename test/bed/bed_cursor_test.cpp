@@ -0,0 +1,30 @@
+#include <cassert>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "dlib/bam_util.h"
+#include "dlib/bed_util.h"
+#include "lib/bed_cursor.h"
+
+int main(int argc, char *argv[])
+{
+    dlib::BamHandle in("test/target_test.bam");
+    khash_t(bed) *bed(dlib::parse_bed_hash((char *)"test/target_test.bed", in.header, 0));
+    std::vector<bam1_t *> recs;
+    while(in.next() >= 0) recs.push_back(bam_dup1(in.rec));
+    // In file order, the cursor sweeps forward; shuffled, it must seek for most records.
+    bmf::BedCursor sorted(bed);
+    uint64_t n_on(0);
+    for(bam1_t *b: recs) {
+        assert(sorted.test(b) == dlib::bed_test(b, bed));
+        n_on += sorted.test(b);
+    }
+    assert(n_on > 0 && n_on < recs.size());
+    std::shuffle(recs.begin(), recs.end(), std::mt19937(137));
+    bmf::BedCursor shuffled(bed);
+    for(bam1_t *b: recs) assert(shuffled.test(b) == dlib::bed_test(b, bed));
+    for(bam1_t *b: recs) bam_destroy1(b);
+    dlib::bed_destroy_hash(bed);
+    fprintf(stderr, "[%s] All tests passed.\n", __FILE__);
+    return EXIT_SUCCESS;
+}
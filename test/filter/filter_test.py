@@ -0,0 +1,48 @@
+import sys
+import subprocess
+try:
+    import pysam
+except ImportError:
+    sys.stderr.write("Could not import pysam. Not running tests.\n")
+    sys.exit(0)
+
+inbam = "../target_test.bam"
+
+
+def key(read):
+    return (read.query_name, read.flag, read.reference_id, read.reference_start)
+
+
+def fm(read):
+    return read.get_tag("FM") if read.has_tag("FM") else 1
+
+
+def keys(path):
+    return [key(read) for read in pysam.AlignmentFile(path, "rb")]
+
+
+def main():
+    # The documented multi-output command: each quoted option set has its own output.
+    subprocess.check_call("../../bmftools_db filter -s 2 %s fm2.bam \"-s 3 fm3.bam\" "
+                          "\"-s 5 -m 20 -r fm5.fail.bam fm5.bam\" 2> filter_test.log" % inbam, shell=True)
+    reads = list(pysam.AlignmentFile(inbam, "rb"))
+    expected = {
+        "fm2.bam": [key(r) for r in reads if fm(r) >= 2],
+        "fm3.bam": [key(r) for r in reads if fm(r) >= 3],
+        "fm5.bam": [key(r) for r in reads if fm(r) >= 5 and r.mapping_quality >= 20],
+        "fm5.fail.bam": [key(r) for r in reads if not (fm(r) >= 5 and r.mapping_quality >= 20)],
+    }
+    ret = 0
+    for path, want in sorted(expected.items()):
+        found = keys(path)
+        if found != want:
+            sys.stderr.write("%s has %i records, expected %i. TEST FAILED\n" % (path, len(found), len(want)))
+            ret = 1
+    if len(expected["fm2.bam"]) == len(expected["fm3.bam"]):
+        sys.stderr.write("Family size thresholds 2 and 3 select the same records, so the test cannot tell them apart. TEST FAILED\n")
+        ret = 1
+    return ret
+
+
+if __name__ == "__main__":
+    sys.exit(main())
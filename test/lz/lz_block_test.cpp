@@ -0,0 +1,50 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "include/lz_block.h"
+
+static size_t roundtrip(const std::vector<uint8_t> &in)
+{
+    std::vector<uint8_t> z(lzb_bound(in.size())), out(in.size());
+    const size_t zlen(lzb_compress(in.data(), in.size(), z.data(), z.size()));
+    assert(zlen > 0);
+    const long len(lzb_decompress(z.data(), zlen, out.data(), out.size()));
+    assert(len == (long)in.size());
+    assert(out == in);
+    // Truncated input must be rejected rather than read past.
+    if(zlen > 1) {
+        std::vector<uint8_t> small(in.size() ? in.size() - 1: 0);
+        assert(lzb_decompress(z.data(), zlen, small.data(), small.size()) < 0 || in.size() == 0);
+    }
+    return zlen;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<uint8_t> buf;
+    roundtrip(buf);
+    // Incompressible.
+    srand(137);
+    for(int i(0); i < 1 << 16; ++i) buf.push_back(rand() & 0xff);
+    roundtrip(buf);
+    // Short inputs, below the match limits.
+    for(size_t n(1); n < 32; ++n) roundtrip(std::vector<uint8_t>(buf.begin(), buf.begin() + n));
+    // Runs and repeats, including overlapping matches and long extended lengths.
+    buf.assign(100000, 'A');
+    const size_t zlen(roundtrip(buf));
+    assert(zlen < buf.size() / 100);
+    buf.clear();
+    const char *recs[] = {"ACGTTGCAAGGCTTAA", "READNAME:1:1101:15589:1331", "IIIIIIIIIIIIIIIIIIIIII#"};
+    for(int i(0); i < 5000; ++i) {
+        for(const char *c = recs[rand() % 3]; *c; ++c) buf.push_back(*c);
+        buf.push_back(rand() & 0xff);
+    }
+    assert(roundtrip(buf) < buf.size() / 2);
+    // Corrupt offset.
+    const uint8_t bad[] = {0x10, 'A', 0x05, 0x00};
+    uint8_t out[64];
+    assert(lzb_decompress(bad, sizeof(bad), out, sizeof(out)) < 0);
+    fprintf(stderr, "Passed lz_block tests.\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,67 @@
+import sys
+import subprocess
+try:
+    import pysam
+except ImportError:
+    sys.stderr.write("Could not import pysam. Not running tests.\n")
+    sys.exit(0)
+
+inbam = "../target_test.bam"
+nsbam = "mark_test.ns.bam"
+
+
+def make_namesorted():
+    """
+    Writes the complete pairs of inbam grouped by name, with secondary and supplementary
+    copies of some reads, and returns the number of those copies.
+    """
+    src = pysam.AlignmentFile(inbam, "rb")
+    header = src.header.to_dict()
+    header["HD"]["SO"] = "queryname"
+    pairs = {}
+    for read in src:
+        pairs.setdefault(read.query_name, [None, None])[0 if read.is_read1 else 1] = read
+    n_extra = 0
+    with pysam.AlignmentFile(nsbam, "wb", header=header) as out:
+        for i, name in enumerate(sorted(pairs)):
+            r1, r2 = pairs[name]
+            if r1 is None or r2 is None:
+                continue
+            out.write(r1)
+            if i % 3 == 0:
+                secondary = pysam.AlignedSegment.fromstring(r1.to_string(), out.header)
+                secondary.flag |= 0x100
+                out.write(secondary)
+                n_extra += 1
+            out.write(r2)
+            if i % 5 == 0:
+                supplementary = pysam.AlignedSegment.fromstring(r2.to_string(), out.header)
+                supplementary.flag |= 0x800
+                out.write(supplementary)
+                n_extra += 1
+    return n_extra
+
+
+def records(path):
+    return [read.to_string() for read in pysam.AlignmentFile(path, "rb")]
+
+
+def main():
+    n_extra = make_namesorted()
+    # -@ 1 marks on the calling thread, -@ 4 in parallel batches of pairs.
+    for n in (1, 4):
+        subprocess.check_call("../../bmftools_db -@ %i mark -l 0 %s mark_test.%i.bam 2> mark_test.%i.log" % (n, nsbam, n, n),
+                              shell=True)
+    serial, batched = records("mark_test.1.bam"), records("mark_test.4.bam")
+    if serial != batched:
+        sys.stderr.write("mark -@ 4 wrote %i records, -@ 1 wrote %i, and they differ. TEST FAILED\n" % (len(batched), len(serial)))
+        return 1
+    written = sum(1 for read in pysam.AlignmentFile("mark_test.4.bam", "rb") if read.flag & 0x900)
+    if written != n_extra:
+        sys.stderr.write("%i of %i secondary and supplementary records were written. TEST FAILED\n" % (written, n_extra))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
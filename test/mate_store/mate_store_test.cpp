@@ -0,0 +1,50 @@
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include "lib/mate_store.h"
+#include "dlib/logging_util.h"
+
+static void run(size_t max_mem)
+{
+    bmf::MateStore store(max_mem, "mate_store_test");
+    uint64_t n_paired(0), n_mismatched(0);
+    auto check = [&](const char *key, const bmf::MateStore::entry_t &r1, const bmf::MateStore::entry_t &r2) {
+        if(std::string(r1.val, r1.len) != std::string(key) + (r1.flag ? "/2": "/1") ||
+           std::string(r2.val, r2.len) != std::string(key) + (r2.flag ? "/2": "/1") ||
+           r1.flag == r2.flag)
+            ++n_mismatched;
+        ++n_paired;
+    };
+    char buf[32];
+    const unsigned n(10000);
+    // Read 1s in order, then read 2s in reverse order, so that most mates have been spilled.
+    for(unsigned i(0); i < n; ++i) {
+        snprintf(buf, sizeof(buf), "read%u", i);
+        store.add(buf, std::string(buf) + "/1", 0, check);
+    }
+    assert(store.spills() > 0);
+    for(unsigned i(n); i--;) {
+        if(i % 100 == 0) continue; // Leave some orphans.
+        snprintf(buf, sizeof(buf), "read%u", i);
+        store.add(buf, std::string(buf) + "/2", 1, check);
+    }
+    uint64_t n_orphan_calls(0);
+    const uint64_t n_orphans(store.finish(check, [&](const char *, const bmf::MateStore::entry_t &e) {
+        assert(e.flag == 0);
+        ++n_orphan_calls;
+    }));
+    if(n_paired != n - n / 100 || n_orphans != n / 100 || n_orphan_calls != n_orphans || n_mismatched)
+        LOG_EXIT("Paired %lu, orphans %lu, mismatched %lu.\n", n_paired, n_orphans, n_mismatched);
+}
+
+int main(int argc, char *argv[])
+{
+    // Small enough to force several spills.
+    run(1 << 16);
+    // Small enough that the partitions must be split again to be joined.
+    run(1 << 11);
+    assert(parse_memory_string("2K") == 2048);
+    assert(parse_memory_string("3M") == 3uL << 20);
+    assert(parse_memory_string("100") == 100);
+    return EXIT_SUCCESS;
+}
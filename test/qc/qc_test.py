@@ -0,0 +1,35 @@
+import sys
+import subprocess
+
+inbam = "../target_test.bam"
+bed = "../target_test.bed"
+
+# Each report of qc, with the standalone subcommand whose output it must match.
+reports = [
+    ("famstats fm", "famstats_fm", "famstats fm %s" % inbam),
+    ("famstats frac 2", "famstats_frac", "famstats frac 2 %s" % inbam),
+    ("famstats frac 3", "famstats_frac", "famstats frac 3 %s" % inbam),
+    ("target -b %s" % bed, "target", "target -b %s %s" % (bed, inbam)),
+]
+
+
+def run(args):
+    return subprocess.check_output("../../bmftools_db %s 2>> qc_test.log" % args, shell=True)
+
+
+def main():
+    run("qc -o qc_test %s %s" % (inbam, " ".join("\"%s\"" % report for report, _, _ in reports)))
+    ret = 0
+    for i, (report, name, standalone) in enumerate(reports):
+        path = "qc_test.%i.%s.txt" % (i + 1, name)
+        with open(path, "rb") as f:
+            found = f.read()
+        expected = run(standalone)
+        if found != expected:
+            sys.stderr.write("qc report '%s' in %s differs from bmftools %s. TEST FAILED\n" % (report, path, standalone))
+            ret = 1
+    return ret
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -6,20 +6,54 @@ except ImportError:
     sys.stderr.write("Could not import pysam. Not running tests.\n")
     sys.exit(0)
 correct_string = "@CCATAATAACGCCAGTAT PV:B:I,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,104,98,78,93,104,98,79,104,79,78,91,93,102,91,78,79,93,93,98,79,104,104,104,93,93,79,79,79,93,93,93,104,104,79,79,98,104,104,104,104,98,102,78,79,79,93,79,93,96,79,91,102,98,93,79,93,93,78,91,91,93,98,78,79,91,91,91,78,79,79,104,98,102,93,93,96,91,93,93,98,79,93,79,91,104,76,76,78,104,79,93,93,79,78,91,78,79,91,78,79,93,102,104,104,102,79,91,91,104,61,65,65,67,67,67,67,67,67,67,67,26\tFA:B:I,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3\tFM:i:3\tFP:i:1\tRV:i:1\tNC:i:0\tNP:i:2\tDR:i:1\nNNNNNNNNNNNNNNNNAGCCTTGTGTTTCTGACAATATATTCTTCAACAGCAGCTAGAAAGTTGGTTCAAACCAACTTTTAATATACAGTAGTTCTTTTCATTTACATTTCAAAATATTTAACAAAGTCAAACTTTC\n+\n################IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIGGIIIIIIIIIIIIIIIIIIIIIIIGGIIIIIIIIA"
-def main():
-    subprocess.check_call("../../bmftools_db rsq -ftmp.fq rsq_test.bam rsq_test.out.bam 2> rsq_test.log", shell=True)
+
+
+def count(path):
     try:
-        assert(subprocess.check_output("samtools view -c rsq_test.out.bam", shell=True).strip() == "0")
-    except AssertionError:
-        assert(subprocess.check_output("samtools view -c rsq_test.out.bam", shell=True).strip().decode() == "0")
+        return int(subprocess.check_output("samtools view -c %s" % path, shell=True).strip())
+    except ValueError:
+        return int(subprocess.check_output("samtools view -c %s" % path, shell=True).strip().decode())
+
+
+def test_realign_all():
+    # With -r, every merged pair goes to the realignment fastq.
+    subprocess.check_call("../../bmftools_db rsq -r -ftmp.fq rsq_test.bam rsq_test.out.bam 2> rsq_test.log", shell=True)
+    assert count("rsq_test.out.bam") == 0
     recs = list(pysam.FastqFile("tmp.fq"))
     assert len(recs) == 2
-    try:
-        assert str(recs[0]) == correct_string
-        return 0
-    except AssertionError:
+    if str(recs[0]) != correct_string:
         sys.stderr.write("%s found not expected %s. TEST FAILED\n" % (repr(str(recs[0])), repr(correct_string)))
         return 1
+    return 0
+
+
+def test_keep_alignment():
+    # Without -r, the merged pair had no bases filled in (NC:i:0), so it keeps its alignment.
+    subprocess.check_call("../../bmftools_db rsq -ftmp.keep.fq rsq_test.bam rsq_test.keep.bam 2> rsq_test.keep.log",
+                          shell=True)
+    if len(list(pysam.FastqFile("tmp.keep.fq"))):
+        sys.stderr.write("Kept pair was also written for realignment. TEST FAILED\n")
+        return 1
+    recs = list(pysam.AlignmentFile("rsq_test.keep.bam", "rb"))
+    if len(recs) != 2:
+        sys.stderr.write("%i records kept, expected 2. TEST FAILED\n" % len(recs))
+        return 1
+    r1, r2 = (recs[0], recs[1]) if recs[0].is_read1 else (recs[1], recs[0])
+    assert r1.query_name == r2.query_name == "CCATAATAACGCCAGTAT"
+    assert r1.get_tag("FM") == r2.get_tag("FM") == 3
+    assert r1.get_tag("NC") == r2.get_tag("NC") == 0
+    for read, mate in ((r1, r2), (r2, r1)):
+        assert read.next_reference_id == mate.reference_id
+        assert read.next_reference_start == mate.reference_start
+        assert read.mate_is_reverse == mate.is_reverse
+        assert read.mate_is_unmapped == mate.is_unmapped
+        assert not read.has_tag("NM") and not read.has_tag("MD")
+    assert r1.template_length == -r2.template_length != 0
+    return 0
+
+
+def main():
+    return test_realign_all() or test_keep_alignment()
 
 
 if __name__ == "__main__":
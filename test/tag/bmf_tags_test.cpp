@@ -0,0 +1,62 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "htslib/sam.h"
+#include "lib/bmf_tags.h"
+
+using bmf::BmfTags;
+
+static const char *names[]{"FM", "FP", "RV", "DR", "NP", "MF", "AF", "PV", "FA", "KR", "SK"};
+
+// Every tag in the index must point where bam_aux_get does.
+static void check(const bam1_t *b)
+{
+    const BmfTags tags(b);
+    for(int i(0); i < BmfTags::N_TAGS; ++i)
+        assert(tags.get((BmfTags::tag_t)i) == bam_aux_get(b, names[i]));
+}
+
+int main()
+{
+    bam1_t *b(bam_init1());
+    check(b);
+    // Put tags of every type in front of and between the BMF tags, so that all must be skipped correctly.
+    const int8_t c(-3);
+    const uint16_t s(1000);
+    const int32_t i(42), fm(7);
+    const float f(0.75);
+    const double d(0.5);
+    bam_aux_append(b, "xc", 'c', sizeof(c), (uint8_t *)&c);
+    bam_aux_append(b, "FM", 'i', sizeof(fm), (uint8_t *)&fm);
+    bam_aux_append(b, "xs", 'S', sizeof(s), (uint8_t *)&s);
+    bam_aux_append(b, "xZ", 'Z', 6, (uint8_t *)"hello");
+    bam_aux_append(b, "AF", 'f', sizeof(f), (uint8_t *)&f);
+    bam_aux_append(b, "xd", 'd', sizeof(d), (uint8_t *)&d);
+    // B arrays: subtype, count, then the values.
+    uint8_t arr[5 + 4 * 4];
+    const uint32_t n(4), pv[4]{10, 20, 30, 40};
+    arr[0] = 'I';
+    memcpy(arr + 1, &n, sizeof(n));
+    memcpy(arr + 5, pv, sizeof(pv));
+    bam_aux_append(b, "PV", 'B', sizeof(arr), arr);
+    bam_aux_append(b, "xB", 'B', sizeof(arr), arr);
+    bam_aux_append(b, "FA", 'B', sizeof(arr), arr);
+    bam_aux_append(b, "FP", 'C', 1, (uint8_t *)&i);
+    bam_aux_append(b, "RV", 'i', sizeof(i), (uint8_t *)&i);
+    check(b);
+
+    const BmfTags tags(b);
+    assert(tags.itag(BmfTags::FM) == fm);
+    assert(tags.itag(BmfTags::RV) == i);
+    assert(tags.itag(BmfTags::FP) == (uint8_t)i);
+    assert(tags.itag(BmfTags::DR, -1) == -1);
+    assert(tags.ftag(BmfTags::AF) == f);
+    for(unsigned j(0); j < n; ++j)
+        assert(tags.array(BmfTags::PV)[j] == pv[j] && tags.array(BmfTags::FA)[j] == pv[j]);
+    assert(tags.array(BmfTags::PV)[-1] == n);
+    assert(tags.array(BmfTags::DR) == nullptr);
+    bam_destroy1(b);
+    fprintf(stderr, "[%s] All tests passed.\n", __FILE__);
+    return EXIT_SUCCESS;
+}
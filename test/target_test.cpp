@@ -1,10 +1,26 @@
 #define __STDC_LIMIT_MACROS
 #include <assert.h>
 #include <cstdint>
-//#include "htslib/sam.h"
+#include "htslib/sam.h"
 #include "src/bmf_target.h"
 #include "dlib/logging_util.h"
 
+// target -i must count each record exactly once, as the streaming pass does.
+static void check_indexed(uint32_t padding, uint32_t minmq)
+{
+    const bmf::target_counts_t counts(bmf::target_core((char *)"test/target_test.bed", (char *)"test/target_test.bam",
+                                                       padding, minmq, 1000000));
+    const bmf::target_counts_t indexed(bmf::target_core_indexed((char *)"test/target_test.bed", (char *)"test/target_test.bam",
+                                                                padding, minmq, 2));
+    assert(indexed.count == counts.count);
+    assert(indexed.n_skipped == counts.n_skipped);
+    assert(indexed.target == counts.target);
+    assert(indexed.rfm_count == counts.rfm_count);
+    assert(indexed.rfm_target == counts.rfm_target);
+    assert(indexed.raw_count == counts.raw_count);
+    assert(indexed.raw_target == counts.raw_target);
+}
+
 int main(int c, char **argv)
 {
     bmf::target_counts_t counts = bmf::target_core((char *)"test/target_test.bed", (char *)"test/target_test.bam", 0u, 0u, 1000000);
@@ -12,5 +28,11 @@ int main(int c, char **argv)
     assert(counts.n_skipped == 0uL);
     if(counts.target != 2006uL)
         LOG_EXIT("counts.target %lu rather than expected.\n", counts.target, 2006uL);
+    if(sam_index_build("test/target_test.bam", 0) < 0)
+        LOG_EXIT("Could not index test/target_test.bam.\n");
+    // Padding merges nearby intervals and widens the reads several windows see; minmq exercises skipped reads.
+    check_indexed(0u, 0u);
+    check_indexed(100u, 0u);
+    check_indexed(0u, 30u);
     return 0;
 }